@@ -0,0 +1,98 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "locker.h"
+
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024) /* size of a huge page, arena is a multiple of it */
+#define ARENA_BUFFER_BYTES (64 * 1024 * 1024) /* reserved for buffer pools besides connection slab */
+#define BUFFER_POOLS_MAX 4 /* buffer pools of a process, each thread caches for all */
+#define BUFFER_CACHE_MAX 64 /* free buffers a thread keeps, half goes back beyond it */
+#define BUFFER_REFILL 16 /* buffers a thread takes at once when its cache runs empty */
+
+namespace lu {
+
+/* memory reserved once on 2MB pages, so thousands of connctions & their
+ * buffers are covered by a few hundred tlb entries instead of tens of
+ * thousands. hugetlbfs pages first, transparent huge pages (madvise) if
+ * none are reserved, plain pages at last. allocation is a bump of offset,
+ * nothing is freed before the arena */
+class arena {
+public:
+    enum BACKING {
+        BACKING_HUGETLB = 0, /* explicit huge pages */
+        BACKING_THP, /* transparent huge pages, given by kernel as it can */
+        BACKING_PAGES /* regular pages */
+    };
+
+public:
+    /* reserve bytes rounded up to ARENA_HUGE_PAGE, throw if nothing can be mapped */
+    arena(size_t bytes);
+    ~arena();
+
+    /* size bytes aligned to align (power of 2), NULL when arena is used up */
+    void *alloc(size_t size, size_t align = 64);
+    /* is p inside arena */
+    inline bool owns(const void *p) const { 
+        return (const char *)p >= _base && (const char *)p < _base + _size;
+    }
+    inline BACKING backing() const { return _backing; }
+    const char *backing_name() const;
+    inline char *base() const { return _base; }
+    inline size_t size() const { return _size; }
+    inline size_t used() const { return _used.load(std::memory_order_relaxed); }
+    /* bytes of arena on huge pages now, from /proc/self/smaps */
+    size_t huge_bytes() const;
+
+private:
+    char *_base;
+    size_t _size;
+    std::atomic<size_t> _used; /* bump offset */
+    BACKING _backing;
+};
+
+/* fixed size buffers carved from an arena. each thread caches free buffers
+ * of every pool, so get & put take no lock until its cache runs empty or
+ * full. an empty cache takes a batch from the shared free list, or carves
+ * BUFFER_REFILL neighbouring ones out of arena (a sub-arena of the thread).
+ * buffers freed on another thread than they were got on stay with it. once
+ * arena is used up, buffers come from heap */
+class buffer_pool {
+public:
+    /* throw if there are BUFFER_POOLS_MAX pools already */
+    buffer_pool(arena *a, size_t size);
+    ~buffer_pool();
+
+    void *get();
+    void put(void *p);
+    inline size_t buffer_size() const { return _size; }
+    /* buffers that came from heap as arena was used up */
+    unsigned long spilled() const { return _spilled.load(std::memory_order_relaxed); }
+
+private:
+    struct node {
+        node *next;
+    };
+    struct cache {
+        node *head;
+        int count;
+    };
+    /* move n buffers of this thread's cache to shared list */
+    void give_back(cache &c, int n);
+
+private:
+    arena *_arena;
+    size_t _size; /* buffer size, rounded up to cache line */
+    int _id; /* index of this pool in thread caches */
+    node *_free; /* shared free list */
+    locker _locker; /* of shared free list */
+    std::atomic<unsigned long> _spilled;
+    static std::atomic<int> _pools; /* pools created */
+    static thread_local cache _caches[BUFFER_POOLS_MAX];
+};
+
+}
+
+#endif
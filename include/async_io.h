@@ -0,0 +1,42 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stddef.h>
+
+#include "threadpool.h"
+
+#define ASYNC_IO_THREADS 4 /* threads blocked on disk reads, apart from workers */
+#define ASYNC_IO_WINDOW (1024 * 1024) /* file bytes ahead of send offset checked & read in */
+
+namespace lu {
+
+/* disk reads of mapped files which are not in page cache, on threads of their
+ * own, so that a cold file never stalls the reactor or a working thread on a
+ * major fault. residency is checked with mincore, a read job faults the pages
+ * in & calls back, the caller goes on with the pages resident */
+class async_io {
+public:
+    /* read [addr, addr + len) of a mapping into page cache, then done(arg) */
+    struct job {
+        char *addr;
+        size_t len;
+        void (*done)(void *arg);
+        void *arg;
+        void process();
+    };
+
+public:
+    async_io(int thread_number = ASYNC_IO_THREADS);
+
+    /* is [addr, addr + len) of a mapping in page cache */
+    static bool resident(const char *addr, size_t len);
+    /* run j on an io thread, false if queue is full. j lives until done */
+    inline bool submit(job *j) { return _pool.append(j); }
+
+private:
+    threadpool<job> _pool;
+};
+
+}
+
+#endif
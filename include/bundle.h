@@ -0,0 +1,80 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "file_cache.h"
+
+#define BUNDLE_MAGIC "LUBUNDL1" /* 8 bytes at file head */
+#define BUNDLE_ALIGN 4096 /* bodies start on page boundary */
+
+namespace lu {
+
+/* document root packed into one file by asset_pack, mapped once at startup.
+ * layout : header | slots | entries | strings | bodies (page aligned)
+ * slots is an open addressing table (linear probing, load <= 1/2) of path
+ * hash => entry, so a lookup is one hash probe into the read-only mapping */
+class bundle {
+public:
+    struct header {
+        char magic[8]; /* BUNDLE_MAGIC */
+        uint32_t count; /* entries */
+        uint32_t slots; /* hash table size, power of 2 */
+        uint64_t size; /* file size */
+    };
+    struct slot {
+        uint64_t hash; /* hash of path */
+        uint32_t entry; /* entry index + 1, 0 is empty slot */
+        uint32_t reserved;
+    };
+    struct entry {
+        uint32_t path_off; /* url path like /images/a.jpg, offsets from file head */
+        uint32_t path_len;
+        uint32_t head_off; /* precomputed response headers, without Connection */
+        uint32_t head_len;
+        uint32_t gz_head_off; /* headers of gzip variant */
+        uint32_t gz_head_len;
+        uint64_t body_off; /* page aligned */
+        uint64_t body_len;
+        uint64_t gz_off; /* gzip variant, 0 if it is not smaller */
+        uint64_t gz_len;
+        int64_t mtime; /* of source file */
+    };
+
+public:
+    /* map bundle file, throw if it is not a valid bundle */
+    bundle(const char *path);
+    ~bundle();
+
+    /* file of url (query string ignored), gzip variant if client accepts it
+     * & there is one. NULL if url is not packed. the file is never released */
+    file_cache::entry *find(const char *url, bool gzip);
+    /* packed urls */
+    inline uint32_t count() const { return _header->count; }
+    /* mapping of whole bundle */
+    inline const char *data() const { return _data; }
+    inline size_t size() const { return _size; }
+
+    /* FNV-1a, shared by asset_pack */
+    static inline uint64_t hash(const char *s, size_t len) {
+        uint64_t h = 14695981039346656037ull;
+        for(size_t i = 0; i < len; i++) {
+            h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+private:
+    char *_data; /* read-only mapping */
+    size_t _size;
+    const header *_header;
+    const slot *_slots;
+    const entry *_entries;
+    std::vector<file_cache::entry> _files; /* entry i : plain at 2i, gzip at 2i + 1 */
+};
+
+}
+
+#endif
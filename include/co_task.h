@@ -0,0 +1,27 @@
+#ifndef CO_TASK_H
+#define CO_TASK_H
+
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+
+namespace lu {
+
+/* fire & forget coroutine : runs as soon as it is called, 
+ * the frame frees itself when the body returns */
+struct co_task {
+    struct promise_type {
+        co_task get_return_object() noexcept { return co_task(); }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef CONN_LIMITER_H
+#define CONN_LIMITER_H
+
+#include <stdint.h>
+
+#include "locker.h"
+
+namespace lu {
+
+/* per client ip connection counter.
+ * open addressing table (linear probing, backward shift deletion) of 
+ * 8 bytes slots, so a full table of 64K clients is only 512KB */
+class conn_limiter {
+public:
+    /* capacity is rounded up to power of 2 */
+    conn_limiter(int capacity, int max_per_ip);
+    ~conn_limiter();
+
+    /* count one more connection of ip, false if ip is at limit or table is full */
+    bool acquire(uint32_t ip);
+    /* count one less connection of ip */
+    void release(uint32_t ip);
+    /* current connections of ip */
+    int count(uint32_t ip);
+    /* longest distance of an ip from its home slot, 0 if none is displaced */
+    uint32_t max_probe();
+
+private:
+    struct slot {
+        uint32_t ip; /* network order ip, valid if cnt > 0 */
+        uint32_t cnt; /* connections of ip, 0 is empty slot */
+    };
+    /* slot index of ip, or the empty slot ends its probe sequence */
+    uint32_t find(uint32_t ip);
+    inline uint32_t hash(uint32_t ip) {
+        /* Knuth multiplicative hash. its high bits mix all bits of ip, low
+         * ones only low bits of ip : the first octets of a network order
+         * address, the same for a whole /16 */
+        return (ip * 2654435761u) >> _shift;
+    }
+
+private:
+    slot *_slots; /* hash table */
+    uint32_t _mask; /* capacity - 1 */
+    int _shift; /* 32 - log2(capacity) */
+    int _size; /* used slots */
+    int _max_per_ip; /* connection limit of one ip */
+    locker _locker; /* connections may be closed by working threads */
+};
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "locker.h"
+
+#define FILE_CACHE_BYTES_DEFAULT (64 * 1024 * 1024) /* default cache capacity */
+#define FILE_CACHE_FILE_MAX (4 * 1024 * 1024) /* bigger files are mapped but not cached */
+#define FILE_CACHE_VALIDATE 2 /* seconds a cached file is trusted without stat */
+#define FILE_CACHE_UNCACHED_MAX 1024 /* too big paths remembered, forgotten all at once */
+
+namespace lu {
+
+/* path => mmap of file, shared by connections, LRU by bytes.
+ * misses are single-flight : while one thread loads a path, parkable
+ * requests for it wait without holding their thread & are woken after.
+ * a path found too big to cache is remembered & loaded by each request
+ * on its own, waiting on a load which caches nothing gains nothing */
+class file_cache {
+public:
+    /* a mapped file, alive until the cache & all connections using it release it */
+    struct entry {
+        std::string path; /* file path in server */
+        struct stat st; /* file status when it was mapped */
+        char *address; /* mmap address, NULL for empty file */
+        time_t checked; /* last time st was validated */
+        int refs; /* connections using it, +1 while it is in cache */
+        bool cached; /* in cache or private to one connection */
+        bool pinned; /* owned by asset bundle, never released */
+        const char *head; /* precomputed response headers, NULL for files from disk */
+        int head_len;
+        std::list<entry *>::iterator lru; /* position in LRU list if cached */
+    };
+    /* parked request, woken by the thread which loads the file it waits for */
+    struct waiter {
+        void (*wake)(void *arg);
+        void *arg;
+    };
+
+public:
+    file_cache(size_t max_bytes = FILE_CACHE_BYTES_DEFAULT, 
+        size_t max_file = FILE_CACHE_FILE_MAX);
+    ~file_cache();
+
+    /* fresh cached entry of path or NULL, never touches disk */
+    entry *lookup(const char *path);
+    /* size of cached file of path, -1 if it is not cached. takes no 
+     * reference & counts no hit */
+    long cached_size(const char *path);
+    /* entry of path, mapped on miss. NULL on failure with err set to errno
+     * of stat/open/mmap, EACCES if others can not read, EISDIR for dir.
+     * with w, a miss of a path another thread is loading parks w : NULL with
+     * err EINPROGRESS, w->wake is called once that load is over */
+    entry *acquire(const char *path, int &err, const waiter *w = NULL);
+    /* one more user of an acquired entry */
+    void retain(entry *e);
+    /* connection done with entry */
+    void release(entry *e);
+
+    /* statistics */
+    size_t bytes() const { return _bytes; }
+    size_t count() const { return _map.size(); }
+    unsigned long hits() const { return _hits; }
+    unsigned long misses() const { return _misses; }
+    unsigned long coalesced() const { return _coalesced; }
+
+private:
+    /* stat & map path, NULL on failure with err set */
+    static entry *load(const char *path, int &err);
+    /* free entry memory & mapping */
+    static void destroy(entry *e);
+    /* take e out of cache, locked */
+    void remove(entry *e);
+    /* drop least recently used entries until bytes fit, locked */
+    void evict();
+    /* load of path is over, wake requests parked on it */
+    void land(const std::string &path);
+
+private:
+    size_t _max_bytes; /* cache capacity */
+    size_t _max_file; /* max size of one cached file */
+    size_t _bytes; /* bytes of cached files */
+    unsigned long _hits; /* served from cache */
+    unsigned long _misses; /* mapped from disk */
+    unsigned long _coalesced; /* misses parked on another thread's load */
+    std::unordered_map<std::string, entry *> _map; /* path => entry */
+    std::list<entry *> _lru; /* most recently used at front */
+    std::unordered_map<std::string, std::vector<waiter> > _loading; /* path => parked */
+    std::unordered_set<std::string> _uncached; /* paths over max_file, never parked on */
+    locker _locker; /* used by reactor & working threads */
+};
+
+}
+
+#endif
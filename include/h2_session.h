@@ -0,0 +1,140 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+#include "hpack.h"
+#include "file_cache.h"
+
+namespace lu {
+
+/* server side of one cleartext http/2 (h2c, RFC 7540) connction.
+ * bytes from client go in through feed(), frames for client come out of 
+ * output(). streams are answered from the file cache and their DATA frames
+ * are interleaved round robin as flow control windows allow */
+class h2_session {
+public:
+    static const char PREFACE[]; /* client connection preface */
+    static const int PREFACE_LEN = 24;
+    static const uint32_t MAX_CONCURRENT_STREAMS = 100; /* our SETTINGS */
+    static const uint32_t MAX_FRAME_SIZE = 16384; /* we accept, SETTINGS default */
+    static const uint32_t HEADER_BLOCK_MAX = 64 * 1024; /* HEADERS + CONTINUATION */
+    static const size_t OUTPUT_HIGH = 64 * 1024; /* stop making DATA frames above */
+
+    /* frame types */
+    enum FRAME_TYPE {
+        FRAME_DATA = 0,
+        FRAME_HEADERS,
+        FRAME_PRIORITY,
+        FRAME_RST_STREAM,
+        FRAME_SETTINGS,
+        FRAME_PUSH_PROMISE,
+        FRAME_PING,
+        FRAME_GOAWAY,
+        FRAME_WINDOW_UPDATE,
+        FRAME_CONTINUATION
+    };
+    /* error codes of RST_STREAM & GOAWAY */
+    enum ERROR_CODE {
+        NO_ERROR = 0,
+        PROTOCOL_ERROR,
+        INTERNAL_ERROR,
+        FLOW_CONTROL_ERROR,
+        SETTINGS_TIMEOUT,
+        STREAM_CLOSED,
+        FRAME_SIZE_ERROR,
+        REFUSED_STREAM,
+        CANCEL,
+        COMPRESSION_ERROR
+    };
+
+public:
+    h2_session();
+    ~h2_session();
+
+    /* prior knowledge : client starts with the preface */
+    void start();
+    /* h2c upgrade : 101 response, then the http/1.1 GET of path becomes stream 1.
+     * settings is the HTTP2-Settings header, false if it is malformed */
+    bool upgrade(const char *settings, const char *path);
+    /* bytes from client, false on connection error (GOAWAY is queued) */
+    bool feed(const char *data, size_t len);
+    /* queue DATA frames as flow control windows allow */
+    void produce();
+
+    /* bytes waiting to be sent */
+    inline const char *output() const { return _out.data() + _out_sent; }
+    inline size_t pending() const { return _out.size() - _out_sent; }
+    /* n bytes of output are sent */
+    void consumed(size_t n);
+    /* GOAWAY is queued or received, close after sending */
+    inline bool closing() const { return _closing; }
+    /* no stream is open & every frame is sent */
+    inline bool idle() const { return _streams.empty() && pending() == 0; }
+    /* server is going away : queue GOAWAY(NO_ERROR) unless closing already */
+    inline void shutdown() {
+        if(!_closing) {
+            goaway(NO_ERROR);
+        }
+    }
+
+private:
+    struct stream {
+        int64_t window; /* send window */
+        std::string block; /* header block fragments until END_HEADERS */
+        std::string method; /* :method */
+        std::string path; /* :path */
+        bool end_stream; /* client is done sending */
+        bool responded; /* response HEADERS are queued */
+        file_cache::entry *file; /* response body if it is a file */
+        const char *body; /* response body */
+        size_t body_len;
+        size_t body_sent;
+    };
+
+private:
+    /* one complete frame */
+    bool on_frame(int type, int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_data(int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_headers(int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_continuation(int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_settings(int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_window_update(uint32_t sid, const uint8_t *payload, uint32_t len);
+    /* END_HEADERS of stream : decode block, answer if request is complete */
+    bool on_header_block(uint32_t sid);
+    /* queue response HEADERS, DATA follows in produce() */
+    void respond(uint32_t sid, stream &s);
+    /* release stream */
+    void finish(uint32_t sid);
+
+    /* output frames */
+    void frame_header(uint32_t len, int type, int flags, uint32_t sid);
+    void settings();
+    void window_update(uint32_t sid, uint32_t inc);
+    void rst_stream(uint32_t sid, ERROR_CODE code);
+    /* queue GOAWAY, return false for caller */
+    bool goaway(ERROR_CODE code);
+
+private:
+    std::string _in; /* incomplete frame */
+    std::string _out; /* frames to send */
+    size_t _out_sent; /* sent bytes of _out */
+    bool _preface_pending; /* client preface not received yet */
+    bool _closing; /* no more frames are processed */
+
+    hpack::decoder _decoder; /* header blocks of client */
+    std::map<uint32_t, stream> _streams; /* open streams by id */
+    uint32_t _last_stream_id; /* highest stream opened by client */
+    uint32_t _cont_stream; /* stream expecting CONTINUATION, 0 if none */
+    uint32_t _rr_next; /* round robin : first stream to send DATA next time */
+
+    int64_t _send_window; /* connection send window */
+    int64_t _peer_initial_window; /* SETTINGS_INITIAL_WINDOW_SIZE of client */
+    uint32_t _peer_max_frame; /* SETTINGS_MAX_FRAME_SIZE of client */
+};
+
+}
+
+#endif
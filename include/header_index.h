@@ -0,0 +1,100 @@
+#ifndef HEADER_INDEX_H
+#define HEADER_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+#define HEADER_INDEX_MAX 64 /* header fields of a request, more is answered with 431 */
+
+namespace lu {
+
+/* header fields of a request as offsets into the read buffer they were
+ * parsed in, so nothing is copied or allocated. names are hashed (case
+ * folded) while the line end is searched, well-known names are found by
+ * that hash & kept in a direct table. values have surrounding blanks
+ * trimmed & are '\0' terminated in place. views are valid while the
+ * buffer holds the request */
+class header_index {
+public:
+    enum KNOWN {
+        HEADER_CONNECTION = 0,
+        HEADER_CONTENT_LENGTH,
+        HEADER_HOST,
+        HEADER_ACCEPT_ENCODING,
+        HEADER_UPGRADE,
+        HEADER_HTTP2_SETTINGS,
+        HEADER_KEEP_ALIVE,
+        HEADER_PROXY_CONNECTION,
+        HEADER_TRANSFER_ENCODING,
+        HEADER_IF_NONE_MATCH,
+        HEADER_IF_MODIFIED_SINCE,
+        HEADER_RANGE,
+        HEADER_IF_RANGE,
+        HEADER_CACHE_CONTROL,
+        HEADER_USER_AGENT,
+        HEADER_ACCEPT,
+        HEADER_COOKIE,
+        HEADER_REFERER,
+        HEADER_AUTHORIZATION,
+        HEADER_EXPECT,
+        HEADER_KNOWN_COUNT,
+        HEADER_OTHER = -1
+    };
+
+public:
+    header_index() { clear(NULL); }
+
+    /* forget fields, next ones are in base */
+    void clear(char *base);
+    /* field of line [begin, end) of base : name ends at colon (name_hash is
+     * hash() of it), value is after it. false if table is full or name is
+     * empty or has blanks or controls ("Content-Length :" is not a
+     * Content-Length a proxy may pass on) */
+    bool add(int begin, int colon, int end, uint32_t name_hash);
+
+    inline int size() const { return _count; }
+    /* no room for another field : the request has too many */
+    inline bool full() const { return _count == HEADER_INDEX_MAX; }
+    inline std::string_view name(int i) const { 
+        return std::string_view(_base + _fields[i].name, _fields[i].name_len);
+    }
+    inline std::string_view value(int i) const { 
+        return std::string_view(_base + _fields[i].value, _fields[i].value_len);
+    }
+    inline KNOWN known(int i) const { return (KNOWN)_fields[i].known; }
+    /* value of a well-known field, first one if repeated. data() is NULL if absent */
+    inline std::string_view get(KNOWN k) const {
+        return _known[k] == 0 ? std::string_view() : value(_known[k] - 1);
+    }
+    inline bool has(KNOWN k) const { return _known[k] != 0; }
+    /* value of field name (any case), data() is NULL if absent */
+    std::string_view get(std::string_view name) const;
+
+    /* FNV-1a of lower case bytes, folded one byte at a time by the line scan */
+    static inline uint32_t hash_byte(uint32_t h, char c) {
+        return (h ^ (uint8_t)(c >= 'A' && c <= 'Z' ? c + 32 : c)) * 16777619u;
+    }
+    static constexpr uint32_t HASH_SEED = 2166136261u;
+    static uint32_t hash(std::string_view name);
+    /* well-known name of hash, HEADER_OTHER if none */
+    static KNOWN lookup(const char *name, size_t len, uint32_t hash);
+
+private:
+    struct field {
+        uint16_t name; /* offsets & lengths in base, which is below 64KB */
+        uint16_t name_len;
+        uint16_t value;
+        uint16_t value_len;
+        uint32_t hash;
+        int8_t known;
+    };
+    char *_base;
+    int _count;
+    uint8_t _known[HEADER_KNOWN_COUNT]; /* field index + 1 of well-known ones, 0 if absent */
+    field _fields[HEADER_INDEX_MAX];
+};
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#define HPACK_TABLE_SIZE_DEFAULT 4096 /* SETTINGS_HEADER_TABLE_SIZE default */
+#define HPACK_HEADER_LIST_MAX (16 * 1024) /* SETTINGS_MAX_HEADER_LIST_SIZE we advertise */
+
+namespace lu {
+
+/* HPACK (RFC 7541) header compression for http/2 */
+class hpack {
+public:
+    struct header {
+        std::string name;
+        std::string value;
+    };
+
+    /* decoder of the header blocks sent by peer, keeps the dynamic table */
+    class decoder {
+    public:
+        decoder(size_t max_table_size = HPACK_TABLE_SIZE_DEFAULT, 
+            size_t max_list_size = HPACK_HEADER_LIST_MAX);
+        /* decode one complete header block, false on compression error or if
+         * the list (name + value + 32 of each field) is over max_list_size :
+         * a small block of indexed references can stand for a huge list */
+        bool decode(const uint8_t *data, size_t len, std::vector<header> &headers);
+
+    private:
+        /* header of index in static + dynamic table, NULL if out of range */
+        const header *lookup(uint64_t index) const;
+        /* add to dynamic table & evict to fit */
+        void insert(const header &h);
+        void evict(size_t max_size);
+
+    private:
+        std::deque<header> _table; /* dynamic table, newest at front */
+        size_t _size; /* sum of name + value + 32 of entries */
+        size_t _max_size; /* current limit set by peer's size updates */
+        size_t _max_allowed; /* our SETTINGS_HEADER_TABLE_SIZE */
+        size_t _max_list; /* our SETTINGS_MAX_HEADER_LIST_SIZE */
+    };
+
+    /* encoder of our header blocks. it never indexes into the dynamic table,
+     * so the peer's table size settings don't matter */
+    class encoder {
+    public:
+        /* append block of headers to out */
+        static void encode(const std::vector<header> &headers, std::string &out);
+    };
+
+public:
+    /* integer with prefix bits (5.1), false on overflow or truncated input */
+    static bool decode_int(const uint8_t *&p, const uint8_t *end, int prefix, uint64_t &value);
+    static void encode_int(uint64_t value, int prefix, uint8_t flags, std::string &out);
+    /* string literal (5.2), huffman coded or raw */
+    static bool decode_string(const uint8_t *&p, const uint8_t *end, std::string &str);
+    /* huffman (5.2, appendix B) */
+    static bool huffman_decode(const uint8_t *data, size_t len, std::string &str);
+
+public:
+    static const int STATIC_TABLE_SIZE = 61;
+    static const header STATIC_TABLE[STATIC_TABLE_SIZE]; /* index 1 ~ 61 */
+};
+
+}
+
+#endif
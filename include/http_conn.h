@@ -14,20 +14,37 @@
 #include <sys/mman.h>
 #include <unordered_map>
 #include <stdarg.h>
+#include <sys/uio.h>
+#include <atomic>
 
 #include "tools.h"
+#include "conn_limiter.h"
+#include "file_cache.h"
+#include "path_cache.h"
+#include "sock_profile.h"
+#include "co_task.h"
+#include "tls.h"
+#include "upstream.h"
+#include "bundle.h"
+#include "shm_cache.h"
+#include "threadpool.h"
+#include "async_io.h"
+#include "out_queue.h"
+#include "header_index.h"
 
 //#define __DEBUG /* debug flag */
 
 namespace lu{
 
+class h2_session;
+
 class http_conn{
     
 public:
     static const int READ_BUFFER_SIZE = 2048; /* read buffer size */
     static const int WRITE_BUFFER_SIZE = 1024; /* write buffer size */
     static const int FILENAME_LEN = 256; /* file name max length */
-    static const int WRITE_IOVCNT_MAX = 2; /* max number of buffers */
+    static const int INLINE_FILE_MAX = 64 * 1024; /* max file answered on reactor thread */
 
     static const char *DOC_ROOT; /* resource root path */
 
@@ -52,13 +69,39 @@ public:
     enum HTTP_CODE { 
         NO_REQUEST, /* request is not completed, continue to read */
         GET_REQUEST, /* fully client request */
+        DEFERRED_REQUEST, /* parsed on reactor thread, left to working thread */
+        PROXY_REQUEST, /* url belongs to a proxy route */
+        PARKED_REQUEST, /* waits for a file another thread is loading */
         FILE_REQUEST = 200, /* file request */
         BAD_REQUEST = 400, /* syntax error in request */
         FORBIDDEN_REQUEST = 403, /* no access */
         NO_RESOURCE = 404, /* no request resource */
+        HEADERS_TOO_LARGE = 431, /* more header fields than are indexed */
         INTERNAL_ERROR = 500, /* server internal error */
+        BAD_GATEWAY = 502, /* no backend answered proxied request */
+        SERVICE_UNAVAILABLE = 503, /* server overloaded */
         CLOSED_CONNECTION /* client close disconnection */
     };
+    /* result of sending response */
+    enum WRITE_STATUS {
+        WRITE_DONE = 0, /* whole response is sent */
+        WRITE_AGAIN, /* socket buffer is full */
+        WRITE_ERROR, /* connction is broken */
+        WRITE_PENDING /* file pages are being read in, io thread arms EPOLLOUT after */
+    };
+    /* result of relaying proxied request */
+    enum PROXY_STATUS {
+        PROXY_DONE = 0, /* whole response is sent to client */
+        PROXY_UP_READ, /* waiting for backend to answer */
+        PROXY_UP_WRITE, /* waiting to send request to backend */
+        PROXY_CLIENT_WRITE, /* client socket buffer is full */
+        PROXY_ERROR /* backend or client failed */
+    };
+    /* lanes of thread pool, by cost of request */
+    enum LANE {
+        LANE_CHEAP = 0, /* cached small file, error answer */
+        LANE_BULK /* large or cold file, proxied url, http/2 session */
+    };
     /* requst method, only support GET */
     enum METHOD {
         GET = 0,
@@ -76,17 +119,54 @@ public:
     ~http_conn();
 
 public:
-    /* init http connction */
-    void init(int connfd, const sockaddr_in &client_addr);
+    /* init http connction, incoming_cpu is the cpu its packets arrive on */
+    void init(int connfd, const sockaddr_in &client_addr, int incoming_cpu = -1);
+    /* cpu the connction's packets arrive on, -1 if unknown */
+    inline int incoming_cpu() const { return _incoming_cpu; }
     /* nonblocking read */
     bool read();
     /* parse http request & make reponse */
     void process();
+    /* on reactor thread : answer the request if it is cheap, false if it must be processed */
+    bool process_inline();
+    /* header fields of parsed request, valid until the next request */
+    inline const header_index &headers() const { return _headers; }
+    /* on reactor thread : lane of connction's request, peeked before queueing */
+    static int classify(http_conn *conn);
     /* nonblocking write */
     bool write();
     /* close connction */
     void close();
 
+    /* find url in server, shared by http/1 & http/2. with cached_only, 
+     * return DEFERRED_REQUEST unless url is a cached small file. gzip picks
+     * precompressed variant of a bundled file. url is canonicalized first,
+     * NO_RESOURCE / FORBIDDEN_REQUEST of a recent miss come without stat.
+     * with w, PARKED_REQUEST if another thread is loading the file */
+    static HTTP_CODE open_file(const char *url, file_cache::entry *&file, 
+        bool cached_only = false, bool gzip = false, const file_cache::waiter *w = NULL);
+#ifdef __cpp_impl_coroutine
+    /* coroutine mode : serve the connction on reactor thread, after init() */
+    void start();
+    /* coroutine mode : socket event comes, continue the connction */
+    void resume();
+#endif
+    /* event of backend connction (or client EPOLLOUT) while relaying proxied 
+     * request, false if client connction must be closed */
+    bool relay();
+    /* server overloaded : answer 503 right away & close */
+    void overload();
+    /* connected & nothing read or waiting to send */
+    bool idle() const;
+    /* close an idle connction while draining, an h2 client is told by GOAWAY */
+    void retire();
+    /* zerocopy sends whose completion has not been read from error queue */
+    inline bool zerocopy_pending() const { return _zc_next != _zc_done; }
+    /* EPOLLERR : read zerocopy completions, false if a real error is queued */
+    bool reap();
+    /* arm epoll again for what the connction waits for, after reap() */
+    void rearm();
+
 private:
     /* init internal data */
     void _init();
@@ -103,7 +183,59 @@ private:
     HTTP_CODE parse_content(char * text);
     /* according parse result to find resource in server & waiting for write to client */
     HTTP_CODE do_request();
+    /* file a parked request waited for is loaded, queue it again */
+    static void unpark(void *conn);
     
+    /* write response until it is done or socket buffer is full */
+    WRITE_STATUS flush();
+    /* file bytes at head of output are in page cache, else read them in on io thread */
+    bool file_ready();
+    /* io thread has read file pages in, go on sending */
+    static void file_read_in(void *conn);
+    /* response is sent : reset for next request, return is or not keep alive */
+    bool finish_response();
+
+    /* is connction http/2 : 1 yes, 0 no, -1 can not tell until more bytes come */
+    int h2_check();
+    /* http/2 with prior knowledge : read buffer goes to session */
+    bool h2_feed();
+    /* h2c upgrade of the request just parsed, false to answer it by http/1.1 */
+    bool h2_upgrade();
+    /* arm epoll for what session needs next */
+    void h2_arm();
+    /* send frames of session, making more DATA as windows allow */
+    WRITE_STATUS h2_flush();
+    /* write of http/2 connction */
+    bool h2_write();
+
+    /* proxy route of url, matched on its canonical path, NULL if it is not proxied */
+    static upstream_pool::route *route_of(const char *url);
+    /* proxied request : start relaying it, BAD_GATEWAY if no backend takes it */
+    HTTP_CODE proxy_begin();
+    /* request for backend & a connction to send it on, false if no backend */
+    bool proxy_start();
+    /* move request & response as far as sockets allow, retry on a fresh connction */
+    PROXY_STATUS proxy_pump();
+    /* one pass of proxy_pump */
+    PROXY_STATUS proxy_move();
+    /* exchange is over, give backend connction back */
+    void proxy_end(bool ok);
+    /* exchange failed : 502 if client got nothing yet, false to close client */
+    bool proxy_fail();
+    /* free _px, back to its pool */
+    void drop_exchange();
+
+    /* recv of connction, through tls session if there is one */
+    int sock_recv(char *buf, int len);
+    /* writev of connction, through tls session unless kernel seals the records */
+    int sock_writev(const struct iovec *iov, int iovcnt);
+    /* sendmsg with MSG_ZEROCOPY, zc is cleared if it fell back to writev */
+    int sock_sendzc(const struct iovec *iov, int iovcnt, bool &zc);
+#ifdef __TLS
+    /* go on with tls handshake, false if it failed */
+    bool tls_handshake();
+#endif
+
     /* create response content according result code of parse http request */
     bool process_write(HTTP_CODE code);
     /* response line */
@@ -123,25 +255,68 @@ private:
     /* write data to write buffer write for sending */
     bool add_reponse(const char* format, ... );
 private:
+#ifdef __cpp_impl_coroutine
+    /* awaitable : suspend connction coroutine until ev (0 is already armed) */
+    struct io_wait {
+        http_conn *conn;
+        int ev;
+        int fd = -1; /* backend connction to wait on instead of client */
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> co) {
+            conn->_co = co;
+            if(fd >= 0) {
+                tools::armfd(_epollfd, fd, ev);
+            } else if(ev != 0) {
+                tools::modifyfd(_epollfd, conn->_connfd, ev);
+            }
+        }
+        void await_resume() const noexcept {}
+    };
+    /* connction body of coroutine mode */
+    co_task serve();
+#endif
+
+    /* event to wait for more request bytes, tls handshake may need to write first */
+    inline int read_event() const {
+#ifdef __TLS
+        return _tls_wait != 0 ? _tls_wait : (int)EPOLLIN;
+#else
+        return EPOLLIN;
+#endif
+    }
     /* get current line head address */
     inline char *get_line() { return _read_buf + _start_line; }
-    /* unmap */
-    inline bool unmap() {
-        int ret = false;
-        if(_file_address != NULL) {
-            ret = munmap(_file_address, _file_stat.st_size);
-            _file_address = NULL;
+    /* release mapped file */
+    inline void unmap() {
+        if(_file != NULL) {
+            _file_cache->release(_file);
+            _file = NULL;
         }
-        return ret;
     }
 
 public:
     static int _epollfd; /* epoll fd */
-    static int _user_count; /* connctions count */
+    static std::atomic<int> _user_count; /* connctions count, closed on working threads too */
+    static volatile bool _draining; /* graceful shutdown, no more keep-alive */
+    static conn_limiter *_ip_limiter; /* per client ip connections, NULL if unlimited */
+    static file_cache *_file_cache; /* mapped files shared by all connctions */
+    static path_cache *_path_cache; /* url => canonical path, recent misses */
+    static const sock_profile *_sock_profile; /* tcp options of the listener */
+#ifdef __TLS
+    static const tls_context *_tls; /* connctions speak tls, NULL for plain http */
+#endif
+    static upstream_pool *_upstreams; /* proxy routes, NULL if there is none */
+    static buffer_pool *_exchanges; /* proxy exchanges come from it, NULL for heap */
+    static bundle *_bundle; /* packed document root, NULL to serve DOC_ROOT */
+    static shm_cache *_shm_cache; /* files shared by prefork workers, NULL with threads only */
+    static async_io *_async_io; /* reads of cold files, NULL to fault on sender */
+    static threadpool<http_conn> *_pool; /* parked requests go back to it, NULL if
+                                          * requests can not park (coroutine mode) */
 
 private:
     int _connfd; /* cur http connction fd  */
     sockaddr_in _client_addr; /* client address */
+    int _incoming_cpu; /* SO_INCOMING_CPU, -1 if unknown */
 
     /* read about */
     int _read_idx; /* current pos in read buffer */
@@ -150,9 +325,7 @@ private:
     /* write about */
     int _write_idx; /* current pos in write buffer */
     char _write_buf[WRITE_BUFFER_SIZE]; /* write buffer */
-    int _iovcnt; /* Number of buffers */
-    struct iovec _iov[WRITE_IOVCNT_MAX]; /* iovec write buffers array */
-    int _bytes_to_send; /* current need to send numbers of bytes */
+    out_queue _out; /* response bytes to send : write buffer, file slices */
     int _bytes_already_send; /* current already send numbers of bytes */
 
     /* http parse about */
@@ -160,6 +333,9 @@ private:
     int _checked_idx; /* current parse char position in read buffer */
     int _start_line; /* current line start index relative to read buffer head address */
     
+    header_index _headers; /* fields of request, views into read buffer */
+    int _colon; /* colon of header line being scanned, -1 if not seen yet */
+    uint32_t _name_hash; /* hash of its name so far */
     char *_url; /* request url */
     METHOD _method; /* request method */
     char *_version; /* http protocol version */
@@ -167,10 +343,42 @@ private:
     int _content_length; /* request content length */
     bool _linger; /* is or not keep alive */
     char *_host; /* host address with point & number */
+    bool _accept_gzip; /* Accept-Encoding has gzip */
+
+    file_cache::entry *_file; /* mapped request file */
+    bool _cached_only; /* do_request may only use cache (on reactor thread) */
+    bool _deferred; /* request is parsed, do_request is left to working thread */
+    const char *_resident_begin; /* file bytes in [begin, end) are known to be in page cache */
+    const char *_resident_end;
+    async_io::job _io_job; /* read of cold file pages in progress */
+    file_cache *_io_cache; /* file _io_job reads, kept mapped until it is done */
+    file_cache::entry *_io_file;
+    std::atomic<bool> _io_busy; /* _io_job is queued or running, maybe for a closed connction */
+    std::atomic<bool> _io_pending; /* sending waits for _io_job, file_read_in() arms EPOLLOUT */
+    bool _zerocopy; /* large file slices go by MSG_ZEROCOPY */
+    uint32_t _zc_next; /* id of next zerocopy send */
+    uint32_t _zc_done; /* zerocopy sends completed */
+
+    /* proxy about */
+    upstream_pool::route *_route; /* proxy route of request */
+    upstream_exchange *_px; /* relay in progress, NULL if none */
+
+    /* http/2 about */
+    h2_session *_h2; /* session once the connction speaks http/2 */
+    bool _h2_upgrade; /* Upgrade: h2c */
+    char *_h2_settings; /* HTTP2-Settings of upgrade request */
+
+#ifdef __TLS
+    /* tls about */
+    SSL *_ssl; /* tls session, NULL for plain http */
+    bool _tls_ready; /* handshake is done */
+    bool _ktls; /* kernel seals records we send, writev goes straight to socket */
+    int _tls_wait; /* event handshake waits for, 0 if none */
+#endif
 
-    char _real_file[FILENAME_LEN]; /* request file path in server */
-    struct stat _file_stat; /* file status */
-    char *_file_address; /* mmap memory map address */
+#ifdef __cpp_impl_coroutine
+    std::coroutine_handle<> _co; /* suspended connction coroutine */
+#endif
 };
 
 }
@@ -1,117 +1,206 @@
 #ifndef LOCKER_H
 #define LOCKER_H
 
-#include <pthread.h>
-#include <semaphore.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
 #include <exception>
 
+#define LOCKER_SPIN 100 /* spins on a held lock before sleeping in kernel */
+
 namespace lu {
 
-/* class mutex */
+/* futex on a 32 bit atomic : sleep while *addr == val, wake n sleepers */
+static inline void futex_wait(std::atomic<uint32_t> *addr, uint32_t val) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+static inline void futex_wake(std::atomic<uint32_t> *addr, int n) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+/* cpu hint inside spin loops */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/* contention of a lock : acquisitions that found it held & of them, those
+ * that went to sleep in kernel after spinning */
+struct lock_stats {
+    unsigned long contended;
+    unsigned long sleeps;
+};
+
+/* class mutex : spin a while, then futex. state 0 free, 1 locked, 2 locked
+ * with sleepers, so an uncontended lock & unlock are one atomic op each */
 class locker {
 public:
     /* init mutex locker */
-    locker() {
-        if(pthread_mutex_init(&_mutex, NULL) != 0) {
-            throw std::exception(); 
-        }
-    }
-    /* destroy mutex locker */
-    ~locker() {
-        pthread_mutex_destroy(&_mutex);
-    }
+    locker() : _state(0), _contended(0), _sleeps(0) {}
     /* lock mutex */
     bool lock() {
-        return pthread_mutex_lock(&_mutex) == 0;
+        uint32_t c = 0;
+        if(_state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+            return true;
+        }
+        _contended.fetch_add(1, std::memory_order_relaxed);
+        /* holder is likely running on another cpu & about to unlock */
+        for(int i = 0; i < LOCKER_SPIN; i++) {
+            cpu_relax();
+            c = 0;
+            if(_state.load(std::memory_order_relaxed) == 0
+                && _state.compare_exchange_weak(c, 1, std::memory_order_acquire)) {
+                return true;
+            }
+        }
+        /* mark it contended, unlock wakes one sleeper */
+        while(_state.exchange(2, std::memory_order_acquire) != 0) {
+            _sleeps.fetch_add(1, std::memory_order_relaxed);
+            futex_wait(&_state, 2);
+        }
+        return true;
+    }
+    /* lock mutex if it is free */
+    bool try_lock() {
+        uint32_t c = 0;
+        return _state.compare_exchange_strong(c, 1, std::memory_order_acquire);
     }
     /* unlock mutex */
     bool unlock() {
-        return pthread_mutex_unlock(&_mutex) == 0;
+        if(_state.exchange(0, std::memory_order_release) == 2) {
+            futex_wake(&_state, 1);
+        }
+        return true;
+    }
+    /* contention so far */
+    lock_stats stats() const {
+        lock_stats s = {_contended.load(std::memory_order_relaxed),
+            _sleeps.load(std::memory_order_relaxed)};
+        return s;
     }
 private:
-    pthread_mutex_t _mutex;
+    std::atomic<uint32_t> _state;
+    std::atomic<unsigned long> _contended;
+    std::atomic<unsigned long> _sleeps;
 };
 
-/* semaphore */
+/* semaphore : post is one atomic op unless somebody sleeps in wait */
 class sem {
 public:
     /* init semaphore */
-    sem() {
-        if(sem_init(&_sem, 0, 0) != 0) {
-            throw std::exception();
-        }
-    }
-    sem(unsigned int val) {
-        if(sem_init(&_sem, 0, val) != 0) {
-            throw std::exception();
-        }
-    }
-    /* destroy semaphore */
-    ~sem() {
-        sem_destroy(&_sem);
-    }
+    sem() : _value(0), _waiters(0) {}
+    sem(unsigned int val) : _value(val), _waiters(0) {}
     /* semaphore substract one */
     bool wait() {
-        return sem_wait(&_sem) == 0;
+        while(true) {
+            uint32_t v = _value.load(std::memory_order_relaxed);
+            while(v > 0) {
+                if(_value.compare_exchange_weak(v, v - 1, std::memory_order_acquire)) {
+                    return true;
+                }
+            }
+            _waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex_wait(&_value, 0);
+            _waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
     }
     /* semaphore add one */
     bool post() {
-        return sem_post(&_sem) == 0;
+        _value.fetch_add(1, std::memory_order_seq_cst);
+        if(_waiters.load(std::memory_order_seq_cst) > 0) {
+            futex_wake(&_value, 1);
+        }
+        return true;
     }
     /* get semaphore value */
     int get_val() {
-        int sval;
-        if(sem_getvalue(&_sem, &sval) != 0) {
-            throw std::exception();
-        }
-        return sval;
+        return (int)_value.load(std::memory_order_relaxed);
     }
 private:
-    sem_t _sem;
+    std::atomic<uint32_t> _value;
+    std::atomic<uint32_t> _waiters;
 };
 
-/* condition variable */
+/* condition variable, waited on with the locker protecting its predicate */
 class cond{
 public:
-    /* init condition variable & mutex */
-    cond() {
-        if(pthread_mutex_init(&_mutex, NULL) != 0) {
-            throw std::exception(); 
-        }
-        /* if something is wrong, we should release mutex resource */
-        if(pthread_cond_init(&_cond, NULL) != 0) {
-            pthread_mutex_destroy(&_mutex);
-            throw std::exception();
-        }
-    }
-    /* destroy condition variable & mutex */
-    ~cond() {
-        pthread_cond_destroy(&_cond);
-        pthread_mutex_destroy(&_mutex);
-    }
-    /* wait condition variable:
-     *      first we should get the mutex locker
-     */
-    bool wait() {
-        int ret = 0;
-        pthread_mutex_lock(&_mutex);
-        ret = pthread_cond_wait(&_cond, &_mutex);
-        pthread_mutex_unlock(&_mutex);
-        return ret == 0;
+    cond() : _seq(0) {}
+    /* unlock m, sleep until signaled & lock m again. a signal between
+     * unlock & sleep is not lost, the sequence has moved on by then */
+    bool wait(locker &m) {
+        uint32_t seq = _seq.load(std::memory_order_relaxed);
+        m.unlock();
+        futex_wait(&_seq, seq);
+        m.lock();
+        return true;
     }
     /* wakeup one thread of waiting for condition variable */
     bool signal() {
-        return pthread_cond_signal(&_cond) == 0;
+        _seq.fetch_add(1, std::memory_order_release);
+        futex_wake(&_seq, 1);
+        return true;
     }
     /* wakeup all thread of waiting for condition variable */
     bool broadcast() {
-        return pthread_cond_broadcast(&_cond) == 0;
+        _seq.fetch_add(1, std::memory_order_release);
+        futex_wake(&_seq, INT_MAX);
+        return true;
+    }
+private:
+    std::atomic<uint32_t> _seq;
+};
+
+/* event count : idle threads sleep on it without a lock. a waiter takes a
+ * key, checks its condition again & sleeps only if no notify came since.
+ * notify costs no syscall while nobody waits
+ *      key = ec.prepare_wait();
+ *      if(condition) { ec.cancel_wait(); } else { ec.wait(key); } */
+class eventcount {
+public:
+    eventcount() : _epoch(0), _waiters(0), _wakes(0) {}
+    uint32_t prepare_wait() {
+        _waiters.fetch_add(1, std::memory_order_seq_cst);
+        return _epoch.load(std::memory_order_seq_cst);
+    }
+    void cancel_wait() {
+        _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    void wait(uint32_t key) {
+        if(_epoch.load(std::memory_order_acquire) == key) {
+            futex_wait(&_epoch, key);
+        }
+        _waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    /* wake one waiter, after making its condition true */
+    void notify_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_waiters.load(std::memory_order_relaxed) > 0) {
+            _epoch.fetch_add(1, std::memory_order_release);
+            _wakes.fetch_add(1, std::memory_order_relaxed);
+            futex_wake(&_epoch, 1);
+        }
+    }
+    void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_waiters.load(std::memory_order_relaxed) > 0) {
+            _epoch.fetch_add(1, std::memory_order_release);
+            _wakes.fetch_add(1, std::memory_order_relaxed);
+            futex_wake(&_epoch, INT_MAX);
+        }
     }
+    /* notifies that had to wake a sleeper (futex syscalls) */
+    unsigned long wakes() const { return _wakes.load(std::memory_order_relaxed); }
 private:
-    pthread_cond_t _cond;
-    pthread_mutex_t _mutex;
+    std::atomic<uint32_t> _epoch;
+    std::atomic<uint32_t> _waiters;
+    std::atomic<unsigned long> _wakes;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
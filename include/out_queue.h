@@ -0,0 +1,99 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "file_cache.h"
+#include "arena.h"
+
+#define OUT_QUEUE_IOV_MAX (IOV_MAX < 64 ? IOV_MAX : 64) /* iovecs of one writev */
+#define OUT_CHUNK_SIZE (16 * 1024) /* copied bytes are packed into chunks of it */
+
+namespace lu {
+
+/* bytes of responses waiting to be sent, as a list of segments : bytes owned
+ * by someone else, reference counted chunks of copied bytes & slices of
+ * cached files. each segment holds what it points into until it is sent.
+ * file slices sent with MSG_ZEROCOPY are held until the kernel reports
+ * their completion, as pages are read by the nic after send returns */
+class out_queue {
+public:
+    /* copied bytes, shared by the segments pointing into it */
+    struct chunk {
+        int refs;
+        size_t used;
+        char data[OUT_CHUNK_SIZE];
+    };
+    struct segment {
+        const char *data;
+        size_t len;
+        chunk *buf; /* chunk data points into, NULL if none */
+        file_cache *cache; /* cache of file */
+        file_cache::entry *file; /* file data points into, NULL if none */
+        long zc; /* id of last zerocopy send of its bytes, -1 if none */
+    };
+
+public:
+    out_queue();
+    ~out_queue();
+
+    /* bytes which stay valid until they are sent or the queue is cleared */
+    void push(const char *data, size_t len);
+    /* copy of bytes, into the last chunk while it has room */
+    void push_copy(const char *data, size_t len);
+    /* len bytes of file from off, the queue keeps its own reference of file */
+    void push_file(file_cache *cache, file_cache::entry *file, size_t off, size_t len);
+
+    /* iovecs of queued bytes from the head, at most max, return count. with
+     * zerocopy_min, file slices from that size go apart from other bytes :
+     * zerocopy tells if the iovecs are such slices */
+    int fill(struct iovec *iov, int max, size_t zerocopy_min = 0, bool *zerocopy = NULL) const;
+    /* n bytes of head were sent, by zerocopy send zc if it is not -1 : drop 
+     * segments done, advance partial one */
+    void consume(size_t n, long zc = -1);
+    /* zerocopy sends lo..hi are complete, release files they held */
+    void complete(uint32_t lo, uint32_t hi);
+    /* drop everything, releasing chunks & files. files held by zerocopy sends
+     * stay held */
+    void clear();
+    /* socket is closing : release held files, pages in flight are pinned by kernel */
+    void release_held();
+
+    inline bool empty() const { return _head == _segments.size(); }
+    inline size_t bytes() const { return _bytes; }
+    /* first segment, queue must not be empty */
+    inline const segment &front() const { return _segments[_head]; }
+
+private:
+    /* file held until zerocopy send id completes */
+    struct held {
+        file_cache *cache;
+        file_cache::entry *file;
+        uint32_t id;
+    };
+
+    /* drop first segment */
+    void pop();
+    static void unref(chunk *c);
+
+public:
+    static buffer_pool *_chunks; /* chunks come from it, NULL for heap */
+
+private:
+    /* segments from _head on are queued. a vector, not a deque : its
+     * capacity is kept when it empties, so a keep-alive connction does not
+     * allocate per response */
+    std::vector<segment> _segments;
+    size_t _head;
+    chunk *_tail; /* chunk copies go to, NULL if none. one reference held */
+    std::vector<held> _held; /* files of zerocopy sends not completed */
+    size_t _bytes; /* bytes queued */
+};
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <time.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "locker.h"
+
+#define PATH_CACHE_MAX 8192 /* urls remembered, least recently used go first */
+#define PATH_CACHE_NEGATIVE_TTL 2 /* seconds a missing file is trusted missing */
+
+namespace lu {
+
+/* url => canonical path & lookup result. a url is percent-decoded & its dot
+ * segments removed once, missing files are remembered for a short while, so
+ * repeated requests for paths that do not exist never reach stat */
+class path_cache {
+public:
+    enum RESULT {
+        PATH_OK = 0, /* canonical path is set, file may exist */
+        PATH_BAD, /* malformed url */
+        PATH_MISSING, /* no such file, recently checked */
+        PATH_FORBIDDEN /* file not readable, recently checked */
+    };
+
+public:
+    path_cache(size_t max_entries = PATH_CACHE_MAX);
+
+    /* canonical path of url into path (len bytes), or negative result of it */
+    RESULT resolve(const char *url, char *path, size_t len);
+    /* file of url could not be opened with err, remember it for a while if err
+     * is definitive (EACCES, ENOENT, ENOTDIR, EISDIR) */
+    void fail(const char *url, int err);
+
+    /* url path without query, percent-decoded & dot segments removed. false for
+     * malformed escapes, encoded NUL or '/' or if it does not fit in len */
+    static bool canonicalize(const char *url, size_t url_len, char *out, size_t len);
+
+    /* statistics */
+    unsigned long hits() const { return _hits; }
+    unsigned long negative_hits() const { return _negative_hits; }
+
+private:
+    struct item {
+        std::string canonical; /* empty for malformed url */
+        RESULT result;
+        time_t expires; /* of negative result, 0 for PATH_OK & PATH_BAD */
+        std::list<std::string>::iterator lru;
+    };
+
+    /* url key : path part, query is not part of resolution */
+    static size_t key_length(const char *url);
+    /* insert or replace item of key, locked */
+    void store(const std::string &key, const item &it);
+
+private:
+    size_t _max_entries;
+    unsigned long _hits; /* resolved without canonicalizing */
+    unsigned long _negative_hits; /* answered without stat */
+    std::unordered_map<std::string, item> _map; /* url path => item */
+    std::list<std::string> _lru; /* most recently used at front */
+    locker _locker; /* used by reactor & working threads */
+};
+
+}
+
+#endif
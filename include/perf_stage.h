@@ -0,0 +1,75 @@
+#ifndef PERF_STAGE_H
+#define PERF_STAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PERF_SAMPLE_EVERY 64 /* one in it of a stage's runs is counted by default */
+
+namespace lu {
+
+/* hardware counters (perf_event_open) around stages of a request, counted
+ * per thread for a sample of runs : a counter read is a syscall, too much
+ * for every run of a stage. a stage run inside another one is taken out of
+ * the outer one, so each stage shows only its own work */
+class perf_stage {
+public:
+    enum STAGE {
+        STAGE_READ = 0, /* process_read : parse */
+        STAGE_REQUEST, /* do_request : route, cache lookup, open file */
+        STAGE_WRITE, /* process_write : response head & segments */
+        STAGE_FLUSH, /* flush : writev / sendmsg loop */
+        STAGE_COUNT
+    };
+    enum COUNTER {
+        CYCLES = 0,
+        INSTRUCTIONS,
+        CACHE_MISSES, /* last level cache */
+        BRANCH_MISSES,
+        DTLB_MISSES, /* dTLB load misses */
+        COUNTER_COUNT
+    };
+    struct thread_state;
+
+    /* counts a run of stage s from construction to destruction, if it is sampled */
+    class scope {
+    public:
+        inline scope(STAGE s) : _state(NULL) {
+            if(_enabled) {
+                begin(s);
+            }
+        }
+        inline ~scope() {
+            if(_state != NULL) {
+                end();
+            }
+        }
+    private:
+        void begin(STAGE s);
+        void end();
+    private:
+        thread_state *_state; /* NULL if not counted */
+        scope *_parent; /* counted stage this one runs in */
+        STAGE _stage;
+        uint64_t _begin[COUNTER_COUNT];
+        uint64_t _nested[COUNTER_COUNT]; /* counts of stages run inside */
+    };
+
+public:
+    /* count one in every runs of each stage, from now on */
+    static void enable(int every = PERF_SAMPLE_EVERY);
+    /* print counts of each thread & all of them by stage */
+    static void report();
+
+private:
+    /* counters of calling thread, opened on first use. NULL if unavailable */
+    static thread_state *state();
+
+private:
+    static bool _enabled;
+    static int _every;
+};
+
+}
+
+#endif
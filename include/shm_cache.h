@@ -0,0 +1,121 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <atomic>
+
+#include "file_cache.h"
+
+#define SHM_CACHE_SLOTS 8192 /* index slots, power of 2 */
+#define SHM_CACHE_FILL (SHM_CACHE_SLOTS * 3 / 4) /* slots taken before index is full */
+#define SHM_CACHE_PATH_MAX 256 /* like http_conn::FILENAME_LEN */
+#define SHM_CACHE_PAGE 4096 /* files start on page boundary */
+#define SHM_WORKERS_MAX 64 /* prefork workers with a stats slot */
+
+namespace lu {
+
+/* file cache of prefork workers, one copy in a memfd segment mapped before
+ * fork. layout : header (stats) | slots | content pages.
+ * index is lock-free : a slot is claimed by one CAS of its tag from empty
+ * to (hash, loading), filled & published by a release store of (hash, ready),
+ * so lookups never lock & never see a half written file. the claim is made
+ * by a CAS of the slot owner first, then its tag is set : a slot claimed or
+ * loading by a worker which died is taken over by the next one storing there. content pages are
+ * mapped read-only in every process, files are written through the memfd.
+ * nothing is ever freed : a changed file takes a new slot & new pages, the
+ * old ones stay for connctions still sending them (counted in dead & lost).
+ * when slots or pages run out, files go to the private file_cache of each
+ * worker, the first time is logged & kept in full */
+class shm_cache {
+public:
+    enum STATE {
+        SLOT_EMPTY = 0,
+        SLOT_LOADING, /* claimed, being copied */
+        SLOT_READY, /* published, read-only */
+        SLOT_DEAD /* file changed or load failed, never matches again */
+    };
+    struct slot {
+        std::atomic<uint64_t> tag; /* path hash << 2 | STATE, 0 is empty */
+        std::atomic<pid_t> owner; /* worker which claimed it, 0 if none */
+        std::atomic<int64_t> checked; /* last time st was validated, by any worker */
+        char path[SHM_CACHE_PATH_MAX];
+        uint64_t off; /* of content in content region */
+        uint64_t size;
+        ino_t ino; /* file status when it was copied */
+        time_t mtime;
+        mode_t mode;
+    };
+    /* stats of a worker, slot is its index. a cache line each, hot
+     * counters of workers do not bounce between cpus */
+    struct alignas(64) worker {
+        std::atomic<pid_t> pid; /* 0 if not running */
+        std::atomic<unsigned> restarts; /* times it was forked again after dying */
+        std::atomic<unsigned long> accepted; /* connctions */
+        std::atomic<unsigned long> hits; /* files served from segment */
+    };
+    /* shared stats & allocation state, at segment head */
+    struct header {
+        std::atomic<uint64_t> used; /* content bytes handed out */
+        std::atomic<uint32_t> taken; /* slots claimed */
+        std::atomic<uint32_t> files; /* slots ready */
+        std::atomic<unsigned long> misses; /* copied in */
+        std::atomic<unsigned long> stale; /* found changed on disk */
+        std::atomic<unsigned long> refused; /* too big or no room, left to private cache */
+        std::atomic<unsigned long> orphans; /* slots taken over from dead workers */
+        std::atomic<uint32_t> dead; /* slots which never match again */
+        std::atomic<uint64_t> lost; /* content bytes held by dead slots */
+        std::atomic<int64_t> full; /* time a file was first refused for no room, 0 if never */
+        worker workers[SHM_WORKERS_MAX];
+    };
+
+public:
+    /* segment with bytes of content, throw if it can not be made */
+    shm_cache(size_t bytes, size_t max_file = FILE_CACHE_FILE_MAX);
+    ~shm_cache();
+
+    /* ready file of path or NULL. with validate, a file not checked for
+     * FILE_CACHE_VALIDATE seconds is stat'ed, otherwise NULL is returned for
+     * it. entries are pinned, never released */
+    file_cache::entry *find(const char *path, bool validate);
+    /* copy path into segment. NULL on failure with err set to errno of
+     * open/fstat, EACCES if others can not read, EISDIR for dir, ENOSPC if
+     * it is too big, there is no room, it can not be copied or another
+     * worker is copying it : serve it from private cache then */
+    file_cache::entry *store(const char *path, int &err);
+
+    /* this process is worker i, its counters go to stats()->workers[i] */
+    inline void attach(int i) { _worker = i; }
+    /* shared stats */
+    inline header *stats() const { return _header; }
+    inline size_t capacity() const { return _capacity; }
+
+private:
+    /* entry of this process for ready slot i */
+    file_cache::entry *entry_of(uint32_t i);
+    /* reserve size bytes of content, -1 if there is no room */
+    int64_t reserve(size_t size);
+    /* pid is this process or a running worker */
+    bool alive(pid_t pid) const;
+    /* no room for a file : logged once, segment only serves what it has */
+    void note_full();
+
+    static inline uint64_t tag(uint64_t hash, STATE s) { return hash << 2 | s; }
+    static inline STATE state(uint64_t tag) { return (STATE)(tag & 3); }
+
+private:
+    int _fd; /* memfd of segment */
+    size_t _capacity; /* content bytes */
+    size_t _max_file; /* max size of one shared file */
+    size_t _index_bytes; /* header & slots, page aligned */
+    header *_header; /* shared, read & write */
+    slot *_slots;
+    char *_content; /* shared, read-only */
+    std::atomic<file_cache::entry *> *_files; /* slot => entry, private to process */
+    int _worker; /* index of this process */
+};
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SOCK_PROFILE_H
+#define SOCK_PROFILE_H
+
+namespace lu {
+
+/* tcp tuning knobs of one listener. options set on the listen socket are 
+ * inherited by accepted connctions, so the accept path only queries */
+class sock_profile {
+public:
+    sock_profile();
+
+    /* parse "nodelay,cork,sndbuf=N,rcvbuf=N,fastopen=N,busy_poll=N,incoming_cpu,zerocopy=N" */
+    bool parse(const char *spec);
+    /* before listen() : buffer sizes decide the window scale of connections.
+     * zerocopy is turned off if the socket refuses SO_ZEROCOPY */
+    void apply_listener(int listenfd);
+    /* accepted connction, return its SO_INCOMING_CPU or -1 */
+    int apply_conn(int connfd) const;
+    /* TCP_CORK on/off around writing one response */
+    void cork(int connfd, bool on) const;
+
+public:
+    bool nodelay; /* TCP_NODELAY : no Nagle delay for small responses */
+    bool corked; /* TCP_CORK while a response is written, header & body share segments */
+    int sndbuf; /* SO_SNDBUF bytes, 0 keeps kernel autotuning */
+    int rcvbuf; /* SO_RCVBUF bytes, 0 keeps kernel autotuning */
+    int fastopen; /* TCP_FASTOPEN pending queue length, 0 is off */
+    int busy_poll; /* SO_BUSY_POLL usecs, 0 is off (needs CAP_NET_ADMIN) */
+    bool incoming_cpu; /* query SO_INCOMING_CPU of accepted connctions */
+    int zerocopy; /* MSG_ZEROCOPY for file slices from this many bytes, 0 is off */
+};
+
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include <list>
 #include <cstdio>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
 #include <exception>
 
 #include "locker.h"
@@ -12,40 +16,134 @@
 
 #define THREAD_NUM_DEFAULT 8 /* default thread number */
 #define MAX_TASKS_DEFAULT 10000 /* default max tasks */
+/* elastic pool : queue wait & utilization are sampled over each interval */
+#define ELASTIC_INTERVAL_NS 100000000ull /* 100ms between sizing decisions */
+#define ELASTIC_WAIT_HIGH_NS 1000000ull /* tasks waited 1ms on average : grow */
+#define ELASTIC_WAIT_LOW_NS 100000ull /* below 100us ... */
+#define ELASTIC_UTIL_HIGH 85 /* or active threads were 85% busy : grow */
+#define ELASTIC_UTIL_LOW 30 /* ... & under 30% busy : calm interval */
+#define ELASTIC_SHRINK_CALM 20 /* calm intervals in a row before parking one thread */
+#define THREADPOOL_LANES_MAX 4 /* priority classes of tasks */
 
 namespace lu {
 
+/* fixed pool of thread_number threads, or elastic one when max_threads is
+ * above it : max_threads are created, thread_number of them take tasks at
+ * first & the rest sleep parked. active count grows fast when tasks wait in
+ * queue or active threads are busy, shrinks one at a time after a calm while.
+ * tasks may be split into priority lanes by a classifier : lane 0 first, a
+ * lane of weight w gets w tasks taken in turn while others wait, so cheap
+ * tasks keep low latency behind a burst of expensive ones & none starves */
 template<typename T>
 class threadpool {
 public:
     threadpool(int thread_number = THREAD_NUM_DEFAULT, 
-        int max_tasks = MAX_TASKS_DEFAULT);
+        int max_tasks = MAX_TASKS_DEFAULT, 
+        const int *cpus = NULL, int cpu_number = 0, int max_threads = 0);
     ~threadpool();
     bool append(T *task);
+    /* append into a lane, ignoring classifier */
+    bool append(T *task, int lane);
+    /* split queue into lanes with weights, classify picks lane of a task
+     * on append (out of range goes to last lane). call before any append */
+    bool set_lanes(int lanes, const int *weights, int (*classify)(T *task));
+    int lanes() const { return _lane_count; }
+    /* tasks taken from a lane */
+    unsigned long taken(int lane) const { return _lane_taken[lane]; }
+    void stop();
+    /* number of queued tasks */
+    int size();
+    /* contention of task queue lock */
+    lock_stats queue_stats() const { return _queue_locker.stats(); }
+    /* appends that woke an idle thread */
+    unsigned long wakeups() const { return _idle.wakes(); }
+    /* threads taking tasks now */
+    int active() const { return _active.load(std::memory_order_relaxed); }
+    /* resizes of elastic pool */
+    unsigned long grown() const { return _grown; }
+    unsigned long shrunk() const { return _shrunk; }
 
 private:
+    struct item {
+        T *task;
+        uint64_t queued; /* enqueue time, elastic pool only */
+    };
     static void *working(void *arg);
     void run();
+    /* lane to take next task from, queue lock held & some lane not empty */
+    int pick();
+    /* elastic pool : resize when an interval is over */
+    void adjust(uint64_t now);
+    static inline uint64_t now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
 
 private:
     int _thread_number; /* thread number */
+    int _min_threads; /* elastic bounds of active threads */
+    int _max_threads;
+    bool _elastic; /* max is above min */
     int _max_tasks; /* max length of tasks */
     pthread_t *_threads; /* threads array */
-    std::list<T *> _task_queue /* task queue */;
+    std::list<item> _task_queue[THREADPOOL_LANES_MAX] /* task queue of each lane */;
+    int _queued; /* tasks of all lanes */
+    int _lane_count; /* lanes in use */
+    int _weights[THREADPOOL_LANES_MAX]; /* tasks taken from a lane per round */
+    int _credits[THREADPOOL_LANES_MAX]; /* left of weights in this round */
+    unsigned long _lane_taken[THREADPOOL_LANES_MAX];
+    int (*_classify)(T *task); /* lane of a task, NULL puts all into lane 0 */
     locker _queue_locker; /* mutex of task queue */
-    sem _queue_stat; /* task number */
+    eventcount _idle; /* threads with nothing to do sleep on it */
+    eventcount _parked; /* threads beyond active count sleep on it */
+    std::atomic<int> _active; /* threads 0 .. _active - 1 take tasks */
+    std::atomic<int> _started; /* index of next thread to start */
     bool _stop; /* is or not stop thread */
+    /* sampling of current interval, counters under queue lock */
+    std::atomic<uint64_t> _window; /* start of interval */
+    uint64_t _wait_ns; /* queue wait of tasks taken in interval */
+    uint64_t _taken;
+    std::atomic<uint64_t> _busy_ns; /* time spent in process() */
+    int _calm; /* calm intervals in a row */
+    unsigned long _grown;
+    unsigned long _shrunk;
 };
 
+/* if cpus is given, the ith thread is pinned to cpus[i % cpu_number] 
+ * before it starts, so its stack & everything it touches first is node local */
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_tasks) 
-    : _thread_number(thread_number), 
+threadpool<T>::threadpool(int thread_number, int max_tasks, 
+    const int *cpus, int cpu_number, int max_threads) 
+    : _thread_number(max_threads > thread_number ? max_threads : thread_number), 
+    _min_threads(thread_number),
+    _max_threads(_thread_number),
+    _elastic(max_threads > thread_number),
     _max_tasks(max_tasks), 
     _threads(NULL),
-    _stop(false)  {
+    _queued(0),
+    _lane_count(1),
+    _classify(NULL),
+    _active(thread_number),
+    _started(0),
+    _stop(false),
+    _window(0),
+    _wait_ns(0),
+    _taken(0),
+    _busy_ns(0),
+    _calm(0),
+    _grown(0),
+    _shrunk(0)  {
     if(thread_number <= 0 || max_tasks <= 0) {
         throw std::exception();   
     }
+    if(_elastic) {
+        _window = now_ns();
+    }
+    for(int i = 0; i < THREADPOOL_LANES_MAX; i++) {
+        _weights[i] = _credits[i] = 1;
+        _lane_taken[i] = 0;
+    }
     // create threads
     _threads = new pthread_t[_thread_number];
     if(_threads == NULL) {
@@ -55,12 +153,19 @@ threadpool<T>::threadpool(int thread_number, int max_tasks)
 #ifdef __DEBUG
         printf( "create the %dth thread\n", i);
 #endif
-        if(pthread_create(&_threads[i], NULL, working, this) != 0) {
-            delete [] _threads;
-            throw std::exception();
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(cpus != NULL && cpu_number > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpu_number], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
         }
-        // set thread detach
-        if(pthread_detach(_threads[i]) != 0) {
+        int ret = pthread_create(&_threads[i], &attr, working, this);
+        pthread_attr_destroy(&attr);
+        if(ret != 0) {
+            _thread_number = i;
+            stop();
             delete [] _threads;
             throw std::exception();
         }
@@ -69,24 +174,83 @@ threadpool<T>::threadpool(int thread_number, int max_tasks)
 
 template<typename T>
 threadpool<T>::~threadpool() {
+    stop();
     delete [] _threads;
+}
+
+/* let threads finish queued tasks, then wake & join them */
+template<typename T>
+void threadpool<T>::stop() {
+    if(_stop) {
+        return;
+    }
+    _queue_locker.lock();
     _stop = true;
+    _queue_locker.unlock();
+    _idle.notify_all();
+    _parked.notify_all();
+    for(int i = 0; i < _thread_number; i++) {
+        pthread_join(_threads[i], NULL);
+    }
 }
 
-/* push task into task queue */
+template<typename T>
+bool threadpool<T>::set_lanes(int lanes, const int *weights, int (*classify)(T *task)) {
+    if(lanes <= 0 || lanes > THREADPOOL_LANES_MAX) {
+        return false;
+    }
+    for(int i = 0; i < lanes; i++) {
+        if(weights[i] <= 0) {
+            return false;
+        }
+    }
+    _queue_locker.lock();
+    for(int i = 0; i < lanes; i++) {
+        _weights[i] = _credits[i] = weights[i];
+    }
+    _lane_count = lanes;
+    _classify = classify;
+    _queue_locker.unlock();
+    return true;
+}
+
+/* push task into task queue, lane by classifier */
 template<typename T>
 bool threadpool<T>::append(T *task) {
+    return append(task, _classify != NULL ? _classify(task) : 0);
+}
+
+/* push task into task queue */
+template<typename T>
+bool threadpool<T>::append(T *task, int lane) {
+    if(lane < 0 || lane >= _lane_count) {
+        lane = _lane_count - 1;
+    }
     _queue_locker.lock();
-    if(_task_queue.size() > _max_tasks) {
+    if(_stop || _queued >= _max_tasks) {
         _queue_locker.unlock();
         return false;    
     }
-    _task_queue.push_back(task);
+    uint64_t now = _elastic ? now_ns() : 0;
+    _task_queue[lane].push_back(item{task, now});
+    _queued++;
     _queue_locker.unlock();
-    _queue_stat.post();
+    _idle.notify_one(); /* no syscall while all threads are busy */
+    if(_elastic) {
+        adjust(now);
+    }
     return true;
 }
 
+/* number of queued tasks */
+template<typename T>
+int threadpool<T>::size() {
+    _queue_locker.lock();
+    int size = _queued;
+    _queue_locker.unlock();
+    return size;
+}
+
 template<typename T>
 void *threadpool<T>::working(void *arg) {
     threadpool *pool = static_cast<threadpool *>(arg);
@@ -97,22 +261,142 @@ void *threadpool<T>::working(void *arg) {
 /* keep getting task from task queue for working thread */
 template<typename T>
 void threadpool<T>::run() {
-    while(!_stop) {
-        _queue_stat.wait();
+    const int index = _started.fetch_add(1);
+    while(true) {
+        if(index >= _active.load(std::memory_order_acquire)) {
+            /* parked : a notify for tasks may have come to it, pass it on */
+            _idle.notify_one();
+            uint32_t key = _parked.prepare_wait();
+            _queue_locker.lock();
+            bool stop = _stop;
+            _queue_locker.unlock();
+            if(stop) {
+                _parked.cancel_wait();
+                break;
+            }
+            if(index >= _active.load(std::memory_order_acquire)) {
+                _parked.wait(key);
+            } else {
+                _parked.cancel_wait();
+            }
+            continue;
+        }
         _queue_locker.lock();
-        if(_task_queue.empty()) {
+        if(_queued == 0) {
+            bool stop = _stop;
+            _queue_locker.unlock();
+            if(stop) {
+                break;
+            }
+            /* look again after announcing the wait, an append in between 
+             * moves the event count on & wait returns at once */
+            uint32_t key = _idle.prepare_wait();
+            _queue_locker.lock();
+            bool idle = _queued == 0 && !_stop;
             _queue_locker.unlock();
+            if(idle) {
+                _idle.wait(key);
+            } else {
+                _idle.cancel_wait();
+            }
             continue;
         }
-        T* task = _task_queue.front();
-        _task_queue.pop_front();
+        int lane = pick();
+        item it = _task_queue[lane].front();
+        _task_queue[lane].pop_front();
+        _queued--;
+        _lane_taken[lane]++;
+        uint64_t begin = 0;
+        if(_elastic) {
+            begin = now_ns();
+            _wait_ns += begin - it.queued;
+            _taken++;
+        }
         _queue_locker.unlock();
-        if(task != NULL) {
-            task->process();
+        if(it.task != NULL) {
+            it.task->process();
+        }
+        if(_elastic) {
+            uint64_t end = now_ns();
+            _busy_ns.fetch_add(end - begin, std::memory_order_relaxed);
+            adjust(end);
         }
     }
 }
 
+/* weighted round robin : first lane in order with tasks & credit left. when
+ * every lane with tasks is out of credit, a new round begins */
+template<typename T>
+int threadpool<T>::pick() {
+    while(true) {
+        for(int i = 0; i < _lane_count; i++) {
+            if(!_task_queue[i].empty() && _credits[i] > 0) {
+                _credits[i]--;
+                return i;
+            }
+        }
+        for(int i = 0; i < _lane_count; i++) {
+            _credits[i] = _weights[i];
+        }
+    }
 }
 
-#endif
\ No newline at end of file
+/* at most one decision per interval, by whoever finds it over first. grow by
+ * a quarter at once, shrink by one thread after ELASTIC_SHRINK_CALM calm
+ * intervals, so a short lull does not give back what a burst needed */
+template<typename T>
+void threadpool<T>::adjust(uint64_t now) {
+    uint64_t window = _window.load(std::memory_order_relaxed);
+    if(now < window + ELASTIC_INTERVAL_NS || !_queue_locker.try_lock()) {
+        return;
+    }
+    window = _window.load(std::memory_order_relaxed);
+    if(now < window + ELASTIC_INTERVAL_NS || _stop) {
+        _queue_locker.unlock();
+        return;
+    }
+    int active = _active.load(std::memory_order_relaxed);
+    uint64_t wait = _taken > 0 ? _wait_ns / _taken : 0;
+    uint64_t busy = _busy_ns.exchange(0, std::memory_order_relaxed);
+    uint64_t util = busy * 100 / ((now - window) * active);
+    int backlog = _queued;
+    int next = active;
+    if(wait > ELASTIC_WAIT_HIGH_NS || util > ELASTIC_UTIL_HIGH || backlog > active) {
+        next = active + (active / 4 > 0 ? active / 4 : 1);
+        next = next < _max_threads ? next : _max_threads;
+        _calm = 0;
+    } else if(wait < ELASTIC_WAIT_LOW_NS && util < ELASTIC_UTIL_LOW) {
+        if(++_calm >= ELASTIC_SHRINK_CALM && active > _min_threads) {
+            next = active - 1;
+            _calm = 0;
+        }
+    } else {
+        _calm = 0;
+    }
+    _wait_ns = 0;
+    _taken = 0;
+    _window.store(now, std::memory_order_relaxed);
+    if(next > active) {
+        _grown++;
+    } else if(next < active) {
+        _shrunk++;
+    }
+    _active.store(next, std::memory_order_release);
+    _queue_locker.unlock();
+#ifdef __DEBUG
+    if(next != active) {
+        printf("threadpool : %d => %d threads, wait %luus, util %lu%%, backlog %d\n",
+            active, next, (unsigned long)(wait / 1000), (unsigned long)util, backlog);
+    }
+#endif
+    if(next > active) {
+        _parked.notify_all();
+    } else if(next < active) {
+        /* idle ones beyond count wake up & move over to park */
+        _idle.notify_all();
+    }
+}
+
+}
+
+#endif
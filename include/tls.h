@@ -0,0 +1,38 @@
+#ifndef TLS_H
+#define TLS_H
+
+#ifdef __TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+namespace lu {
+
+/* server side tls : certificate, key & settings shared by all connctions.
+ * handshakes run in user space, records go to kernel tls (ktls) after that
+ * when both openssl & kernel support it */
+class tls_context {
+public:
+    /* load pem certificate chain & private key, throw if they are not usable */
+    tls_context(const char *cert, const char *key);
+    ~tls_context();
+
+    /* tls session of an accepted connction, NULL on failure */
+    SSL *create(int connfd) const;
+    /* is record layer of sending in kernel : plain writev on socket is encrypted */
+    static bool ktls_send(SSL *ssl);
+
+private:
+    /* ALPN : h2 if client offers it, else http/1.1 */
+    static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+        const unsigned char *in, unsigned int inlen, void *arg);
+
+private:
+    SSL_CTX *_ctx;
+};
+
+}
+
+#endif
+
+#endif
@@ -9,6 +9,8 @@
 #include <cassert>
 #include <string.h> 
 #include <sys/socket.h> 
+#include <pthread.h>
+#include <sched.h>
 
 namespace lu {
 
@@ -26,6 +28,30 @@ public:
     static void removefd(int epollfd, int fd);
     /* modify fd */
     static void modifyfd(int epollfd, int fd, int ev);
+    /* arm fd like modifyfd, adding it to epoll if it is not there yet */
+    static void armfd(int epollfd, int fd, int ev);
+
+    /* Content-Length value : decimal digits between optional blanks, at 
+     * most max. false for anything else, eg: sign, empty, overflow */
+    static bool parse_length(const char *value, long max, long &length);
+    /* Accept-Encoding value allows gzip : listed with q > 0, or not listed and
+     * '*' is with q > 0. "gzip;q=0" or "*;q=0" refuse it */
+    static bool accepts_gzip(const char *value);
+    /* parse cpu list like "0-3,8,10-11" into cpus, return cpu count or -1 */
+    static int parse_cpu_list(const char *list, int *cpus, int max);
+    /* numa node of cpu, 0 if unknown */
+    static int cpu_node(int cpu);
+    /* cpus belong to numa node, return cpu count or -1 */
+    static int node_cpus(int node, int *cpus, int max);
+    /* pin thread to one cpu */
+    static bool pin_thread(pthread_t thread, int cpu);
+    /* prefer allocating pages of [addr, addr + len) from numa node */
+    static bool bind_node(void *addr, size_t len, int node);
+
+    /* pass fd to the process on the other end of unix socket (SCM_RIGHTS) */
+    static bool send_fd(int sock, int fd);
+    /* receive fd passed by send_fd, -1 on failure */
+    static int recv_fd(int sock);
 };
 
 }
@@ -0,0 +1,139 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <netinet/in.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "locker.h"
+
+#define UPSTREAM_FD_MAX 65536 /* upstream fds are below it, like connction fds */
+#define UPSTREAM_IDLE_MAX 32 /* idle keep-alive connections kept per backend */
+#define UPSTREAM_FAILS_MAX 3 /* failures in a row that take a backend out */
+#define UPSTREAM_CHECK_INTERVAL 2 /* seconds between health checks of a backend */
+#define UPSTREAM_BUFFER_SIZE (16 * 1024) /* response head & body relayed by copy */
+#define UPSTREAM_SPLICE_MIN (16 * 1024) /* bodies from this size go by splice */
+#define UPSTREAM_PIPE_SIZE (64 * 1024) /* bytes moved by one splice */
+
+namespace lu {
+
+class http_conn;
+
+/* proxy routes & pools of persistent non-blocking connctions to their backends.
+ * backend of a request is the healthy one with least outstanding requests.
+ * health : UPSTREAM_FAILS_MAX failed exchanges in a row take a backend out,
+ * a tcp connect probe every UPSTREAM_CHECK_INTERVAL decides when it is back */
+class upstream_pool {
+public:
+    struct backend;
+    /* connction to a backend, lent to one client connction at a time */
+    struct conn {
+        int fd; /* nonblocking socket */
+        int pipe[2]; /* splice pipe, created on first use & kept with the socket */
+        backend *be; /* backend it connects to */
+        bool reused; /* taken from idle pool, may have been closed by backend */
+        http_conn *owner; /* client connction relaying on it */
+    };
+    struct backend {
+        sockaddr_in addr; /* backend address */
+        char name[32]; /* ip:port */
+        int outstanding; /* requests in flight */
+        int fails; /* failed exchanges in a row */
+        bool healthy; /* takes requests */
+        std::vector<conn *> idle; /* keep-alive connctions, last released on back */
+        int probe_fd; /* health check connect in progress, -1 if none */
+        time_t next_check; /* time of next health check */
+    };
+    /* urls starting with prefix go to backends */
+    struct route {
+        std::string prefix;
+        std::vector<backend *> backends;
+        unsigned next; /* round robin start among equally loaded backends */
+    };
+
+public:
+    upstream_pool();
+    ~upstream_pool();
+
+    /* add route "/prefix=ip:port[,ip:port...]" */
+    bool add_route(const char *spec);
+    /* route of canonical path (path_cache::canonicalize), NULL if it is not
+     * proxied. a prefix ends on a segment boundary */
+    route *match(const char *path);
+    /* connction to the least outstanding healthy backend of route, idle one
+     * first unless fresh. NULL if no backend can take it */
+    conn *acquire(route *r, http_conn *owner, bool fresh = false);
+    /* exchange on c is over : keep it for next request if reusable, failed
+     * counts against its backend */
+    void release(conn *c, bool reusable, bool failed);
+    /* lent connction of fd, NULL if fd is not one */
+    inline conn *lent(int fd) const {
+        return fd >= 0 && fd < UPSTREAM_FD_MAX ? _lent[fd].load(std::memory_order_acquire) : NULL;
+    }
+    /* health checks due by now, called on reactor ticks */
+    void check(time_t now);
+
+private:
+    /* new nonblocking connction to backend, -1 if connect fails at once */
+    static int connect_backend(const backend *be);
+    /* is idle connction still open, nothing may be readable on it */
+    static bool alive(const conn *c);
+    static void destroy(conn *c);
+
+private:
+    std::vector<route *> _routes;
+    std::atomic<conn *> *_lent; /* fd => lent connction, set by working threads */
+    locker _locker; /* connections are acquired by working threads */
+};
+
+/* one proxied request : request goes out on conn, response comes back
+ * rewritten for client. body is relayed as it is, its end is found by
+ * Content-Length, chunked encoding or backend closing */
+struct upstream_exchange {
+    enum BODY {
+        BODY_NONE = 0, /* 1xx, 204, 304 */
+        BODY_LENGTH, /* Content-Length */
+        BODY_CHUNKED, /* Transfer-Encoding: chunked */
+        BODY_EOF /* until backend closes */
+    };
+    enum CHUNK {
+        CHUNK_SIZE = 0, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF,
+        CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_END
+    };
+
+    upstream_exchange();
+
+    /* response head in buf : rewrite it into head with our Connection header
+     * & keep body bytes behind it in buf. 1 done, 0 more bytes, -1 bad response */
+    int take_head(bool keep_alive);
+    /* body bytes came, return how many belong to this response */
+    int scan(const char *data, int len);
+    /* has client got any byte of response */
+    inline bool responded() const { return head_sent > 0; }
+
+    upstream_pool::conn *up; /* connction request goes on */
+    std::string req; /* request for backend */
+    size_t req_sent; /* bytes of req sent */
+
+    char buf[UPSTREAM_BUFFER_SIZE]; /* response bytes from backend */
+    int buf_len; /* bytes in buf */
+    int buf_sent; /* bytes of buf sent to client */
+    bool head_done; /* response head is parsed */
+    std::string head; /* response head for client */
+    size_t head_sent; /* bytes of head sent */
+    int pipe_bytes; /* body bytes in splice pipe */
+
+    BODY body; /* how body ends */
+    long remaining; /* body bytes not received, or bytes left of current chunk */
+    CHUNK chunk; /* chunked body parse state */
+    bool done; /* whole response received */
+    bool reusable; /* backend keeps connction open after it */
+    bool keep_alive; /* client connction stays open after it */
+    bool up_failed; /* exchange failed on backend side */
+};
+
+}
+
+#endif
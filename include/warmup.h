@@ -0,0 +1,68 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "locker.h"
+#include "file_cache.h"
+#include "bundle.h"
+
+#define WARM_MLOCK 1 /* lock hot pages in memory */
+#define WARM_HUGEPAGE 2 /* ask for transparent huge pages (MADV_HUGEPAGE) */
+#define WARM_RANGE_BYTES (4 * 1024 * 1024) /* bundle is faulted in by ranges of it */
+
+namespace lu {
+
+/* startup warm-up of the hot set before listening : files are mapped into
+ * the file cache (or bundle pages faulted in) by a pool of threads, with
+ * MADV_WILLNEED & optionally mlock / transparent huge pages */
+class warmup {
+public:
+    /* one file or bundle range, task of threadpool */
+    struct task {
+        warmup *owner;
+        std::string path; /* file path in server, empty for range */
+        char *addr; /* range of bundle */
+        size_t len;
+        void process();
+    };
+
+public:
+    warmup(file_cache *cache, bundle *assets);
+
+    /* parse "all|<manifest>[,mlock][,hugepage]". all is every file of document
+     * root, manifest lists urls one per line, '#' starts a comment */
+    bool parse(const char *spec);
+    /* warm hot set with threads, return when it is done */
+    void run(int thread_number, const int *cpus, int cpu_number);
+
+    /* advise & fault in pages of [addr, addr + len), false if mlock failed */
+    static bool touch(char *addr, size_t len, int policy);
+
+private:
+    /* hot url of manifest */
+    void add_url(const char *url);
+    /* every file under dir */
+    void add_tree(const std::string &dir);
+    /* one task done */
+    void done(size_t bytes, bool ok, bool locked);
+
+private:
+    file_cache *_cache;
+    bundle *_assets; /* NULL if document root is served from disk */
+    int _policy; /* WARM_* flags */
+    std::vector<task> _tasks;
+
+    /* statistics, updated by threads */
+    locker _locker;
+    int _files; /* files or ranges warmed */
+    int _failed; /* files can not be loaded */
+    int _unlocked; /* mlock failed, eg: RLIMIT_MEMLOCK */
+    size_t _bytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <exception>
+#include <new>
+
+namespace lu {
+
+std::atomic<int> buffer_pool::_pools(0);
+thread_local buffer_pool::cache buffer_pool::_caches[BUFFER_POOLS_MAX];
+
+arena::arena(size_t bytes) : _base(NULL), _size(0), _used(0), _backing(BACKING_PAGES) {
+    _size = (bytes + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+    if(_size == 0) {
+        throw std::exception();
+    }
+    /* hugetlbfs : fails at once unless enough pages are reserved (vm.nr_hugepages) */
+    void *p = mmap(NULL, _size, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED) {
+        _base = (char *)p;
+        _backing = BACKING_HUGETLB;
+        return;
+    }
+    /* map one more huge page to start on a 2MB boundary, kernel backs only
+     * aligned 2MB ranges by transparent huge pages */
+    size_t len = _size + ARENA_HUGE_PAGE;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        throw std::exception();
+    }
+    char *start = (char *)(((uintptr_t)p + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+    if(start > (char *)p) {
+        munmap(p, start - (char *)p);
+    }
+    if(start + _size < (char *)p + len) {
+        munmap(start + _size, (char *)p + len - (start + _size));
+    }
+    _base = start;
+    _backing = madvise(_base, _size, MADV_HUGEPAGE) == 0 ? BACKING_THP : BACKING_PAGES;
+}
+
+arena::~arena() {
+    munmap(_base, _size);
+}
+
+void *arena::alloc(size_t size, size_t align) {
+    size_t used = _used.load(std::memory_order_relaxed);
+    while(true) {
+        size_t off = (used + align - 1) & ~(align - 1);
+        if(off + size > _size) {
+            return NULL;
+        }
+        if(_used.compare_exchange_weak(used, off + size, std::memory_order_relaxed)) {
+            return _base + off;
+        }
+    }
+}
+
+const char *arena::backing_name() const {
+    switch(_backing) {
+        case BACKING_HUGETLB: return "hugetlbfs pages";
+        case BACKING_THP: return "transparent huge pages";
+        default: return "regular pages";
+    }
+}
+
+/* sum huge page fields of mappings inside arena, which mbind may have split */
+size_t arena::huge_bytes() const {
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if(fp == NULL) {
+        return 0;
+    }
+    size_t kb = 0;
+    bool inside = false;
+    char line[256];
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long lo, hi, n;
+        if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2 && strchr(line, ':') > strchr(line, ' ')) {
+            inside = (char *)lo >= _base && (char *)hi <= _base + _size;
+        } else if(inside && (sscanf(line, "AnonHugePages: %lu kB", &n) == 1 
+            || sscanf(line, "Private_Hugetlb: %lu kB", &n) == 1)) {
+            kb += n;
+        }
+    }
+    fclose(fp);
+    return kb << 10;
+}
+
+buffer_pool::buffer_pool(arena *a, size_t size) 
+    : _arena(a), 
+    _size((size + 63) & ~(size_t)63), 
+    _id(_pools.fetch_add(1)), 
+    _free(NULL), 
+    _spilled(0) {
+    if(_id >= BUFFER_POOLS_MAX) {
+        throw std::exception();
+    }
+}
+
+/* buffers are arena memory, they go with it */
+buffer_pool::~buffer_pool() {}
+
+void *buffer_pool::get() {
+    cache &c = _caches[_id];
+    if(c.head == NULL) {
+        _locker.lock();
+        while(_free != NULL && c.count < BUFFER_REFILL) {
+            node *n = _free;
+            _free = n->next;
+            n->next = c.head;
+            c.head = n;
+            c.count++;
+        }
+        _locker.unlock();
+    }
+    if(c.head == NULL) {
+        char *p = (char *)_arena->alloc(_size * BUFFER_REFILL);
+        if(p == NULL) {
+            _spilled.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(_size);
+        }
+        for(int i = BUFFER_REFILL - 1; i >= 0; i--) {
+            node *n = (node *)(p + i * _size);
+            n->next = c.head;
+            c.head = n;
+            c.count++;
+        }
+    }
+    node *n = c.head;
+    c.head = n->next;
+    c.count--;
+    return n;
+}
+
+void buffer_pool::put(void *p) {
+    if(!_arena->owns(p)) {
+        ::operator delete(p);
+        return;
+    }
+    cache &c = _caches[_id];
+    node *n = (node *)p;
+    n->next = c.head;
+    c.head = n;
+    if(++c.count > BUFFER_CACHE_MAX) {
+        give_back(c, BUFFER_CACHE_MAX / 2);
+    }
+}
+
+void buffer_pool::give_back(cache &c, int n) {
+    node *first = c.head, *last = c.head;
+    for(int i = 1; i < n; i++) {
+        last = last->next;
+    }
+    c.head = last->next;
+    c.count -= n;
+    _locker.lock();
+    last->next = _free;
+    _free = first;
+    _locker.unlock();
+}
+
+}
@@ -0,0 +1,34 @@
+#include "async_io.h"
+#include "warmup.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace lu {
+
+async_io::async_io(int thread_number) : _pool(thread_number) {}
+
+/* is [addr, addr + len) of a mapping in page cache */
+bool async_io::resident(const char *addr, size_t len) {
+    static const long page = sysconf(_SC_PAGESIZE);
+    char *start = (char *)((unsigned long)addr & ~(page - 1));
+    size_t pages = (addr + len - start + page - 1) / page;
+    unsigned char vec[ASYNC_IO_WINDOW / 4096 + 2];
+    if(pages > sizeof(vec) || mincore(start, pages * page, vec) != 0) {
+        return true; /* can not tell, let the sender fault */
+    }
+    for(size_t i = 0; i < pages; i++) {
+        if(!(vec[i] & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* on io thread : readahead & fault the range in, then call back */
+void async_io::job::process() {
+    warmup::touch(addr, len, 0);
+    done(arg);
+}
+
+}
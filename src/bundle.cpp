@@ -0,0 +1,105 @@
+#include "bundle.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <exception>
+
+namespace lu {
+
+/* map bundle file, throw if it is not a valid bundle */
+bundle::bundle(const char *path) : _data(NULL), _size(0) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+        printf("bundle %s can not be opened\n", path);
+        if(fd >= 0) {
+            ::close(fd);
+        }
+        throw std::exception();
+    }
+    _size = st.st_size;
+    _data = (char *)mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(_data == MAP_FAILED) {
+        perror("bundle mmap");
+        throw std::exception();
+    }
+    _header = (const header *)_data;
+    _slots = (const slot *)(_data + sizeof(header));
+    _entries = (const entry *)(_slots + _header->slots);
+
+    /* trust nothing in the file before it is checked against its size */
+    bool valid = memcmp(_header->magic, BUNDLE_MAGIC, 8) == 0 && _header->size == _size
+        && _header->slots > 0 && (_header->slots & (_header->slots - 1)) == 0
+        && _header->count < _header->slots
+        && sizeof(header) + (uint64_t)_header->slots * sizeof(slot) 
+            + (uint64_t)_header->count * sizeof(entry) <= _size;
+    for(uint32_t i = 0; valid && i < _header->count; i++) {
+        const entry &e = _entries[i];
+        valid = (uint64_t)e.path_off + e.path_len <= _size 
+            && (uint64_t)e.head_off + e.head_len <= _size
+            && (uint64_t)e.gz_head_off + e.gz_head_len <= _size
+            && e.body_off <= _size && e.body_len <= _size - e.body_off
+            && e.gz_off <= _size && e.gz_len <= _size - e.gz_off;
+    }
+    uint32_t empty = 0; /* a probe ends on an empty slot, there must be one */
+    for(uint32_t i = 0; valid && i < _header->slots; i++) {
+        valid = _slots[i].entry <= _header->count;
+        empty += _slots[i].entry == 0;
+    }
+    valid = valid && empty > 0;
+    if(!valid) {
+        printf("bundle %s is broken\n", path);
+        munmap(_data, _size);
+        throw std::exception();
+    }
+
+    /* files handed to connctions point into the mapping & are never released */
+    _files.resize(_header->count * 2);
+    for(uint32_t i = 0; i < _header->count; i++) {
+        const entry &e = _entries[i];
+        for(int gz = 0; gz < 2; gz++) {
+            file_cache::entry &f = _files[i * 2 + gz];
+            f.path.assign(_data + e.path_off, e.path_len);
+            bzero(&f.st, sizeof(f.st));
+            f.st.st_mode = S_IFREG | 0444;
+            f.st.st_size = gz ? e.gz_len : e.body_len;
+            f.st.st_mtime = e.mtime;
+            f.address = _data + (gz ? e.gz_off : e.body_off);
+            f.checked = 0;
+            f.refs = 1;
+            f.cached = false;
+            f.pinned = true;
+            f.head = _data + (gz ? e.gz_head_off : e.head_off);
+            f.head_len = gz ? e.gz_head_len : e.head_len;
+        }
+    }
+}
+
+bundle::~bundle() {
+    munmap(_data, _size);
+}
+
+/* file of url (query string ignored), gzip variant if client accepts it
+ * & there is one. NULL if url is not packed. the file is never released */
+file_cache::entry *bundle::find(const char *url, bool gzip) {
+    size_t len = strcspn(url, "?");
+    uint64_t h = hash(url, len);
+    uint32_t mask = _header->slots - 1;
+    for(uint32_t i = h & mask; _slots[i].entry != 0; i = (i + 1) & mask) {
+        if(_slots[i].hash != h) {
+            continue;
+        }
+        uint32_t idx = _slots[i].entry - 1;
+        const entry &e = _entries[idx];
+        if(e.path_len == len && memcmp(_data + e.path_off, url, len) == 0) {
+            return &_files[idx * 2 + (gzip && e.gz_len > 0 ? 1 : 0)];
+        }
+    }
+    return NULL;
+}
+
+}
@@ -0,0 +1,106 @@
+#include "conn_limiter.h"
+
+#include <exception>
+#include <string.h>
+
+namespace lu {
+
+conn_limiter::conn_limiter(int capacity, int max_per_ip) 
+    : _slots(NULL), _mask(0), _shift(31), _size(0), _max_per_ip(max_per_ip) {
+    if(capacity <= 0 || max_per_ip <= 0) {
+        throw std::exception();
+    }
+    uint32_t cap = 2; /* one slot is kept empty */
+    while(cap < (uint32_t)capacity) {
+        cap <<= 1;
+        _shift--;
+    }
+    _slots = new slot[cap];
+    bzero(_slots, sizeof(slot) * cap);
+    _mask = cap - 1;
+}
+
+conn_limiter::~conn_limiter() {
+    delete [] _slots;
+}
+
+/* slot index of ip, or the empty slot ends its probe sequence */
+uint32_t conn_limiter::find(uint32_t ip) {
+    uint32_t i = hash(ip);
+    while(_slots[i].cnt != 0 && _slots[i].ip != ip) {
+        i = (i + 1) & _mask;
+    }
+    return i;
+}
+
+/* count one more connection of ip, false if ip is at limit or table is full */
+bool conn_limiter::acquire(uint32_t ip) {
+    _locker.lock();
+    uint32_t i = find(ip);
+    if(_slots[i].cnt == 0) {
+        /* keep one slot empty at least, so probing always ends */
+        if((uint32_t)_size >= _mask) {
+            _locker.unlock();
+            return false;
+        }
+        _slots[i].ip = ip;
+        _size++;
+    } else if(_slots[i].cnt >= (uint32_t)_max_per_ip) {
+        _locker.unlock();
+        return false;
+    }
+    _slots[i].cnt++;
+    _locker.unlock();
+    return true;
+}
+
+/* count one less connection of ip */
+void conn_limiter::release(uint32_t ip) {
+    _locker.lock();
+    uint32_t i = find(ip);
+    if(_slots[i].cnt == 0 || --_slots[i].cnt != 0) {
+        _locker.unlock();
+        return;
+    }
+    /* slot becomes empty : shift following entries back to keep probe sequences */
+    _size--;
+    uint32_t j = i;
+    while(true) {
+        j = (j + 1) & _mask;
+        if(_slots[j].cnt == 0) {
+            break;
+        }
+        uint32_t home = hash(_slots[j].ip);
+        /* move j to i only if its home is not in (i, j] cyclically */
+        bool stay = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if(!stay) {
+            _slots[i] = _slots[j];
+            _slots[j].cnt = 0;
+            i = j;
+        }
+    }
+    _locker.unlock();
+}
+
+/* longest distance of an ip from its home slot, 0 if none is displaced */
+uint32_t conn_limiter::max_probe() {
+    uint32_t longest = 0;
+    _locker.lock();
+    for(uint32_t i = 0; i <= _mask; i++) {
+        if(_slots[i].cnt != 0 && ((i - hash(_slots[i].ip)) & _mask) > longest) {
+            longest = (i - hash(_slots[i].ip)) & _mask;
+        }
+    }
+    _locker.unlock();
+    return longest;
+}
+
+/* current connections of ip */
+int conn_limiter::count(uint32_t ip) {
+    _locker.lock();
+    int cnt = _slots[find(ip)].cnt;
+    _locker.unlock();
+    return cnt;
+}
+
+}
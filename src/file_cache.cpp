@@ -0,0 +1,262 @@
+#include "file_cache.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace lu {
+
+file_cache::file_cache(size_t max_bytes, size_t max_file) 
+    : _max_bytes(max_bytes), 
+    _max_file(max_file), 
+    _bytes(0), 
+    _hits(0), 
+    _misses(0),
+    _coalesced(0) {}
+
+file_cache::~file_cache() {
+    /* connections are gone by now */
+    for(std::list<entry *>::iterator it = _lru.begin(); it != _lru.end(); ++it) {
+        destroy(*it);
+    }
+}
+
+/* fresh cached entry of path or NULL, never touches disk */
+file_cache::entry *file_cache::lookup(const char *path) {
+    entry *e = NULL;
+    _locker.lock();
+    std::unordered_map<std::string, entry *>::iterator it = _map.find(path);
+    if(it != _map.end() && time(NULL) - it->second->checked < FILE_CACHE_VALIDATE) {
+        e = it->second;
+        e->refs++;
+        _lru.splice(_lru.begin(), _lru, e->lru);
+        _hits++;
+    }
+    _locker.unlock();
+    return e;
+}
+
+long file_cache::cached_size(const char *path) {
+    long size = -1;
+    _locker.lock();
+    std::unordered_map<std::string, entry *>::iterator it = _map.find(path);
+    if(it != _map.end()) { /* a stale one costs a stat at most */
+        size = it->second->st.st_size;
+    }
+    _locker.unlock();
+    return size;
+}
+
+/* entry of path, mapped on miss. NULL on failure with err set to errno
+ * of stat/open/mmap, EACCES if others can not read, EISDIR for dir.
+ * with w, a miss of a path another thread is loading parks w : NULL with
+ * err EINPROGRESS, w->wake is called once that load is over */
+file_cache::entry *file_cache::acquire(const char *path, int &err, const waiter *w) {
+    time_t now = time(NULL);
+    _locker.lock();
+    std::unordered_map<std::string, entry *>::iterator it = _map.find(path);
+    if(it != _map.end()) {
+        entry *e = it->second;
+        bool fresh = now - e->checked < FILE_CACHE_VALIDATE;
+        if(!fresh) {
+            /* stat under lock is cheap compare to remap, and only once per period */
+            struct stat st;
+            fresh = stat(path, &st) == 0 && st.st_ino == e->st.st_ino 
+                && st.st_size == e->st.st_size && st.st_mtime == e->st.st_mtime;
+            if(fresh) {
+                e->checked = now;
+            } else {
+                remove(e);
+            }
+        }
+        if(fresh) {
+            e->refs++;
+            _lru.splice(_lru.begin(), _lru, e->lru);
+            _hits++;
+            _locker.unlock();
+            return e;
+        }
+    }
+    /* single flight : first miss loads, later ones park until it is over.
+     * a too big file is mapped by each request, as woken ones would only
+     * miss again & park behind each other */
+    bool uncached = _uncached.count(path) != 0;
+    bool loader = false;
+    std::string key;
+    if(!uncached) {
+        std::unordered_map<std::string, std::vector<waiter> >::iterator flight = _loading.find(path);
+        loader = flight == _loading.end();
+        if(loader) {
+            flight = _loading.emplace(path, std::vector<waiter>()).first;
+        } else if(w != NULL) {
+            flight->second.push_back(*w);
+            _coalesced++;
+            _locker.unlock();
+            err = EINPROGRESS;
+            return NULL;
+        }
+        key = flight->first;
+    }
+    /* a caller which can not park loads on its own */
+    _misses++;
+    _locker.unlock();
+
+    /* map without lock, other threads keep serving */
+    entry *e = load(path, err);
+    if(e == NULL || (size_t)e->st.st_size > _max_file) {
+        if(e != NULL && !uncached) {
+            /* before land : parked requests must not park again */
+            _locker.lock();
+            if(_uncached.size() >= FILE_CACHE_UNCACHED_MAX) {
+                _uncached.clear();
+            }
+            _uncached.insert(path);
+            _locker.unlock();
+        }
+        if(loader) {
+            land(key);
+        }
+        return e;
+    }
+
+    _locker.lock();
+    if(uncached) { /* it shrank, cache it from now on */
+        _uncached.erase(path);
+    }
+    it = _map.find(path);
+    if(it != _map.end()) {
+        /* someone else mapped it meanwhile, keep theirs */
+        entry *other = it->second;
+        other->refs++;
+        _locker.unlock();
+        destroy(e);
+        if(loader) {
+            land(key);
+        }
+        return other;
+    }
+    e->cached = true;
+    e->refs++;
+    _lru.push_front(e);
+    e->lru = _lru.begin();
+    _map[e->path] = e;
+    _bytes += e->st.st_size;
+    evict();
+    _locker.unlock();
+    if(loader) {
+        land(key); /* parked requests find it cached */
+    }
+    return e;
+}
+
+/* load of path is over, wake requests parked on it */
+void file_cache::land(const std::string &path) {
+    std::vector<waiter> parked;
+    _locker.lock();
+    std::unordered_map<std::string, std::vector<waiter> >::iterator it = _loading.find(path);
+    if(it != _loading.end()) {
+        parked.swap(it->second);
+        _loading.erase(it);
+    }
+    _locker.unlock();
+    for(size_t i = 0; i < parked.size(); i++) {
+        parked[i].wake(parked[i].arg);
+    }
+}
+
+/* one more user of an acquired entry */
+void file_cache::retain(entry *e) {
+    if(e->pinned) {
+        return;
+    }
+    _locker.lock();
+    e->refs++;
+    _locker.unlock();
+}
+
+/* connection done with entry */
+void file_cache::release(entry *e) {
+    if(e->pinned) {
+        return;
+    }
+    _locker.lock();
+    bool last = --e->refs == 0;
+    _locker.unlock();
+    if(last) {
+        destroy(e);
+    }
+}
+
+/* stat & map path, NULL on failure with err set */
+file_cache::entry *file_cache::load(const char *path, int &err) {
+    struct stat st;
+    if(stat(path, &st) != 0) {
+        err = errno;
+        return NULL;
+    }
+    /* access : others can read or not */
+    if(!(st.st_mode & S_IROTH)) {
+        err = EACCES;
+        return NULL;
+    }
+    /* is or not a dir */
+    if(S_ISDIR(st.st_mode)) {
+        err = EISDIR;
+        return NULL;
+    }
+    char *address = NULL;
+    if(st.st_size > 0) {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            err = errno;
+            return NULL;
+        }
+        address = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        err = errno;
+        ::close(fd);
+        if(address == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    entry *e = new entry;
+    e->path = path;
+    e->st = st;
+    e->address = address;
+    e->checked = time(NULL);
+    e->refs = 1;
+    e->cached = false;
+    e->pinned = false;
+    e->head = NULL;
+    e->head_len = 0;
+    err = 0;
+    return e;
+}
+
+/* free entry memory & mapping */
+void file_cache::destroy(entry *e) {
+    if(e->address != NULL) {
+        munmap(e->address, e->st.st_size);
+    }
+    delete e;
+}
+
+/* take e out of cache, locked */
+void file_cache::remove(entry *e) {
+    _map.erase(e->path);
+    _lru.erase(e->lru);
+    _bytes -= e->st.st_size;
+    e->cached = false;
+    if(--e->refs == 0) {
+        destroy(e);
+    }
+}
+
+/* drop least recently used entries until bytes fit, locked */
+void file_cache::evict() {
+    while(_bytes > _max_bytes && _lru.size() > 1) {
+        remove(_lru.back());
+    }
+}
+
+}
@@ -0,0 +1,575 @@
+#include "h2_session.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+
+#include "http_conn.h"
+
+namespace lu {
+
+const char h2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* frame flags */
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+/* settings parameters */
+static const int SETTINGS_ENABLE_PUSH = 0x2;
+static const int SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const int SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const int SETTINGS_MAX_FRAME_SIZE = 0x5;
+static const int SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+static const int64_t WINDOW_MAX = 0x7fffffff; /* 2^31 - 1 */
+static const int64_t WINDOW_DEFAULT = 65535;
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_u32(std::string &out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+/* base64url without padding, used by HTTP2-Settings */
+static bool base64url_decode(const char *text, std::string &out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for(const char *p = text; *p != '\0' && *p != '='; p++) {
+        int v;
+        if(*p >= 'A' && *p <= 'Z') {
+            v = *p - 'A';
+        } else if(*p >= 'a' && *p <= 'z') {
+            v = *p - 'a' + 26;
+        } else if(*p >= '0' && *p <= '9') {
+            v = *p - '0' + 52;
+        } else if(*p == '-' || *p == '+') {
+            v = 62;
+        } else if(*p == '_' || *p == '/') {
+            v = 63;
+        } else {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+h2_session::h2_session() 
+    : _out_sent(0), 
+    _preface_pending(true), 
+    _closing(false), 
+    _last_stream_id(0), 
+    _cont_stream(0), 
+    _rr_next(0), 
+    _send_window(WINDOW_DEFAULT), 
+    _peer_initial_window(WINDOW_DEFAULT), 
+    _peer_max_frame(MAX_FRAME_SIZE) {}
+
+h2_session::~h2_session() {
+    for(std::map<uint32_t, stream>::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+        if(it->second.file != NULL) {
+            http_conn::_file_cache->release(it->second.file);
+        }
+    }
+}
+
+/* prior knowledge : client starts with the preface */
+void h2_session::start() {
+    settings();
+}
+
+/* h2c upgrade : 101 response, then the http/1.1 GET of path becomes stream 1 */
+bool h2_session::upgrade(const char *settings_text, const char *path) {
+    std::string payload;
+    if(!base64url_decode(settings_text, payload) 
+        || !on_settings(0, 0, (const uint8_t *)payload.data(), payload.size())) {
+        return false;
+    }
+    /* on_settings queued an ACK of the upgrade settings, they must not be acked (3.2.1) */
+    _out.clear();
+    _out.append("HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    settings();
+
+    _last_stream_id = 1;
+    stream &s = _streams[1];
+    s.window = _peer_initial_window;
+    s.method = "GET";
+    s.path = path;
+    s.end_stream = true; /* half closed (remote) */
+    s.responded = false;
+    s.file = NULL;
+    respond(1, s);
+    return true;
+}
+
+/* bytes from client, false on connection error (GOAWAY is queued) */
+bool h2_session::feed(const char *data, size_t len) {
+    if(_closing) {
+        return false;
+    }
+    _in.append(data, len);
+    size_t pos = 0;
+    if(_preface_pending) {
+        size_t cmp = _in.size() < (size_t)PREFACE_LEN ? _in.size() : PREFACE_LEN;
+        if(memcmp(_in.data(), PREFACE, cmp) != 0) {
+            return goaway(PROTOCOL_ERROR);
+        }
+        if(cmp < (size_t)PREFACE_LEN) {
+            return true;
+        }
+        pos = PREFACE_LEN;
+        _preface_pending = false;
+    }
+    while(_in.size() - pos >= 9) {
+        const uint8_t *head = (const uint8_t *)_in.data() + pos;
+        uint32_t flen = ((uint32_t)head[0] << 16) | ((uint32_t)head[1] << 8) | head[2];
+        int type = head[3];
+        int flags = head[4];
+        uint32_t sid = get_u32(head + 5) & 0x7fffffff;
+        if(flen > MAX_FRAME_SIZE) {
+            return goaway(FRAME_SIZE_ERROR);
+        }
+        if(_in.size() - pos - 9 < flen) {
+            break;
+        }
+        if(!on_frame(type, flags, sid, head + 9, flen)) {
+            _in.clear();
+            return false;
+        }
+        pos += 9 + flen;
+    }
+    _in.erase(0, pos);
+    produce();
+    return true;
+}
+
+/* n bytes of output are sent */
+void h2_session::consumed(size_t n) {
+    _out_sent += n;
+    if(_out_sent == _out.size()) {
+        _out.clear();
+        _out_sent = 0;
+    } else if(_out_sent >= OUTPUT_HIGH) {
+        _out.erase(0, _out_sent);
+        _out_sent = 0;
+    }
+}
+
+/* one complete frame */
+bool h2_session::on_frame(int type, int flags, uint32_t sid, const uint8_t *payload, uint32_t len) {
+    /* header block must not be interleaved with other frames (6.10) */
+    if(_cont_stream != 0 && (type != FRAME_CONTINUATION || sid != _cont_stream)) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    switch(type) {
+        case FRAME_DATA: {
+            return on_data(flags, sid, payload, len);
+        }
+        case FRAME_HEADERS: {
+            return on_headers(flags, sid, payload, len);
+        }
+        case FRAME_CONTINUATION: {
+            return on_continuation(flags, sid, payload, len);
+        }
+        case FRAME_SETTINGS: {
+            return on_settings(flags, sid, payload, len);
+        }
+        case FRAME_WINDOW_UPDATE: {
+            return on_window_update(sid, payload, len);
+        }
+        case FRAME_PRIORITY: {
+            if(sid == 0 || len != 5) {
+                return goaway(PROTOCOL_ERROR);
+            }
+            return true; /* we don't schedule by priority */
+        }
+        case FRAME_RST_STREAM: {
+            if(sid == 0 || len != 4) {
+                return goaway(PROTOCOL_ERROR);
+            }
+            finish(sid);
+            return true;
+        }
+        case FRAME_PING: {
+            if(sid != 0 || len != 8) {
+                return goaway(PROTOCOL_ERROR);
+            }
+            if(!(flags & FLAG_ACK)) {
+                frame_header(8, FRAME_PING, FLAG_ACK, 0);
+                _out.append((const char *)payload, 8);
+            }
+            return true;
+        }
+        case FRAME_GOAWAY: {
+            _closing = true;
+            return false;
+        }
+        case FRAME_PUSH_PROMISE: { /* clients can not push */
+            return goaway(PROTOCOL_ERROR);
+        }
+        default: { /* unknown frames are ignored (4.1) */
+            return true;
+        }
+    }
+}
+
+bool h2_session::on_data(int flags, uint32_t sid, const uint8_t *payload, uint32_t len) {
+    if(sid == 0) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_PADDED && (len == 0 || payload[0] >= len)) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    /* request bodies are not used, give the window back right away */
+    if(len > 0) {
+        window_update(0, len);
+    }
+    std::map<uint32_t, stream>::iterator it = _streams.find(sid);
+    if(it == _streams.end()) {
+        if(sid > _last_stream_id) { /* DATA on idle stream */
+            return goaway(PROTOCOL_ERROR);
+        }
+        return true; /* stream is answered & closed already */
+    }
+    stream &s = it->second;
+    if(s.end_stream) {
+        rst_stream(sid, STREAM_CLOSED);
+        return true;
+    }
+    if(len > 0 && !(flags & FLAG_END_STREAM)) {
+        window_update(sid, len);
+    }
+    if(flags & FLAG_END_STREAM) {
+        s.end_stream = true;
+        if(!s.responded && !s.method.empty()) {
+            respond(sid, s);
+        }
+    }
+    return true;
+}
+
+bool h2_session::on_headers(int flags, uint32_t sid, const uint8_t *payload, uint32_t len) {
+    if(sid == 0 || (sid & 1) == 0) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    /* strip padding & priority */
+    uint32_t pad = 0;
+    if(flags & FLAG_PADDED) {
+        if(len == 0) {
+            return goaway(PROTOCOL_ERROR);
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    if(flags & FLAG_PRIORITY) {
+        if(len < 5) {
+            return goaway(PROTOCOL_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if(pad > len) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    len -= pad;
+
+    std::map<uint32_t, stream>::iterator it = _streams.find(sid);
+    if(it == _streams.end()) {
+        if(sid <= _last_stream_id) { /* stream ids only go up (5.1.1) */
+            return goaway(PROTOCOL_ERROR);
+        }
+        _last_stream_id = sid;
+        stream &s = _streams[sid];
+        s.window = _peer_initial_window;
+        s.end_stream = false;
+        s.responded = false;
+        s.file = NULL;
+        s.body = NULL;
+        s.body_len = s.body_sent = 0;
+        it = _streams.find(sid);
+    } else if(it->second.end_stream) {
+        return goaway(STREAM_CLOSED);
+    }
+    stream &s = it->second;
+    s.block.assign((const char *)payload, len);
+    if(flags & FLAG_END_STREAM) {
+        s.end_stream = true;
+    }
+    if(flags & FLAG_END_HEADERS) {
+        return on_header_block(sid);
+    }
+    _cont_stream = sid;
+    return true;
+}
+
+bool h2_session::on_continuation(int flags, uint32_t sid, const uint8_t *payload, uint32_t len) {
+    if(sid == 0 || sid != _cont_stream) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    stream &s = _streams[sid];
+    if(s.block.size() + len > HEADER_BLOCK_MAX) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    s.block.append((const char *)payload, len);
+    if(flags & FLAG_END_HEADERS) {
+        _cont_stream = 0;
+        return on_header_block(sid);
+    }
+    return true;
+}
+
+/* END_HEADERS of stream : decode block, answer if request is complete */
+bool h2_session::on_header_block(uint32_t sid) {
+    stream &s = _streams[sid];
+    std::vector<hpack::header> headers;
+    /* every block is decoded, even refused ones, to keep the table in sync */
+    bool ok = _decoder.decode((const uint8_t *)s.block.data(), s.block.size(), headers);
+    s.block.clear();
+    if(!ok) {
+        return goaway(COMPRESSION_ERROR);
+    }
+    if(s.responded || !s.method.empty()) { /* trailers */
+        if(s.end_stream && !s.responded) {
+            respond(sid, s);
+        }
+        return true;
+    }
+    if(_streams.size() > MAX_CONCURRENT_STREAMS) {
+        rst_stream(sid, REFUSED_STREAM);
+        return true;
+    }
+    for(size_t i = 0; i < headers.size(); i++) {
+        if(headers[i].name == ":method") {
+            s.method = headers[i].value;
+        } else if(headers[i].name == ":path") {
+            s.path = headers[i].value;
+        }
+    }
+    if(s.method.empty() || s.path.empty()) {
+        rst_stream(sid, PROTOCOL_ERROR);
+        return true;
+    }
+    if(s.end_stream) {
+        respond(sid, s);
+    }
+    return true;
+}
+
+bool h2_session::on_settings(int flags, uint32_t sid, const uint8_t *payload, uint32_t len) {
+    if(sid != 0) {
+        return goaway(PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_ACK) {
+        return len == 0 ? true : goaway(FRAME_SIZE_ERROR);
+    }
+    if(len % 6 != 0) {
+        return goaway(FRAME_SIZE_ERROR);
+    }
+    for(uint32_t i = 0; i < len; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        if(id == SETTINGS_ENABLE_PUSH && value > 1) {
+            return goaway(PROTOCOL_ERROR);
+        } else if(id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if(value > WINDOW_MAX) {
+                return goaway(FLOW_CONTROL_ERROR);
+            }
+            /* change applies to every open stream (6.9.2), none may go
+             * over 2^31 - 1 */
+            int64_t delta = (int64_t)value - _peer_initial_window;
+            for(std::map<uint32_t, stream>::iterator it = _streams.begin(); 
+                it != _streams.end(); ++it) {
+                if(it->second.window + delta > WINDOW_MAX) {
+                    return goaway(FLOW_CONTROL_ERROR);
+                }
+            }
+            _peer_initial_window = value;
+            for(std::map<uint32_t, stream>::iterator it = _streams.begin(); 
+                it != _streams.end(); ++it) {
+                it->second.window += delta;
+            }
+        } else if(id == SETTINGS_MAX_FRAME_SIZE) {
+            if(value < 16384 || value > 16777215) {
+                return goaway(PROTOCOL_ERROR);
+            }
+            _peer_max_frame = value;
+        }
+        /* HEADER_TABLE_SIZE doesn't matter, our encoder never indexes */
+    }
+    frame_header(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    return true;
+}
+
+bool h2_session::on_window_update(uint32_t sid, const uint8_t *payload, uint32_t len) {
+    if(len != 4) {
+        return goaway(FRAME_SIZE_ERROR);
+    }
+    uint32_t inc = get_u32(payload) & 0x7fffffff;
+    if(sid == 0) {
+        if(inc == 0 || _send_window + inc > WINDOW_MAX) {
+            return goaway(inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        }
+        _send_window += inc;
+        return true;
+    }
+    std::map<uint32_t, stream>::iterator it = _streams.find(sid);
+    if(it == _streams.end()) {
+        return true; /* may arrive after the stream is closed */
+    }
+    if(inc == 0 || it->second.window + inc > WINDOW_MAX) {
+        rst_stream(sid, inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        return true;
+    }
+    it->second.window += inc;
+    return true;
+}
+
+/* queue response HEADERS, DATA follows in produce() */
+void h2_session::respond(uint32_t sid, stream &s) {
+    http_conn::HTTP_CODE code = http_conn::BAD_REQUEST;
+    if(s.method == "GET" && s.path[0] == '/') {
+        code = http_conn::open_file(s.path.c_str(), s.file);
+    }
+    if(code == http_conn::FILE_REQUEST) {
+        s.body = s.file->address;
+        s.body_len = s.file->st.st_size;
+    } else {
+        s.body = http_conn::RESPONSE_CODE_FORM.at(code);
+        s.body_len = strlen(s.body);
+    }
+    s.body_sent = 0;
+    s.responded = true;
+
+    char status[16], length[32];
+    snprintf(status, sizeof(status), "%d", code);
+    snprintf(length, sizeof(length), "%zu", s.body_len);
+    std::vector<hpack::header> headers(3);
+    headers[0].name = ":status";
+    headers[0].value = status;
+    headers[1].name = "content-length";
+    headers[1].value = length;
+    headers[2].name = "content-type";
+    headers[2].value = "text/html";
+    std::string block;
+    hpack::encoder::encode(headers, block);
+
+    frame_header(block.size(), FRAME_HEADERS, 
+        FLAG_END_HEADERS | (s.body_len == 0 ? FLAG_END_STREAM : 0), sid);
+    _out.append(block);
+    if(s.body_len == 0) {
+        finish(sid);
+    }
+}
+
+/* queue DATA frames as flow control windows allow */
+void h2_session::produce() {
+    bool progress = true;
+    while(progress && pending() < OUTPUT_HIGH && _send_window > 0) {
+        progress = false;
+        /* one frame per stream & round, starting after the last served stream */
+        std::map<uint32_t, stream>::iterator it = _streams.lower_bound(_rr_next);
+        for(size_t n = _streams.size(); n > 0 && _send_window > 0; n--) {
+            if(it == _streams.end()) {
+                it = _streams.begin();
+            }
+            uint32_t sid = it->first;
+            stream &s = it->second;
+            ++it;
+            if(!s.responded || s.window <= 0) {
+                continue;
+            }
+            int64_t size = s.body_len - s.body_sent;
+            size = size < s.window ? size : s.window;
+            size = size < _send_window ? size : _send_window;
+            size = size < _peer_max_frame ? size : _peer_max_frame;
+            bool last = s.body_sent + size == s.body_len;
+            frame_header(size, FRAME_DATA, last ? FLAG_END_STREAM : 0, sid);
+            _out.append(s.body + s.body_sent, size);
+            s.body_sent += size;
+            s.window -= size;
+            _send_window -= size;
+            _rr_next = sid + 1;
+            progress = true;
+            if(last) {
+                finish(sid);
+            }
+            if(pending() >= OUTPUT_HIGH) {
+                break;
+            }
+        }
+    }
+}
+
+/* release stream */
+void h2_session::finish(uint32_t sid) {
+    std::map<uint32_t, stream>::iterator it = _streams.find(sid);
+    if(it == _streams.end()) {
+        return;
+    }
+    if(it->second.file != NULL) {
+        http_conn::_file_cache->release(it->second.file);
+    }
+    if(_cont_stream == sid) {
+        _cont_stream = 0;
+    }
+    _streams.erase(it);
+}
+
+void h2_session::frame_header(uint32_t len, int type, int flags, uint32_t sid) {
+    _out.push_back((char)(len >> 16));
+    _out.push_back((char)(len >> 8));
+    _out.push_back((char)len);
+    _out.push_back((char)type);
+    _out.push_back((char)flags);
+    put_u32(_out, sid);
+}
+
+void h2_session::settings() {
+    frame_header(18, FRAME_SETTINGS, 0, 0);
+    _out.push_back(0);
+    _out.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    put_u32(_out, MAX_CONCURRENT_STREAMS);
+    _out.push_back(0);
+    _out.push_back(SETTINGS_ENABLE_PUSH);
+    put_u32(_out, 0);
+    _out.push_back(0);
+    _out.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    put_u32(_out, HPACK_HEADER_LIST_MAX); /* more fails the block, see hpack::decoder */
+}
+
+void h2_session::window_update(uint32_t sid, uint32_t inc) {
+    frame_header(4, FRAME_WINDOW_UPDATE, 0, sid);
+    put_u32(_out, inc);
+}
+
+void h2_session::rst_stream(uint32_t sid, ERROR_CODE code) {
+    frame_header(4, FRAME_RST_STREAM, 0, sid);
+    put_u32(_out, code);
+    finish(sid);
+}
+
+/* queue GOAWAY, return false for caller */
+bool h2_session::goaway(ERROR_CODE code) {
+    frame_header(8, FRAME_GOAWAY, 0, 0);
+    put_u32(_out, _last_stream_id);
+    put_u32(_out, code);
+    _closing = true;
+    return false;
+}
+
+}
@@ -0,0 +1,102 @@
+#include "header_index.h"
+
+#include <string.h>
+#include <strings.h>
+
+namespace lu {
+
+static const char *KNOWN_NAMES[header_index::HEADER_KNOWN_COUNT] = {
+    "connection", "content-length", "host", "accept-encoding", "upgrade", 
+    "http2-settings", "keep-alive", "proxy-connection", "transfer-encoding", 
+    "if-none-match", "if-modified-since", "range", "if-range", "cache-control", 
+    "user-agent", "accept", "cookie", "referer", "authorization", "expect"
+};
+
+#define KNOWN_SLOTS 64 /* power of 2, over 3 times the well-known names */
+
+/* hash => well-known name, open addressing with linear probing, built once */
+struct known_table {
+    uint32_t hashes[header_index::HEADER_KNOWN_COUNT];
+    int8_t slots[KNOWN_SLOTS]; /* name index, -1 is empty */
+    known_table() {
+        memset(slots, -1, sizeof(slots));
+        for(int k = 0; k < header_index::HEADER_KNOWN_COUNT; k++) {
+            hashes[k] = header_index::hash(KNOWN_NAMES[k]);
+            uint32_t i = hashes[k] & (KNOWN_SLOTS - 1);
+            while(slots[i] != -1) {
+                i = (i + 1) & (KNOWN_SLOTS - 1);
+            }
+            slots[i] = k;
+        }
+    }
+};
+static const known_table KNOWN_TABLE;
+
+uint32_t header_index::hash(std::string_view name) {
+    uint32_t h = HASH_SEED;
+    for(size_t i = 0; i < name.size(); i++) {
+        h = hash_byte(h, name[i]);
+    }
+    return h;
+}
+
+header_index::KNOWN header_index::lookup(const char *name, size_t len, uint32_t hash) {
+    for(uint32_t i = hash & (KNOWN_SLOTS - 1); KNOWN_TABLE.slots[i] != -1; i = (i + 1) & (KNOWN_SLOTS - 1)) {
+        int k = KNOWN_TABLE.slots[i];
+        if(KNOWN_TABLE.hashes[k] == hash && strlen(KNOWN_NAMES[k]) == len 
+            && strncasecmp(KNOWN_NAMES[k], name, len) == 0) {
+            return (KNOWN)k;
+        }
+    }
+    return HEADER_OTHER;
+}
+
+void header_index::clear(char *base) {
+    _base = base;
+    _count = 0;
+    memset(_known, 0, sizeof(_known));
+}
+
+bool header_index::add(int begin, int colon, int end, uint32_t name_hash) {
+    if(_count == HEADER_INDEX_MAX || colon == begin) {
+        return false;
+    }
+    for(int i = begin; i < colon; i++) {
+        if((uint8_t)_base[i] <= ' ' || _base[i] == 0x7f) {
+            return false;
+        }
+    }
+    int value = colon + 1;
+    while(value < end && (_base[value] == ' ' || _base[value] == '\t')) {
+        value++;
+    }
+    while(end > value && (_base[end - 1] == ' ' || _base[end - 1] == '\t')) {
+        end--;
+    }
+    _base[end] = '\0';
+    field &f = _fields[_count];
+    f.name = begin;
+    f.name_len = colon - begin;
+    f.value = value;
+    f.value_len = end - value;
+    f.hash = name_hash;
+    f.known = lookup(_base + begin, colon - begin, name_hash);
+    if(f.known != HEADER_OTHER && _known[f.known] == 0) {
+        _known[f.known] = _count + 1;
+    }
+    _count++;
+    return true;
+}
+
+std::string_view header_index::get(std::string_view name) const {
+    uint32_t h = hash(name);
+    for(int i = 0; i < _count; i++) {
+        if(_fields[i].hash == h && _fields[i].name_len == name.size() 
+            && strncasecmp(_base + _fields[i].name, name.data(), name.size()) == 0) {
+            return value(i);
+        }
+    }
+    return std::string_view();
+}
+
+}
@@ -0,0 +1,400 @@
+#include "hpack.h"
+
+namespace lu {
+
+const hpack::header hpack::STATIC_TABLE[hpack::STATIC_TABLE_SIZE] = {
+    {":authority", ""}, /* 1 */
+    {":method", "GET"}, /* 2 */
+    {":method", "POST"}, /* 3 */
+    {":path", "/"}, /* 4 */
+    {":path", "/index.html"}, /* 5 */
+    {":scheme", "http"}, /* 6 */
+    {":scheme", "https"}, /* 7 */
+    {":status", "200"}, /* 8 */
+    {":status", "204"}, /* 9 */
+    {":status", "206"}, /* 10 */
+    {":status", "304"}, /* 11 */
+    {":status", "400"}, /* 12 */
+    {":status", "404"}, /* 13 */
+    {":status", "500"}, /* 14 */
+    {"accept-charset", ""}, /* 15 */
+    {"accept-encoding", "gzip, deflate"}, /* 16 */
+    {"accept-language", ""}, /* 17 */
+    {"accept-ranges", ""}, /* 18 */
+    {"accept", ""}, /* 19 */
+    {"access-control-allow-origin", ""}, /* 20 */
+    {"age", ""}, /* 21 */
+    {"allow", ""}, /* 22 */
+    {"authorization", ""}, /* 23 */
+    {"cache-control", ""}, /* 24 */
+    {"content-disposition", ""}, /* 25 */
+    {"content-encoding", ""}, /* 26 */
+    {"content-language", ""}, /* 27 */
+    {"content-length", ""}, /* 28 */
+    {"content-location", ""}, /* 29 */
+    {"content-range", ""}, /* 30 */
+    {"content-type", ""}, /* 31 */
+    {"cookie", ""}, /* 32 */
+    {"date", ""}, /* 33 */
+    {"etag", ""}, /* 34 */
+    {"expect", ""}, /* 35 */
+    {"expires", ""}, /* 36 */
+    {"from", ""}, /* 37 */
+    {"host", ""}, /* 38 */
+    {"if-match", ""}, /* 39 */
+    {"if-modified-since", ""}, /* 40 */
+    {"if-none-match", ""}, /* 41 */
+    {"if-range", ""}, /* 42 */
+    {"if-unmodified-since", ""}, /* 43 */
+    {"last-modified", ""}, /* 44 */
+    {"link", ""}, /* 45 */
+    {"location", ""}, /* 46 */
+    {"max-forwards", ""}, /* 47 */
+    {"proxy-authenticate", ""}, /* 48 */
+    {"proxy-authorization", ""}, /* 49 */
+    {"range", ""}, /* 50 */
+    {"referer", ""}, /* 51 */
+    {"refresh", ""}, /* 52 */
+    {"retry-after", ""}, /* 53 */
+    {"server", ""}, /* 54 */
+    {"set-cookie", ""}, /* 55 */
+    {"strict-transport-security", ""}, /* 56 */
+    {"transfer-encoding", ""}, /* 57 */
+    {"user-agent", ""}, /* 58 */
+    {"vary", ""}, /* 59 */
+    {"via", ""}, /* 60 */
+    {"www-authenticate", ""}, /* 61 */
+};
+
+/* huffman code & bit length of symbol 0 ~ 255 & EOS (256) */
+static const struct {
+    uint32_t code;
+    int bits;
+} HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/* binary decoding tree of HUFFMAN_CODES, built once */
+class huffman_tree {
+public:
+    huffman_tree() : _size(1) {
+        for(int i = 0; i < NODES_MAX; i++) {
+            _nodes[i].child[0] = _nodes[i].child[1] = 0;
+            _nodes[i].sym = -1;
+        }
+        for(int sym = 0; sym < 257; sym++) {
+            int node = 0;
+            for(int bit = HUFFMAN_CODES[sym].bits - 1; bit >= 0; bit--) {
+                int b = (HUFFMAN_CODES[sym].code >> bit) & 1;
+                if(_nodes[node].child[b] == 0) {
+                    _nodes[node].child[b] = _size++;
+                }
+                node = _nodes[node].child[b];
+            }
+            _nodes[node].sym = sym;
+        }
+    }
+    /* next node from node by bit, 0 if no such code */
+    inline int next(int node, int bit) const { return _nodes[node].child[bit]; }
+    /* symbol of leaf node, -1 for inner node */
+    inline int symbol(int node) const { return _nodes[node].sym; }
+
+private:
+    static const int NODES_MAX = 513; /* 257 leaves of a full binary tree */
+    struct node {
+        uint16_t child[2];
+        int16_t sym;
+    } _nodes[NODES_MAX];
+    int _size;
+};
+
+static const huffman_tree HUFFMAN_TREE;
+
+/* huffman (5.2, appendix B) */
+bool hpack::huffman_decode(const uint8_t *data, size_t len, std::string &str) {
+    int node = 0;
+    int depth = 0; /* bits consumed since last symbol */
+    bool all_ones = true; /* bits since last symbol are all 1, valid padding */
+    for(size_t i = 0; i < len; i++) {
+        for(int bit = 7; bit >= 0; bit--) {
+            int b = (data[i] >> bit) & 1;
+            node = HUFFMAN_TREE.next(node, b);
+            if(node == 0) {
+                return false;
+            }
+            depth++;
+            all_ones = all_ones && b == 1;
+            int sym = HUFFMAN_TREE.symbol(node);
+            if(sym == 256) { /* EOS in string is an error */
+                return false;
+            } else if(sym >= 0) {
+                str.push_back((char)sym);
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    /* padding : most significant bits of EOS, shorter than 8 bits */
+    return depth < 8 && all_ones;
+}
+
+/* integer with prefix bits (5.1), false on overflow or truncated input */
+bool hpack::decode_int(const uint8_t *&p, const uint8_t *end, int prefix, uint64_t &value) {
+    if(p >= end) {
+        return false;
+    }
+    uint64_t max = (1 << prefix) - 1;
+    value = *p++ & max;
+    if(value < max) {
+        return true;
+    }
+    for(int shift = 0; shift <= 56; shift += 7) {
+        if(p >= end) {
+            return false;
+        }
+        uint8_t byte = *p++;
+        value += (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void hpack::encode_int(uint64_t value, int prefix, uint8_t flags, std::string &out) {
+    uint64_t max = (1 << prefix) - 1;
+    if(value < max) {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | max));
+    value -= max;
+    while(value >= 0x80) {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+/* string literal (5.2), huffman coded or raw */
+bool hpack::decode_string(const uint8_t *&p, const uint8_t *end, std::string &str) {
+    if(p >= end) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if(!decode_int(p, end, 7, len) || len > (uint64_t)(end - p)) {
+        return false;
+    }
+    str.clear();
+    bool ok = true;
+    if(huffman) {
+        ok = huffman_decode(p, len, str);
+    } else {
+        str.assign((const char *)p, len);
+    }
+    p += len;
+    return ok;
+}
+
+hpack::decoder::decoder(size_t max_table_size, size_t max_list_size) 
+    : _size(0), 
+    _max_size(max_table_size), 
+    _max_allowed(max_table_size), 
+    _max_list(max_list_size) {}
+
+/* header of index in static + dynamic table, NULL if out of range */
+const hpack::header *hpack::decoder::lookup(uint64_t index) const {
+    if(index == 0) {
+        return NULL;
+    }
+    if(index <= (uint64_t)STATIC_TABLE_SIZE) {
+        return &STATIC_TABLE[index - 1];
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= _table.size()) {
+        return NULL;
+    }
+    return &_table[index];
+}
+
+/* add to dynamic table & evict to fit */
+void hpack::decoder::insert(const header &h) {
+    size_t size = h.name.size() + h.value.size() + 32;
+    if(size > _max_size) { /* bigger than table : table becomes empty (4.4) */
+        evict(0);
+        return;
+    }
+    evict(_max_size - size);
+    _table.push_front(h);
+    _size += size;
+}
+
+void hpack::decoder::evict(size_t max_size) {
+    while(_size > max_size && !_table.empty()) {
+        _size -= _table.back().name.size() + _table.back().value.size() + 32;
+        _table.pop_back();
+    }
+}
+
+/* decode one complete header block, false on compression error or if
+ * the list (name + value + 32 of each field) is over max_list_size :
+ * a small block of indexed references can stand for a huge list */
+bool hpack::decoder::decode(const uint8_t *data, size_t len, std::vector<header> &headers) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    bool first = true; /* size updates only at beginning of block (4.2) */
+    size_t list = 0; /* size of list so far, as SETTINGS_MAX_HEADER_LIST_SIZE counts it */
+    while(p < end) {
+        uint8_t byte = *p;
+        uint64_t index;
+        if(byte & 0x80) { /* indexed header field (6.1) */
+            if(!decode_int(p, end, 7, index)) {
+                return false;
+            }
+            const header *h = lookup(index);
+            if(h == NULL) {
+                return false;
+            }
+            list += h->name.size() + h->value.size() + 32;
+            if(list > _max_list) { /* before the copy */
+                return false;
+            }
+            headers.push_back(*h);
+        } else if((byte & 0xe0) == 0x20) { /* dynamic table size update (6.3) */
+            if(!first || !decode_int(p, end, 5, index) || index > _max_allowed) {
+                return false;
+            }
+            _max_size = index;
+            evict(_max_size);
+            continue;
+        } else { /* literal header field (6.2) */
+            bool indexing = (byte & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4; /* without indexing & never indexed use 4 bits */
+            if(!decode_int(p, end, prefix, index)) {
+                return false;
+            }
+            header h;
+            if(index != 0) {
+                const header *named = lookup(index);
+                if(named == NULL) {
+                    return false;
+                }
+                h.name = named->name;
+            } else if(!decode_string(p, end, h.name)) {
+                return false;
+            }
+            if(!decode_string(p, end, h.value)) {
+                return false;
+            }
+            list += h.name.size() + h.value.size() + 32;
+            if(list > _max_list) {
+                return false;
+            }
+            if(indexing) {
+                insert(h);
+            }
+            headers.push_back(h);
+        }
+        first = false;
+    }
+    return true;
+}
+
+/* append block of headers to out */
+void hpack::encoder::encode(const std::vector<header> &headers, std::string &out) {
+    for(size_t i = 0; i < headers.size(); i++) {
+        const header &h = headers[i];
+        int name_index = 0;
+        int full_index = 0;
+        for(int j = 0; j < STATIC_TABLE_SIZE && full_index == 0; j++) {
+            if(STATIC_TABLE[j].name == h.name) {
+                if(name_index == 0) {
+                    name_index = j + 1;
+                }
+                if(STATIC_TABLE[j].value == h.value) {
+                    full_index = j + 1;
+                }
+            }
+        }
+        if(full_index != 0) { /* indexed header field */
+            encode_int(full_index, 7, 0x80, out);
+            continue;
+        }
+        /* literal header field without indexing, raw strings */
+        encode_int(name_index, 4, 0x00, out);
+        if(name_index == 0) {
+            encode_int(h.name.size(), 7, 0x00, out);
+            out.append(h.name);
+        }
+        encode_int(h.value.size(), 7, 0x00, out);
+        out.append(h.value);
+    }
+}
+
+}
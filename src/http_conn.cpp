@@ -1,10 +1,34 @@
 #include "http_conn.h"
+#include "h2_session.h"
+#include "perf_stage.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <new>
 
 namespace lu {
 
 /* init static */
 int http_conn::_epollfd = -1;
-int http_conn::_user_count = 0;
+std::atomic<int> http_conn::_user_count(0);
+volatile bool http_conn::_draining = false;
+conn_limiter *http_conn::_ip_limiter = NULL;
+file_cache *http_conn::_file_cache = NULL;
+path_cache *http_conn::_path_cache = NULL;
+const sock_profile *http_conn::_sock_profile = NULL;
+#ifdef __TLS
+const tls_context *http_conn::_tls = NULL;
+#endif
+upstream_pool *http_conn::_upstreams = NULL;
+bundle *http_conn::_bundle = NULL;
+shm_cache *http_conn::_shm_cache = NULL;
+buffer_pool *http_conn::_exchanges = NULL;
+async_io *http_conn::_async_io = NULL;
+threadpool<http_conn> *http_conn::_pool = NULL;
 
 /* reource root path */
 const char *http_conn::DOC_ROOT = "/home/merlotliu/lu-webserver/resources";
@@ -15,24 +39,49 @@ std::unordered_map<int, const char *> http_conn::RESPONSE_CODE_TITLE = {
     {BAD_REQUEST, "Bad Request"},
     {FORBIDDEN_REQUEST, "Forbidden"},
     {NO_RESOURCE, "Not Found"},
-    {INTERNAL_ERROR, "Internal Error"}
+    {HEADERS_TOO_LARGE, "Request Header Fields Too Large"},
+    {INTERNAL_ERROR, "Internal Error"},
+    {BAD_GATEWAY, "Bad Gateway"},
+    {SERVICE_UNAVAILABLE, "Service Unavailable"}
 };
 std::unordered_map<int, const char *> http_conn::RESPONSE_CODE_FORM = {
     {FILE_REQUEST, ""},
     {BAD_REQUEST, "Your request has bad syntax or is inherently impossible to satisfy.\n"},
     {FORBIDDEN_REQUEST, "You do not have permission to get file from this server.\n"},
     {NO_RESOURCE, "The requested file was not found on this server.\n"},
-    {INTERNAL_ERROR, "There was an unusual problem serving the requested file.\n"}
+    {HEADERS_TOO_LARGE, "Your request has too many header fields.\n"},
+    {INTERNAL_ERROR, "There was an unusual problem serving the requested file.\n"},
+    {BAD_GATEWAY, "The upstream server did not answer the request.\n"},
+    {SERVICE_UNAVAILABLE, "The server is overloaded, please retry later.\n"}
 };
 
-/* nouse */
-http_conn::http_conn() {}
+/* slots never used must look closed to whoever scans the connection array */
+http_conn::http_conn() : _connfd(-1), _read_idx(0), 
+    _file(NULL), _io_busy(false), _io_pending(false), _zc_next(0), _zc_done(0), _px(NULL), _h2(NULL) {
+#ifdef __TLS
+    _ssl = NULL;
+#endif
+}
 http_conn::~http_conn() {}
 
 /* initialize user connction */
-void http_conn::init(int connfd, const sockaddr_in &addr) {
+void http_conn::init(int connfd, const sockaddr_in &addr, int incoming_cpu) {
     _connfd = connfd;
     _client_addr = addr;
+    _incoming_cpu = incoming_cpu;
+#ifdef __TLS
+    /* handshake starts with the first EPOLLIN, failure to create shows there */
+    _ssl = _tls != NULL ? _tls->create(connfd) : NULL;
+    _tls_ready = false;
+    _ktls = false;
+    _tls_wait = 0;
+#endif
+    /* SO_ZEROCOPY is inherited from the listener, user space tls copies anyway */
+    _zerocopy = _sock_profile != NULL && _sock_profile->zerocopy > 0;
+#ifdef __TLS
+    _zerocopy = _zerocopy && _ssl == NULL;
+#endif
+    _zc_next = _zc_done = 0;
     
 #ifdef __DEBUG
     //[1] for test
@@ -55,15 +104,17 @@ void http_conn::_init() {
     /* write about */
     _write_idx = 0; /* current pos in write buffer */
     bzero(_write_buf, WRITE_BUFFER_SIZE); /* write buffer clear */
-    _iovcnt = 0; /* Number of buffers */
+    _out.clear(); /* nothing to send */
     _bytes_already_send = 0; /* current already send numbers of bytes */
-    _bytes_to_send = 0; /* current need to send numbers of bytes */
 
     /* http parse about */
     _check_state = CHECK_STATE_REQUESTLINE; /* main state machine state */
     _checked_idx = 0; /* current parse char position in read buffer */
     _start_line = 0; /* current line start index relative to read buffer head address */
     
+    _headers.clear(_read_buf); /* no header field */
+    _colon = -1; /* header line scan */
+    _name_hash = header_index::HASH_SEED;
     _url = NULL; /* request url */
     _method = GET; /* default request GET */
     _version = NULL; /* http protocol version */
@@ -71,10 +122,15 @@ void http_conn::_init() {
     _content_length = 0; /* request content length */
     _linger = false; /* is or not keep alive */
     _host = NULL; /* host address with point & number */
+    _accept_gzip = false; /* identity only */
 
-    bzero(_real_file, FILENAME_LEN); /* request file path in server */
-    bzero(&_file_stat, sizeof(_file_stat)); /* file status */
-    _file_address = NULL; /* mmap memory map address */
+    _file = NULL; /* mapped request file */
+    _cached_only = false; /* do_request may load file */
+    _deferred = false; /* request is not parsed yet */
+    _resident_begin = _resident_end = NULL; /* residency of file unknown */
+    _route = NULL; /* not proxied */
+    _h2_upgrade = false; /* no Upgrade: h2c */
+    _h2_settings = NULL; /* no HTTP2-Settings */
 }
 
 /* Reading client data util no data or client disconnct */
@@ -82,11 +138,20 @@ bool http_conn::read() {
     if(_read_idx >= READ_BUFFER_SIZE) { /* buffer is full */
         return false;
     }
+#ifdef __TLS
+    if(_tls != NULL && !_tls_ready) {
+        if(!tls_handshake()) {
+            return false;
+        }
+        if(!_tls_ready) { /* handshake goes on, no request bytes yet */
+            return true;
+        }
+    }
+#endif
     int bytes_read = 0;
     while(true) {
         /* start from last read index in buffer to read new data */
-        bytes_read = recv(_connfd, _read_buf + _read_idx, 
-            READ_BUFFER_SIZE - _read_idx, 0);
+        bytes_read = sock_recv(_read_buf + _read_idx, READ_BUFFER_SIZE - _read_idx);
         if(bytes_read == -1) {
             if(errno == EAGAIN || errno == EWOULDBLOCK) { /* read the end of data */
                 break;
@@ -108,9 +173,34 @@ void http_conn::process() {
 #ifdef __DEBUG
     printf("\nprocess...\n");
 #endif
-    HTTP_CODE read_ret = process_read();
+    int h2 = _deferred ? 0 : h2_check();
+    if(h2 < 0) { /* part of http/2 preface */
+        tools::modifyfd(_epollfd, _connfd, read_event());
+        return;
+    } else if(h2 > 0) {
+        h2_feed();
+        h2_arm();
+        return;
+    }
+    HTTP_CODE read_ret = NO_REQUEST;
+    if(_deferred) { /* reactor thread has parsed it already */
+        _deferred = false;
+        read_ret = do_request();
+    } else {
+        read_ret = process_read();
+    }
     if(read_ret == NO_REQUEST) {
-        tools::modifyfd(_epollfd, _connfd, EPOLLIN);
+        tools::modifyfd(_epollfd, _connfd, read_event());
+        return;
+    }
+    if(read_ret == PARKED_REQUEST) {
+        return; /* unpark() queues it again, it may already run on another thread */
+    }
+    if(read_ret == PROXY_REQUEST && (read_ret = proxy_begin()) == PROXY_REQUEST) {
+        return; /* backend answers through relay() */
+    }
+    if(_h2_upgrade && h2_upgrade()) {
+        h2_arm();
         return;
     }
     /* make response */
@@ -125,63 +215,914 @@ void http_conn::process() {
 #endif
 }
 
+/* Being executed by reactor thread. Answer requests which need no disk access
+ * (cached small file, bad request) without the queue hop to working thread. 
+ * return false if the request must be processed by working thread */
+bool http_conn::process_inline() {
+    if(h2_check() != 0) {
+        return false;
+    }
+    _cached_only = true;
+    HTTP_CODE read_ret = process_read();
+    _cached_only = false;
+    if(read_ret == DEFERRED_REQUEST) {
+        return false;
+    }
+    if(read_ret == NO_REQUEST) {
+        tools::modifyfd(_epollfd, _connfd, read_event());
+        return true;
+    }
+    if(read_ret == PROXY_REQUEST && (read_ret = proxy_begin()) == PROXY_REQUEST) {
+        return true; /* nonblocking, cheap enough for reactor */
+    }
+    if(_h2_upgrade) { /* let working thread switch protocol */
+        unmap();
+        _deferred = true;
+        return false;
+    }
+    if(!process_write(read_ret) || !write()) {
+        close();
+    }
+    return true;
+}
+
+/* Being executed by reactor thread. The url is peeked from request line, 
+ * which may be cut in place by an earlier partial parse, & looked up the 
+ * way open_file does without loading anything. a file not in cache costs 
+ * disk access, a request not complete yet or answered with error is cheap */
+int http_conn::classify(http_conn *c) {
+    if(c->_deferred || c->_h2 != NULL) { /* not a cached small file / many streams */
+        return LANE_BULK;
+    }
+    const char *p = c->_read_buf, *end = c->_read_buf + c->_read_idx;
+    while(p < end && *p != ' ' && *p != '\t' && *p != '\0') {
+        p++;
+    }
+    while(p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if(end - p > 7 && strncasecmp(p, "http://", 7) == 0) {
+        p = (const char *)memchr(p + 7, '/', end - p - 7);
+        if(p == NULL) {
+            return LANE_CHEAP;
+        }
+    }
+    char url[FILENAME_LEN];
+    int len = 0;
+    while(p + len < end && len < FILENAME_LEN - 1 
+        && p[len] != ' ' && p[len] != '\t' && p[len] != '\0' && p[len] != '\r') {
+        len++;
+    }
+    if(p + len >= end || len == FILENAME_LEN - 1 || len == 0) {
+        return LANE_CHEAP;
+    }
+    memcpy(url, p, len);
+    url[len] = '\0';
+    if(route_of(url) != NULL) {
+        return LANE_BULK;
+    }
+    char path[FILENAME_LEN];
+    if(_path_cache->resolve(url, path, sizeof(path)) != path_cache::PATH_OK) {
+        return LANE_CHEAP;
+    }
+    if(_bundle != NULL) {
+        file_cache::entry *file = _bundle->find(path, false);
+        return file == NULL || file->st.st_size <= INLINE_FILE_MAX ? LANE_CHEAP : LANE_BULK;
+    }
+    char real_file[FILENAME_LEN];
+    if(snprintf(real_file, FILENAME_LEN, "%s%s", DOC_ROOT, path) >= FILENAME_LEN) {
+        return LANE_CHEAP;
+    }
+    if(_shm_cache != NULL) {
+        file_cache::entry *file = _shm_cache->find(real_file, false);
+        if(file != NULL) {
+            return file->st.st_size <= INLINE_FILE_MAX ? LANE_CHEAP : LANE_BULK;
+        }
+    }
+    long size = _file_cache->cached_size(real_file);
+    return size >= 0 && size <= INLINE_FILE_MAX ? LANE_CHEAP : LANE_BULK;
+}
+
 /* write to */
 bool http_conn::write() {
 #ifdef __DEBUG
     printf("\nwrite...\n");
 #endif
-    if(_bytes_to_send <= 0) {
+#ifdef __TLS
+    if(_tls != NULL && !_tls_ready) { /* handshake wanted to write */
+        if(!tls_handshake()) {
+            return false;
+        }
+        tools::modifyfd(_epollfd, _connfd, read_event());
+        return true;
+    }
+#endif
+    if(_px != NULL) { /* client can take more of proxied response */
+        return relay();
+    }
+    if(_h2 != NULL) {
+        return h2_write();
+    }
+    if(_out.empty()) {
         tools::modifyfd(_epollfd, _connfd, EPOLLIN);
         _init();
         return true;
     }
 
-    int cur_wbytes = 0;
-    while(true) {
-        cur_wbytes = writev(_connfd, _iov, _iovcnt);
-        if(cur_wbytes <= -1) {
-            if(errno == EAGAIN) {
-                tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
-                return true;
-            }
+    switch(flush()) {
+        case WRITE_AGAIN: {
+            tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
+            return true;
+        }
+        case WRITE_PENDING: {
+            return true; /* file_read_in() arms EPOLLOUT */
+        }
+        case WRITE_DONE: {
+            tools::modifyfd(_epollfd, _connfd, EPOLLIN);
+            return finish_response();
+        }
+        default: {
             unmap();
             return false;
         }
+    }
+}
 
+/* write response until it is done or socket buffer is full */
+http_conn::WRITE_STATUS http_conn::flush() {
+    perf_stage::scope stage(perf_stage::STAGE_FLUSH);
+    if(_bytes_already_send == 0 && _sock_profile != NULL) {
+        /* hold partial segments until the whole response is queued */
+        _sock_profile->cork(_connfd, true);
+    }
+    struct iovec iov[OUT_QUEUE_IOV_MAX];
+    while(!_out.empty()) {
+        if(_async_io != NULL && !file_ready()) {
+            return WRITE_PENDING;
+        }
+        bool zc = false;
+        int cnt = _out.fill(iov, OUT_QUEUE_IOV_MAX, _zerocopy ? _sock_profile->zerocopy : 0, &zc);
+        int cur_wbytes = zc ? sock_sendzc(iov, cnt, zc) : sock_writev(iov, cnt);
+        if(cur_wbytes <= -1) {
+            return errno == EAGAIN ? WRITE_AGAIN : WRITE_ERROR;
+        }
         _bytes_already_send += cur_wbytes;
-        _bytes_to_send -= cur_wbytes;
+        /* partly sent segment goes on from where it stopped */
+        _out.consume(cur_wbytes, zc ? (long)_zc_next++ : -1);
+    }
+    return WRITE_DONE;
+}
 
-        if(_bytes_to_send <= 0) {
-            unmap();
+/* file bytes at head of output are in page cache, else read them in on io thread */
+bool http_conn::file_ready() {
+    const out_queue::segment &seg = _out.front();
+    if(seg.file == NULL || (seg.data >= _resident_begin && seg.data < _resident_end)) {
+        return true;
+    }
+    size_t len = seg.len < ASYNC_IO_WINDOW ? seg.len : ASYNC_IO_WINDOW;
+    _resident_begin = seg.data; /* resident now, or once the read is done */
+    _resident_end = seg.data + len;
+    if(async_io::resident(seg.data, len) || _io_busy.load(std::memory_order_acquire)) {
+        return true; /* job of a connction closed on this slot still runs : fault here */
+    }
+    _io_job.addr = (char *)seg.data;
+    _io_job.len = len;
+    _io_job.done = file_read_in;
+    _io_job.arg = this;
+    _io_cache = seg.cache; /* pages stay mapped even if the connction is closed meanwhile */
+    _io_file = seg.file;
+    _io_cache->retain(_io_file);
+    _io_busy.store(true, std::memory_order_relaxed);
+    _io_pending.store(true, std::memory_order_relaxed);
+    if(!_async_io->submit(&_io_job)) {
+        /* io queue full : fault on this thread rather than wait */
+        _io_pending.store(false, std::memory_order_relaxed);
+        _io_busy.store(false, std::memory_order_relaxed);
+        _io_cache->release(_io_file);
+        return true;
+    }
+    return false;
+}
+
+/* io thread has read file pages in, go on sending */
+void http_conn::file_read_in(void *conn) {
+    http_conn *c = (http_conn *)conn;
+    c->_io_cache->release(c->_io_file);
+    /* not waiting any more if closed meanwhile */
+    bool waiting = c->_io_pending.exchange(false, std::memory_order_acq_rel);
+    int fd = c->_connfd;
+    c->_io_busy.store(false, std::memory_order_release);
+    if(waiting) {
+        tools::modifyfd(_epollfd, fd, EPOLLOUT);
+    }
+}
+
+/* response is sent : reset for next request, return is or not keep alive */
+bool http_conn::finish_response() {
+    if(_sock_profile != NULL) {
+        _sock_profile->cork(_connfd, false); /* flush the last segment */
+    }
+    unmap();
+    bool keep_alive = _linger && !_draining; /* _init() resets _linger */
+    _init();
+    return keep_alive;
+}
+
+#ifdef __cpp_impl_coroutine
+/* start coroutine mode after init() */
+void http_conn::start() {
+    serve();
+}
+
+/* socket event of coroutine mode connction */
+void http_conn::resume() {
+    if(_co) {
+        std::coroutine_handle<> co = _co;
+        _co = nullptr; /* not suspended while running */
+        co.resume();
+    }
+}
+
+/* Coroutine mode : the whole connction lives on reactor thread. parse, make
+ * response & send run in line, suspended only while waiting for socket */
+co_task http_conn::serve() {
+    co_await io_wait{this, 0}; /* init() armed EPOLLIN */
+    while(true) {
+        if(!read()) {
+            break;
+        }
+        int h2 = h2_check();
+        if(h2 < 0) { /* part of http/2 preface */
+            co_await io_wait{this, read_event()};
+            continue;
+        } else if(h2 > 0) {
+            h2_feed();
+        } else {
+            HTTP_CODE read_ret = process_read();
+            if(read_ret == NO_REQUEST) {
+                co_await io_wait{this, read_event()};
+                continue;
+            }
+            if(read_ret == PROXY_REQUEST) {
+                read_ret = BAD_GATEWAY;
+                if(proxy_start()) {
+                    PROXY_STATUS status;
+                    while((status = proxy_pump()) != PROXY_DONE && status != PROXY_ERROR) {
+                        if(status == PROXY_CLIENT_WRITE) {
+                            co_await io_wait{this, EPOLLOUT};
+                        } else {
+                            co_await io_wait{this, status == PROXY_UP_READ ? (int)EPOLLIN : (int)EPOLLOUT, 
+                                _px->up->fd};
+                        }
+                    }
+                    bool responded = _px->responded();
+                    proxy_end(status == PROXY_DONE);
+                    if(status == PROXY_DONE) {
+                        if(!finish_response()) {
+                            break;
+                        }
+                        co_await io_wait{this, EPOLLIN};
+                        continue;
+                    }
+                    if(responded) { /* broken in the middle of response */
+                        break;
+                    }
+                }
+            }
+            if(!_h2_upgrade || !h2_upgrade()) {
+                if(!process_write(read_ret)) {
+                    break;
+                }
+                WRITE_STATUS write_ret;
+                while((write_ret = flush()) == WRITE_AGAIN || write_ret == WRITE_PENDING) {
+                    /* pending : io thread arms EPOLLOUT once file pages are in */
+                    co_await io_wait{this, write_ret == WRITE_AGAIN ? (int)EPOLLOUT : 0};
+                }
+                if(write_ret == WRITE_ERROR || !finish_response()) {
+                    break;
+                }
+                co_await io_wait{this, EPOLLIN};
+                continue;
+            }
+        }
+        /* http/2 : send the frames queued by session */
+        WRITE_STATUS write_ret;
+        while((write_ret = h2_flush()) == WRITE_AGAIN) {
+            co_await io_wait{this, EPOLLOUT};
+        }
+        if(write_ret == WRITE_ERROR || _h2->closing()) {
+            break;
+        }
+        co_await io_wait{this, EPOLLIN};
+    }
+    close();
+}
+#endif
+
+/* is connction http/2 : 1 yes, 0 no, -1 can not tell until more bytes come */
+int http_conn::h2_check() {
+    if(_h2 != NULL) {
+        return 1;
+    }
+    if(_check_state != CHECK_STATE_REQUESTLINE || _start_line != 0 || _read_idx == 0) {
+        return 0;
+    }
+    int len = _read_idx < h2_session::PREFACE_LEN ? _read_idx : h2_session::PREFACE_LEN;
+    if(memcmp(_read_buf, h2_session::PREFACE, len) != 0) {
+        return 0;
+    }
+    return len == h2_session::PREFACE_LEN ? 1 : -1;
+}
+
+/* http/2 with prior knowledge : read buffer goes to session */
+bool http_conn::h2_feed() {
+    if(_h2 == NULL) {
+        _h2 = new h2_session();
+        _h2->start();
+    }
+    bool ret = _h2->feed(_read_buf, _read_idx);
+    _read_idx = 0;
+    return ret;
+}
+
+/* h2c upgrade of the request just parsed, false to answer it by http/1.1 */
+bool http_conn::h2_upgrade() {
+    if(_h2_settings == NULL || _content_length != 0) {
+        return false;
+    }
+    _h2 = new h2_session();
+    if(!_h2->upgrade(_h2_settings, _url)) {
+        delete _h2;
+        _h2 = NULL;
+        return false;
+    }
+    unmap(); /* session maps the file of stream 1 itself */
+    /* client preface may be pipelined behind the request */
+    _h2->feed(_read_buf + _checked_idx, _read_idx - _checked_idx);
+    _read_idx = 0;
+    return true;
+}
+
+/* Being executed by working thread. arm epoll for what session needs next */
+void http_conn::h2_arm() {
+    if(_h2->pending() > 0) {
+        tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
+    } else if(_h2->closing()) {
+        close();
+    } else {
+        tools::modifyfd(_epollfd, _connfd, EPOLLIN);
+    }
+}
+
+/* send frames of session, making more DATA as windows allow */
+http_conn::WRITE_STATUS http_conn::h2_flush() {
+    _h2->produce();
+    while(_h2->pending() > 0) {
+        struct iovec iov = {(void *)_h2->output(), _h2->pending()};
+        int cur_wbytes = sock_writev(&iov, 1);
+        if(cur_wbytes <= -1) {
+            return errno == EAGAIN ? WRITE_AGAIN : WRITE_ERROR;
+        }
+        _h2->consumed(cur_wbytes);
+        if(_h2->pending() == 0) {
+            _h2->produce();
+        }
+    }
+    return WRITE_DONE;
+}
+
+/* write of http/2 connction */
+bool http_conn::h2_write() {
+    switch(h2_flush()) {
+        case WRITE_AGAIN: {
+            tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
+            return true;
+        }
+        case WRITE_DONE: {
+            if(_h2->closing()) {
+                return false;
+            }
             tools::modifyfd(_epollfd, _connfd, EPOLLIN);
-            _init();
-            return _linger;
+            return true;
         }
-        if(_bytes_already_send < _write_idx) { /* first buffer have data need to write */
+        default: {
+            return false;
+        }
+    }
+}
 
-            _iov[0].iov_base = _write_buf + _bytes_already_send;
-            _iov[0].iov_len -= cur_wbytes;
-        } else { /* first buffer done */
-            _iov[0].iov_len = 0;
-            _iov[1].iov_base = _file_address + (_bytes_already_send - _write_idx);
-            _iov[1].iov_len -= _bytes_to_send;
+/* recv of connction, through tls session if there is one */
+int http_conn::sock_recv(char *buf, int len) {
+#ifdef __TLS
+    if(_ssl != NULL) {
+        int ret = SSL_read(_ssl, buf, len);
+        if(ret > 0) {
+            return ret;
+        }
+        switch(SSL_get_error(_ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE: {
+                errno = EAGAIN;
+                return -1;
+            }
+            case SSL_ERROR_ZERO_RETURN: { /* close_notify */
+                return 0;
+            }
+            default: {
+                ERR_clear_error(); /* error queue is per thread, keep it clean */
+                errno = ECONNRESET;
+                return -1;
+            }
         }
     }
+#endif
+    return recv(_connfd, buf, len, 0);
+}
 
+/* writev of connction. with tls in user space every buffer is sealed by 
+ * SSL_write, one record at a time, stopping at the first one that can not go.
+ * with ktls the kernel seals records & the mapped file goes by plain writev */
+int http_conn::sock_writev(const struct iovec *iov, int iovcnt) {
+#ifdef __TLS
+    if(_ssl != NULL && !_ktls) {
+        int total = 0;
+        for(int i = 0; i < iovcnt; i++) {
+            int done = 0;
+            while(done < (int)iov[i].iov_len) {
+                int ret = SSL_write(_ssl, (char *)iov[i].iov_base + done, iov[i].iov_len - done);
+                if(ret <= 0) {
+                    int err = SSL_get_error(_ssl, ret);
+                    if(err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+                        ERR_clear_error();
+                        errno = EPIPE;
+                        return -1;
+                    }
+                    if(total == 0) {
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                    return total;
+                }
+                done += ret;
+                total += ret;
+            }
+        }
+        return total;
+    }
+#endif
+    return writev(_connfd, iov, iovcnt);
+}
+
+/* sendmsg with MSG_ZEROCOPY, zc is cleared if it fell back to writev */
+int http_conn::sock_sendzc(const struct iovec *iov, int iovcnt, bool &zc) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    int ret = sendmsg(_connfd, &msg, MSG_ZEROCOPY);
+    if(ret < 0 && errno == ENOBUFS) { /* too many pages pinned (optmem_max), copy */
+        zc = false;
+        return writev(_connfd, iov, iovcnt);
+    }
+    return ret;
+}
+
+/* EPOLLERR : read zerocopy completions, false if a real error is queued */
+bool http_conn::reap() {
+    char control[128];
+    while(true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(_connfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break; /* error queue is empty */
+        }
+        for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                return false;
+            }
+            /* sends ee_info..ee_data are done with their pages */
+            _out.complete(serr->ee_info, serr->ee_data);
+            _zc_done += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(_connfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+/* arm epoll again for what the connction waits for, after reap() */
+void http_conn::rearm() {
+    if(_io_pending.load(std::memory_order_acquire)) {
+        return; /* file_read_in() arms EPOLLOUT, sending now would fault */
+    }
+    tools::modifyfd(_epollfd, _connfd, !_out.empty() || _px != NULL ? (int)EPOLLOUT : read_event());
+}
+
+#ifdef __TLS
+/* go on with tls handshake, false if it failed */
+bool http_conn::tls_handshake() {
+    if(_ssl == NULL) {
+        return false;
+    }
+    int ret = SSL_do_handshake(_ssl);
+    if(ret == 1) {
+        _tls_ready = true;
+        _tls_wait = 0;
+        _ktls = tls_context::ktls_send(_ssl);
+        return true;
+    }
+    switch(SSL_get_error(_ssl, ret)) {
+        case SSL_ERROR_WANT_READ: {
+            _tls_wait = EPOLLIN;
+            return true;
+        }
+        case SSL_ERROR_WANT_WRITE: {
+            _tls_wait = EPOLLOUT;
+            return true;
+        }
+        default: {
+#ifdef __DEBUG
+            ERR_print_errors_fp(stdout);
+#endif
+            ERR_clear_error();
+            return false;
+        }
+    }
+}
+#endif
+
+/* proxy route of url, matched on its canonical path, NULL if it is not proxied.
+ * "/%61pi/x" & "/./api/x" are proxied by /api, "/api/../x" is not */
+upstream_pool::route *http_conn::route_of(const char *url) {
+    if(_upstreams == NULL) {
+        return NULL;
+    }
+    char path[FILENAME_LEN];
+    if(!path_cache::canonicalize(url, strcspn(url, "?#"), path, sizeof(path))) {
+        return NULL; /* open_file answers it */
+    }
+    return _upstreams->match(path);
+}
+
+/* canonical path percent-encoded again for a request line : bytes which
+ * are not allowed raw (or would end the path) are escaped */
+static void append_path(std::string &out, const char *path) {
+    static const char HEX[] = "0123456789ABCDEF";
+    for(const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        if(isalnum(*p) || strchr("/-._~!$&'()*+,;=:@", *p) != NULL) {
+            out.push_back(*p);
+        } else {
+            out.push_back('%');
+            out.push_back(HEX[*p >> 4]);
+            out.push_back(HEX[*p & 15]);
+        }
+    }
+}
+
+/* proxied request : start relaying it, BAD_GATEWAY if no backend takes it */
+http_conn::HTTP_CODE http_conn::proxy_begin() {
+    if(!proxy_start()) {
+        return BAD_GATEWAY;
+    }
+    if(!relay()) {
+        close();
+    }
+    return PROXY_REQUEST;
+}
+
+/* request for backend & a connction to send it on, false if no backend */
+bool http_conn::proxy_start() {
+    /* backend gets the path the route was matched on, not one it could
+     * resolve otherwise ("/api/%2e%2e/x"). query is passed as is */
+    char path[FILENAME_LEN];
+    size_t path_len = strcspn(_url, "?#");
+    if(!path_cache::canonicalize(_url, path_len, path, sizeof(path))) {
+        return false; /* route_of matched it, can not happen */
+    }
+    _px = _exchanges != NULL ? new (_exchanges->get()) upstream_exchange() : new upstream_exchange();
+    std::string &req = _px->req;
+    req.append("GET ");
+    append_path(req, path);
+    req.append(_url + path_len, strcspn(_url + path_len, "#")).append(" HTTP/1.1\r\n");
+    /* hop-by-hop fields & body framing are ours */
+    for(int i = 0; i < _headers.size(); i++) {
+        switch(_headers.known(i)) {
+            case header_index::HEADER_CONTENT_LENGTH:
+            case header_index::HEADER_TRANSFER_ENCODING:
+            case header_index::HEADER_CONNECTION:
+            case header_index::HEADER_KEEP_ALIVE:
+            case header_index::HEADER_PROXY_CONNECTION:
+            case header_index::HEADER_UPGRADE:
+            case header_index::HEADER_HTTP2_SETTINGS: {
+                continue;
+            }
+            default: {
+                break;
+            }
+        }
+        req.append(_headers.name(i)).append(": ").append(_headers.value(i)).append("\r\n");
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &_client_addr.sin_addr, ip, sizeof(ip));
+    req.append("X-Forwarded-For: ").append(ip).append("\r\n");
+    if(_content_length > 0) {
+        req.append("Content-Length: ").append(std::to_string(_content_length)).append("\r\n");
+    }
+    req.append("Connection: keep-alive\r\n\r\n");
+    if(_content_length > 0) {
+        req.append(_read_buf + _checked_idx, _content_length);
+    }
+    _px->up = _upstreams->acquire(_route, this);
+    if(_px->up == NULL) {
+        drop_exchange();
+        return false;
+    }
     return true;
 }
 
+/* move request & response as far as sockets allow. an idle connction may 
+ * have been closed by backend meanwhile : nothing came back on it, so the 
+ * request goes once more on a fresh one */
+http_conn::PROXY_STATUS http_conn::proxy_pump() {
+    PROXY_STATUS ret;
+    while((ret = proxy_move()) == PROXY_ERROR && _px->up_failed && _px->up->reused 
+        && !_px->head_done && _px->buf_len == 0) {
+        epoll_ctl(_epollfd, EPOLL_CTL_DEL, _px->up->fd, NULL);
+        _upstreams->release(_px->up, false, false);
+        _px->up = _upstreams->acquire(_route, this, true);
+        if(_px->up == NULL) {
+            return PROXY_ERROR;
+        }
+        _px->req_sent = 0;
+        _px->up_failed = false;
+    }
+    return ret;
+}
+
+/* one pass of proxy_pump */
+http_conn::PROXY_STATUS http_conn::proxy_move() {
+    upstream_exchange *px = _px;
+    int upfd = px->up->fd;
+    /* request to backend */
+    while(px->req_sent < px->req.size()) {
+        int n = send(upfd, px->req.data() + px->req_sent, px->req.size() - px->req_sent, 
+            MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN) {
+                return PROXY_UP_WRITE;
+            }
+            px->up_failed = true;
+            return PROXY_ERROR;
+        }
+        px->req_sent += n;
+    }
+    /* splice moves body from backend to client socket inside kernel, it needs
+     * a known end (or backend closing) & a client socket kernel can write to */
+    bool plain = true;
+#ifdef __TLS
+    plain = _ssl == NULL || _ktls;
+#endif
+    /* response back to client */
+    while(true) {
+        if(px->head_sent < px->head.size() || px->buf_sent < px->buf_len) {
+            struct iovec iov[2] = {
+                {(void *)(px->head.data() + px->head_sent), px->head.size() - px->head_sent},
+                {px->buf + px->buf_sent, (size_t)(px->buf_len - px->buf_sent)}
+            };
+            int n = sock_writev(iov, 2);
+            if(n < 0) {
+                return errno == EAGAIN ? PROXY_CLIENT_WRITE : PROXY_ERROR;
+            }
+            int from_head = px->head.size() - px->head_sent;
+            from_head = n < from_head ? n : from_head;
+            px->head_sent += from_head;
+            px->buf_sent += n - from_head;
+            continue;
+        }
+        if(px->pipe_bytes > 0) {
+            int n = splice(px->up->pipe[0], NULL, _connfd, NULL, px->pipe_bytes, 
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n < 0) {
+                return errno == EAGAIN ? PROXY_CLIENT_WRITE : PROXY_ERROR;
+            }
+            px->pipe_bytes -= n;
+            continue;
+        }
+        if(px->done) {
+            return PROXY_DONE;
+        }
+        bool by_splice = plain && px->head_done && (px->body == upstream_exchange::BODY_EOF 
+            || (px->body == upstream_exchange::BODY_LENGTH && px->remaining >= UPSTREAM_SPLICE_MIN));
+        if(by_splice && px->up->pipe[0] < 0 && pipe2(px->up->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+            px->up->pipe[0] = px->up->pipe[1] = -1;
+            by_splice = false;
+        }
+        int n = 0;
+        if(by_splice) {
+            long want = px->body == upstream_exchange::BODY_LENGTH && px->remaining < UPSTREAM_PIPE_SIZE 
+                ? px->remaining : UPSTREAM_PIPE_SIZE;
+            n = splice(upfd, NULL, px->up->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            if(px->head_done) { /* buffer is sent */
+                px->buf_len = px->buf_sent = 0;
+            }
+            long want = UPSTREAM_BUFFER_SIZE - px->buf_len;
+            if(px->head_done && px->body == upstream_exchange::BODY_LENGTH && px->remaining < want) {
+                want = px->remaining;
+            }
+            n = recv(upfd, px->buf + px->buf_len, want, 0);
+        }
+        if(n < 0) {
+            if(errno == EAGAIN) {
+                return PROXY_UP_READ;
+            }
+            px->up_failed = true;
+            return PROXY_ERROR;
+        }
+        if(n == 0) { /* backend closed */
+            if(px->head_done && px->body == upstream_exchange::BODY_EOF) {
+                px->done = true;
+                continue;
+            }
+            px->up_failed = true;
+            return PROXY_ERROR;
+        }
+        if(by_splice) {
+            px->pipe_bytes += n;
+            px->scan(NULL, n); /* only counts, bytes are in pipe */
+        } else if(px->head_done) {
+            px->buf_len = px->scan(px->buf, n);
+        } else {
+            px->buf_len += n;
+            int ret = px->take_head(_linger && !_draining);
+            if(ret < 0) {
+                px->up_failed = true;
+                return PROXY_ERROR;
+            }
+            if(ret > 0 && !px->keep_alive) {
+                _linger = false;
+            }
+        }
+    }
+}
+
+/* event of backend connction (or client EPOLLOUT) while relaying proxied 
+ * request, false if client connction must be closed */
+bool http_conn::relay() {
+    switch(proxy_pump()) {
+        case PROXY_UP_READ: {
+            tools::armfd(_epollfd, _px->up->fd, EPOLLIN);
+            return true;
+        }
+        case PROXY_UP_WRITE: {
+            tools::armfd(_epollfd, _px->up->fd, EPOLLOUT);
+            return true;
+        }
+        case PROXY_CLIENT_WRITE: {
+            tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
+            return true;
+        }
+        case PROXY_DONE: {
+            proxy_end(true);
+            /* may run on working thread : reset before client can send more */
+            if(!finish_response()) {
+                return false;
+            }
+            tools::modifyfd(_epollfd, _connfd, EPOLLIN);
+            return true;
+        }
+        default: {
+            return proxy_fail();
+        }
+    }
+}
+
+/* exchange is over, give backend connction back */
+void http_conn::proxy_end(bool ok) {
+    if(_px->up != NULL) {
+        epoll_ctl(_epollfd, EPOLL_CTL_DEL, _px->up->fd, NULL);
+        _upstreams->release(_px->up, ok && _px->reusable, _px->up_failed);
+    }
+    drop_exchange();
+}
+
+void http_conn::drop_exchange() {
+    if(_exchanges != NULL) {
+        _px->~upstream_exchange();
+        _exchanges->put(_px);
+    } else {
+        delete _px;
+    }
+    _px = NULL;
+}
+
+/* exchange failed : 502 if client got nothing yet, false to close client */
+bool http_conn::proxy_fail() {
+    bool responded = _px->responded();
+    proxy_end(false);
+    if(responded || !process_write(BAD_GATEWAY)) {
+        return false;
+    }
+    tools::modifyfd(_epollfd, _connfd, EPOLLOUT);
+    return true;
+}
+
+/* connected & nothing read or waiting to send */
+bool http_conn::idle() const {
+    if(_connfd == -1 || _read_idx != 0 || !_out.empty() || _px != NULL) {
+        return false;
+    }
+    if(_h2 == NULL) {
+        return true;
+    }
+    /* streams are erased once their last DATA is queued, frames may still be 
+     * in session or socket buffer. closing with client's WINDOW_UPDATEs unread 
+     * resets the connction & takes unacked bytes with it */
+    int unacked = 0;
+    return _h2->idle() && ioctl(_connfd, SIOCOUTQ, &unacked) == 0 && unacked == 0;
+}
+
+/* Being executed by reactor thread. the connction is idle, so GOAWAY is the
+ * only thing in socket buffer & goes out at once */
+void http_conn::retire() {
+    if(_h2 != NULL) {
+        _h2->shutdown();
+        h2_flush();
+    }
+    close();
+}
+
 /* close connction */
 void http_conn::close() {
+#ifdef __cpp_impl_coroutine
+    if(_co) { /* closed from outside while suspended, eg: drained */
+        std::coroutine_handle<> co = _co;
+        _co = nullptr;
+        co.destroy();
+    }
+#endif
+    _io_pending.store(false, std::memory_order_release); /* a read in progress arms nothing */
+    _out.clear();
+    _out.release_held(); /* pages still in flight are pinned by kernel */
+    _zc_next = _zc_done = 0;
+    unmap();
+    if(_px != NULL) {
+        proxy_end(false);
+    }
+    if(_h2 != NULL) {
+        delete _h2;
+        _h2 = NULL;
+    }
+#ifdef __TLS
+    if(_ssl != NULL) {
+        if(_tls_ready) {
+            SSL_shutdown(_ssl); /* best effort close_notify */
+        }
+        SSL_free(_ssl);
+        _ssl = NULL;
+        ERR_clear_error();
+    }
+#endif
     if(_connfd != -1) {
         tools::removefd(_epollfd, _connfd);
         _connfd = -1;
         http_conn::_user_count--;
+        if(_ip_limiter != NULL) {
+            _ip_limiter->release(_client_addr.sin_addr.s_addr);
+        }
     }
 }
 
+/* server overloaded : answer 503 right away & close.
+ * called on the reactor thread when the task queue refuses the connection */
+void http_conn::overload() {
+#ifdef __TLS
+    if(_ssl != NULL) { /* a plain 503 means nothing to a tls client */
+        close();
+        return;
+    }
+#endif
+    unmap();
+    _out.clear();
+    _write_idx = 0;
+    _linger = false;
+    if(process_write(SERVICE_UNAVAILABLE)) {
+        /* best effort, socket buffer of a fresh connection has enough room */
+        struct iovec iov[OUT_QUEUE_IOV_MAX];
+        writev(_connfd, iov, _out.fill(iov, OUT_QUEUE_IOV_MAX));
+    }
+    close();
+}
+
 /* parse http request every line */
 http_conn::HTTP_CODE http_conn::process_read() {
+    perf_stage::scope stage(perf_stage::STAGE_READ);
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char *text = 0;
@@ -191,7 +1132,9 @@ http_conn::HTTP_CODE http_conn::process_read() {
         || ((line_status = parse_line()) == LINE_OK)) {
         text = get_line(); /* get current parse line */
         _start_line = _checked_idx;/* record next line head address */
+#ifdef __DEBUG
         printf("got 1 http line : %s\n", text);
+#endif
 
         /* main machine state handle & switch */
         switch(_check_state) {
@@ -204,8 +1147,8 @@ http_conn::HTTP_CODE http_conn::process_read() {
             }
             case CHECK_STATE_HEADER: {
                 ret = parse_headers(text);
-                if(ret == BAD_REQUEST) {
-                    return BAD_REQUEST;
+                if(ret == BAD_REQUEST || ret == HEADERS_TOO_LARGE) {
+                    return ret;
                 }
                 if(ret == GET_REQUEST) {
                     return do_request();
@@ -251,6 +1194,13 @@ http_conn::LINE_STATUS http_conn::parse_line() {
                 return LINE_OK;
             }
             return LINE_BAD;
+        } else if(_colon < 0 && _check_state == CHECK_STATE_HEADER) {
+            /* header name is hashed on the way to line end */
+            if(temp == ':') {
+                _colon = _checked_idx;
+            } else {
+                _name_hash = header_index::hash_byte(_name_hash, temp);
+            }
         }
     }
     return LINE_OPEN;
@@ -282,7 +1232,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text) {
         return BAD_REQUEST;
     }
     *_version++ = '\0';
-    if (strcasecmp( _version, "HTTP/1.1") != 0 || strcasecmp( _version, "HTTP/1.0") != 0) { /* support HTTP/1.1 & 1.0 */
+    if (strcasecmp( _version, "HTTP/1.1") != 0 && strcasecmp( _version, "HTTP/1.0") != 0) { /* support HTTP/1.1 & 1.0 */
         return BAD_REQUEST;
     }
     /* method & version is ok */
@@ -302,37 +1252,74 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text) {
 
 /* parse headers to get key-value */
 http_conn::HTTP_CODE http_conn::parse_headers(char * text) {
+    int colon = _colon;
+    uint32_t name_hash = _name_hash;
+    _colon = -1; /* next line */
+    _name_hash = header_index::HASH_SEED;
     if(*text == '\0') { /* empty line that means we get a fully headers */
         if(_content_length != 0) { /* there is request content */
             _check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         } 
         return GET_REQUEST;
-    } else if(strncasecmp(text, "Connection:", 11) == 0) { /* Connection */
-        text += 11;
-        text += strspn(text, " \t");
+    }
+    if(colon < 0) { /* not a field, nor a folded line (obsolete) we could join */
+        return BAD_REQUEST;
+    }
+    /* line ends before the two '\0' parse_line left of its CRLF */
+    int begin = text - _read_buf;
+    if(_headers.full()) { /* not indexed, a field left out could be Content-Length */
+        _linger = false; /* rest of the fields are not read */
+        return HEADERS_TOO_LARGE;
+    }
+    if(!_headers.add(begin, colon, _checked_idx - 2, name_hash)) {
+        return BAD_REQUEST;
+    }
+    int i = _headers.size() - 1;
+    const char *value = _headers.value(i).data();
 #ifdef __DEBUG
-        printf("\n%s\n", text);
+    printf("\n%s\n", text);
 #endif
-        if(strcasecmp(text, "keep-alive") == 0) {
-            _linger = true;
+    switch(_headers.known(i)) {
+        case header_index::HEADER_CONNECTION: {
+            if(strcasecmp(value, "keep-alive") == 0) {
+                _linger = true;
+            }
+            break;
+        }
+        case header_index::HEADER_CONTENT_LENGTH: { /* request content length */
+            /* body must fit read buffer. a repeated one may disagree with what
+             * a backend believes, its connction is shared by clients */
+            long length = 0;
+            if(_headers.get(header_index::HEADER_CONTENT_LENGTH).data() != value
+                || !tools::parse_length(value, READ_BUFFER_SIZE, length)) {
+                return BAD_REQUEST;
+            }
+            _content_length = length;
+            break;
+        }
+        case header_index::HEADER_TRANSFER_ENCODING: { /* chunked bodies are not read */
+            return BAD_REQUEST;
+        }
+        case header_index::HEADER_HOST: {
+            _host = (char *)value;
+            break;
+        }
+        case header_index::HEADER_ACCEPT_ENCODING: { /* compressed variants */
+            _accept_gzip = tools::accepts_gzip(value);
+            break;
+        }
+        case header_index::HEADER_UPGRADE: { /* protocol switch */
+            _h2_upgrade = strcasecmp(value, "h2c") == 0;
+            break;
+        }
+        case header_index::HEADER_HTTP2_SETTINGS: { /* settings of h2c upgrade */
+            _h2_settings = (char *)value;
+            break;
+        }
+        default: { /* kept in index for handlers */
+            break;
         }
-    } else if(strncasecmp(text, "Content-Length:", 15) == 0) { /* request content length */
-        text += 15;
-        text += strspn(text, " \t");
-#ifdef __DEBUG
-        printf("\n%s\n", text);
-#endif
-        _content_length = atol(text);
-    } else if(strncasecmp(text, "Host:", 5) == 0) { /* host ip */
-        text += 5;
-        text += strspn(text, " \t");
-#ifdef __DEBUG
-        printf("\n%s\n", text);
-#endif
-        _host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text);
     }
     return NO_REQUEST;
 }
@@ -349,67 +1336,180 @@ http_conn::HTTP_CODE http_conn::parse_content(char * text) {
 
 /* according parse result to find resource in server & waiting for write to client */
 http_conn::HTTP_CODE http_conn::do_request() {
+    perf_stage::scope stage(perf_stage::STAGE_REQUEST);
+    if((_route = route_of(_url)) != NULL) {
+        return PROXY_REQUEST;
+    }
+    /* a working thread never waits for a file another one is loading */
+    file_cache::waiter w = {unpark, this};
+    HTTP_CODE ret = open_file(_url, _file, _cached_only, _accept_gzip, 
+        _pool != NULL ? &w : NULL);
+    if(ret == DEFERRED_REQUEST) {
+        _deferred = true;
+    }
+    return ret;
+}
+
+/* file a parked request waited for is loaded, queue it again */
+void http_conn::unpark(void *conn) {
+    http_conn *c = (http_conn *)conn;
+    c->_deferred = true; /* parsed, next process() goes on from do_request */
+    if(!_pool->append(c)) {
+        c->overload();
+    }
+}
+
+/* find url in server, shared by http/1 & http/2. with cached_only, 
+ * return DEFERRED_REQUEST unless url is a cached small file. with w, 
+ * PARKED_REQUEST if another thread is loading the file */
+http_conn::HTTP_CODE http_conn::open_file(const char *url, file_cache::entry *&file, 
+    bool cached_only, bool gzip, const file_cache::waiter *w) {
+    file = NULL;
+    /* canonical path once per url, recent misses are answered without stat */
+    char path[FILENAME_LEN];
+    switch(_path_cache->resolve(url, path, sizeof(path))) {
+        case path_cache::PATH_BAD: {
+            return BAD_REQUEST;
+        }
+        case path_cache::PATH_MISSING: {
+            return NO_RESOURCE;
+        }
+        case path_cache::PATH_FORBIDDEN: {
+            return FORBIDDEN_REQUEST;
+        }
+        default: {
+            break;
+        }
+    }
+    if(_bundle != NULL) {
+        /* one probe into the mapped index, the bundle is the whole document root */
+        file = _bundle->find(path, gzip);
+        if(file == NULL) {
+            return NO_RESOURCE;
+        }
+        if(cached_only && file->st.st_size > INLINE_FILE_MAX) { /* may fault on disk */
+            file = NULL;
+            return DEFERRED_REQUEST;
+        }
+        return FILE_REQUEST;
+    }
     /* resource file path */
-    sprintf(_real_file, "%s%s", DOC_ROOT, _url);
-    if(stat(_real_file, &_file_stat) != 0) {
+    char real_file[FILENAME_LEN];
+    if(snprintf(real_file, FILENAME_LEN, "%s%s", DOC_ROOT, path) >= FILENAME_LEN) {
         return BAD_REQUEST;
     }
-    /* access : others can read or not */
-    if(!(_file_stat.st_mode & S_IROTH)) {
-        return BAD_REQUEST;
+    if(_shm_cache != NULL) {
+        /* prefork : one copy in shared memory for all workers */
+        file = _shm_cache->find(real_file, !cached_only);
+        if(file != NULL) {
+            if(cached_only && file->st.st_size > INLINE_FILE_MAX) {
+                file = NULL;
+                return DEFERRED_REQUEST;
+            }
+            return FILE_REQUEST;
+        }
     }
-    /* is or not a dir */
-    if(S_ISDIR(_file_stat.st_mode)) {
-        return BAD_REQUEST;
+    if(cached_only) {
+        /* reactor thread : only a cached small file is cheap enough */
+        file = _file_cache->lookup(real_file);
+        if(file == NULL || file->st.st_size > INLINE_FILE_MAX) {
+            if(file != NULL) {
+                _file_cache->release(file);
+                file = NULL;
+            }
+            return DEFERRED_REQUEST;
+        }
+        return FILE_REQUEST;
     }
-    int fd = open(_real_file, O_RDONLY);
-    /* create mmap */
-    _file_address = (char *)mmap(NULL, _file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    ::close(fd); /* unistd.h */
-#ifdef __DEBUG
-    if(_file_address == NULL) {
-        perror("mmap");
+    int err = 0;
+    if(_shm_cache != NULL) {
+        /* a file left to private cache before is not copied again */
+        file = _file_cache->lookup(real_file);
+        if(file == NULL) {
+            file = _shm_cache->store(real_file, err);
+        }
+    }
+    if(file == NULL && (err == 0 || err == ENOSPC)) {
+        /* stat & mmap on miss, shared mapping on hit */
+        err = 0;
+        file = _file_cache->acquire(real_file, err, w);
+        if(file == NULL && err == EINPROGRESS) {
+            return PARKED_REQUEST;
+        }
     }
+    if(file == NULL) {
+#ifdef __DEBUG
+        errno = err;
+        perror("file cache");
 #endif
+        switch(err) {
+            /* not readable : 403, missing or not a file : 404, remembered */
+            case EACCES : {
+                _path_cache->fail(url, err);
+                return FORBIDDEN_REQUEST;
+            }
+            case ENOENT : 
+            case ENOTDIR : 
+            case EISDIR : {
+                _path_cache->fail(url, err);
+                return NO_RESOURCE;
+            }
+            /* out of descriptors or memory : passes, not cached */
+            case EMFILE : 
+            case ENFILE : 
+            case ENOMEM : 
+            case EAGAIN : {
+                return SERVICE_UNAVAILABLE;
+            }
+            default : {
+                return INTERNAL_ERROR;
+            }
+        }
+    }
     return FILE_REQUEST;
 }
 
 /* create response content according result code of parse http request */
 bool http_conn::process_write(HTTP_CODE http_code) {
+    perf_stage::scope stage(perf_stage::STAGE_WRITE);
     /* hash map will map reponse code to tile (response line) */
     add_status_line(http_code, RESPONSE_CODE_TITLE[http_code]);
     switch (http_code){
         case FILE_REQUEST: {
-            add_headers(_file_stat.st_size); 
-            /* write buffer */
-            _iov[0].iov_base = _write_buf;
-            _iov[0].iov_len = _write_idx;
-            /* mmap file */
-            _iov[1].iov_base = _file_address;
-            _iov[1].iov_len = _file_stat.st_size;
-            _iovcnt = 2; /* Number of buffers */
-
-            _bytes_to_send = _write_idx + _file_stat.st_size;
+            if(_file->head != NULL) { 
+                /* bundled file : headers are made by asset_pack & sent from the 
+                 * mapping between status line & ours, whatever their size */
+                int status_len = _write_idx;
+                add_linger();
+                add_blank_line();
+                _out.push(_write_buf, status_len);
+                _out.push(_file->head, _file->head_len);
+                _out.push(_write_buf + status_len, _write_idx - status_len);
+            } else {
+                add_headers(_file->st.st_size); 
+                _out.push(_write_buf, _write_idx);
+            }
+            /* then mmap file */
+            _out.push_file(_file_cache, _file, 0, _file->st.st_size);
 
 #ifdef __DEBUG
-    printf("\nbytes to send : %d\n", _bytes_to_send);
+    printf("\nbytes to send : %zu\n", _out.bytes());
 #endif
             break;
         }
         case BAD_REQUEST :
         case FORBIDDEN_REQUEST:
         case NO_RESOURCE : 
-        case INTERNAL_ERROR : {
+        case HEADERS_TOO_LARGE : 
+        case INTERNAL_ERROR : 
+        case BAD_GATEWAY : 
+        case SERVICE_UNAVAILABLE : {
             add_headers(strlen(RESPONSE_CODE_FORM[http_code])); /* get string length use strlen not sizeof */
             if(add_content(RESPONSE_CODE_FORM[http_code]) == false) {
                 return false;
             }
             /* write buffer */
-            _iov[0].iov_base = _write_buf;
-            _iov[0].iov_len = _write_idx;
-            _iovcnt = 1; /* Number of buffers */
-
-            _bytes_to_send = _write_idx;
+            _out.push(_write_buf, _write_idx);
             break;
         }
         default:{
@@ -443,7 +1543,7 @@ bool http_conn::add_content(const char *content) {
 #ifdef __DEBUG
     printf("\nadd content...\n");
 #endif
-    add_reponse("%s", content);
+    return add_reponse("%s", content);
 }
 
 /* response headers : Content-Length */
@@ -458,7 +1558,7 @@ bool http_conn::add_content_type() {
 
 /* response headers : Connection keep-alive or close */
 bool http_conn::add_linger() {
-    return add_reponse("Connection: %s\r\n", (_linger == true ? "keep-alive" : "close"));
+    return add_reponse("Connection: %s\r\n", (_linger && !_draining ? "keep-alive" : "close"));
 }
 
 /* '\r\n' */
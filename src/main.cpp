@@ -8,50 +8,104 @@
 #include <stdlib.h> 
 #include <cassert> 
 #include <sys/epoll.h> 
+#include <getopt.h> 
+#include <time.h> 
+#include <sys/un.h> 
+#include <sys/syscall.h> 
+#include <sys/wait.h> 
+#include <sys/prctl.h> 
+#include <signal.h> 
+#include <limits.h> 
+#include <sys/stat.h> 
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
 #include "tools.h"
+#include "warmup.h"
+#include "arena.h"
+#include "perf_stage.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
-#define BACKLOG_DEFAULT 8
+#define BACKLOG_DEFAULT 1024 /* accept queue, kernel caps it at net.core.somaxconn */
 #define NUMBER_IGN 1
 
-int main(int argc, char *argv[]) {
-    const char *ip = NULL;
-    int port;
-    if(argc < 2) {
-        printf("usage 1 : %s <ip-address> <port-number>\n", basename(argv[0]));
-        printf("usage 2 : %s <port-number>\n", basename(argv[0]));
-        exit(-1);
+#define MAX_CPUS 1024
+#define DRAIN_TIMEOUT 30 /* seconds to wait for in-flight requests when shutting down */
+#define TICK_MS 100 /* ms between sweeps when draining or accept is paused */
+#define WORKER_STABLE 10 /* seconds a prefork worker lives for its restart to be immediate */
+#define RESTART_DELAY_MIN_MS 100 /* restart delay after an early death, doubled each time */
+#define RESTART_DELAY_MAX_MS 10000
+
+/* admission control : accept is paused above high & resumed below low watermark */
+#define CONNS_HIGH_WATERMARK (MAX_FD - 1024)
+#define CONNS_LOW_WATERMARK (MAX_FD - 4096)
+#define TASKS_HIGH_WATERMARK (MAX_TASKS_DEFAULT * 3 / 4)
+#define TASKS_LOW_WATERMARK (MAX_TASKS_DEFAULT / 2)
+
+static const char BUSY_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* turn a connction away before it is initialized, a tls client can not read plain 503 */
+static void refuse(int connfd, bool plain) {
+    if(plain) {
+        send(connfd, BUSY_RESPONSE, sizeof(BUSY_RESPONSE) - 1, MSG_DONTWAIT);
     }
-    ip = argc == 2 ? "192.168.1.111" : argv[1];
-    port = atoi(argv[argc - 1]);
-    
-    /* ignore SIGPIPE */ 
-    lu::tools::set_sigcatch(SIGPIPE, SIG_IGN);
+    close(connfd);
+}
 
-    /* create thread pool of http connction */
-    lu::threadpool<lu::http_conn> *conn_pool = NULL;
-    try {
-        conn_pool = new lu::threadpool<lu::http_conn>;
-    } catch(const std::exception& e) {
+static int sig_pipefd[2]; /* signals are forwarded to the event loop through it */
+
+static void sig_handler(int sig) {
+    int save_errno = errno;
+    char msg = sig;
+    send(sig_pipefd[1], &msg, 1, 0);
+    errno = save_errno;
+}
+
+/* ask the old process listening on path for its listen fd, -1 if nobody there */
+static int handoff_take(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(sock >= 0);
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = -1;
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fd = lu::tools::recv_fd(sock);
+    }
+    close(sock);
+    return fd;
+}
+
+/* listen on path so that the next process can take our listen fd */
+static int handoff_listen(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(sock >= 0);
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0) {
+        perror("handoff socket");
+        close(sock);
         return -1;
     }
-    
-    /* possible users' http connction */
-    lu::http_conn *users = new lu::http_conn[MAX_FD];
-    assert(users != NULL);
+    return sock;
+}
 
-    /* listen fd */
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+/* bind & listen on ip:port */
+static int bind_listener(const char *ip, int port, lu::sock_profile &profile) {
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     assert(listenfd >= 0);
 
     /* set address reuse */
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    profile.apply_listener(listenfd);
     
     int ret = 0;
 
@@ -67,21 +121,626 @@ int main(int argc, char *argv[]) {
     /* listen */
     ret = listen(listenfd, BACKLOG_DEFAULT);
     assert(ret >= 0);
+    return listenfd;
+}
+
+/* listen fd into epoll. prefork workers share one, EPOLLEXCLUSIVE wakes one 
+ * of them for a connction instead of all */
+static void watch_listener(int epollfd, int listenfd, bool shared) {
+    if(!shared) {
+        lu::tools::addfd(epollfd, listenfd, false);
+        return;
+    }
+    epoll_event event;
+    event.data.fd = listenfd;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event);
+    lu::tools::set_nonblocking(listenfd); /* a woken worker may find it taken */
+}
+
+/* fork worker i of prefork master, 0 in the worker. mask is the signal mask
+ * of the worker, master blocks the signals it waits for */
+static pid_t spawn(int i, lu::shm_cache *shm, const sigset_t *mask) {
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+    } else if(pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM); /* drain & go if master is gone */
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        shm->attach(i);
+        shm->stats()->workers[i].pid.store(getpid(), std::memory_order_relaxed);
+    }
+    return pid;
+}
+
+static long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* restart delay after another early death of a worker */
+static long backoff(long delay) {
+    if(delay == 0) {
+        return RESTART_DELAY_MIN_MS;
+    }
+    return delay * 2 < RESTART_DELAY_MAX_MS ? delay * 2 : RESTART_DELAY_MAX_MS;
+}
+
+/* prefork : master holds listen fd & forks workers, which return from here 
+ * with their index to run the event loop. a worker which dies takes only its 
+ * own connctions & is forked again, right away if it lived for 
+ * WORKER_STABLE seconds, else after a delay doubled at each early death, so 
+ * a worker crashing on start does not fork in a loop. on SIGTERM/SIGINT 
+ * master passes it on, waits for workers to drain & returns -1 */
+static int prefork(int workers, lu::shm_cache *shm) {
+    pid_t pids[SHM_WORKERS_MAX]; /* -1 if not running */
+    long started[SHM_WORKERS_MAX]; /* ms of last fork, -1 if never forked */
+    long due[SHM_WORKERS_MAX]; /* ms a worker not running is forked */
+    long delay[SHM_WORKERS_MAX]; /* ms before fork after its next early death */
+    /* stop signals & exits of workers are only taken by sigtimedwait : one
+     * coming between a check & the wait stays pending, it is never missed */
+    sigset_t wait_set, worker_set;
+    sigemptyset(&wait_set);
+    sigaddset(&wait_set, SIGTERM);
+    sigaddset(&wait_set, SIGINT);
+    sigaddset(&wait_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &wait_set, &worker_set);
+    lu::tools::set_sigcatch(SIGUSR2, SIG_IGN);
+    long now = monotonic_ms();
+    for(int i = 0; i < workers; i++) {
+        pids[i] = -1;
+        started[i] = -1;
+        due[i] = now;
+        delay[i] = 0;
+    }
+    int running = 0;
+    bool stopping = false;
+    bool reported = false;
+    while(!stopping || running > 0) {
+        /* fork workers which are due */
+        now = monotonic_ms();
+        for(int i = 0; i < workers && !stopping; i++) {
+            if(pids[i] > 0 || due[i] > now) {
+                continue;
+            }
+            pids[i] = spawn(i, shm, &worker_set);
+            if(pids[i] == 0) {
+                return i;
+            }
+            if(pids[i] < 0) { /* fork failed, try again later */
+                delay[i] = backoff(delay[i]);
+                due[i] = now + delay[i];
+                continue;
+            }
+            if(started[i] >= 0) {
+                shm->stats()->workers[i].restarts.fetch_add(1, std::memory_order_relaxed);
+            }
+            started[i] = now;
+            running++;
+        }
+        if(!reported) {
+            printf("master %d : %d workers\n", getpid(), running);
+            reported = true;
+        }
+
+        /* sleep until a signal comes or the next fork is due */
+        long wait = -1;
+        for(int i = 0; i < workers && !stopping; i++) {
+            if(pids[i] < 0 && (wait < 0 || due[i] - now < wait)) {
+                wait = due[i] - now;
+            }
+        }
+        int sig;
+        if(wait < 0) {
+            sig = sigwaitinfo(&wait_set, NULL);
+        } else {
+            struct timespec timeout = {wait / 1000, wait % 1000 * 1000000};
+            sig = sigtimedwait(&wait_set, NULL, &timeout);
+        }
+        if((sig == SIGTERM || sig == SIGINT) && !stopping) {
+            stopping = true;
+            for(int i = 0; i < workers; i++) {
+                if(pids[i] > 0) {
+                    kill(pids[i], SIGTERM);
+                }
+            }
+        }
+
+        /* reap every worker gone, one SIGCHLD may stand for several */
+        int status = 0;
+        pid_t pid;
+        now = monotonic_ms();
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(int i = 0; i < workers; i++) {
+                if(pids[i] != pid) {
+                    continue;
+                }
+                pids[i] = -1;
+                running--;
+                shm->stats()->workers[i].pid.store(0, std::memory_order_relaxed);
+                if(stopping) {
+                    break;
+                }
+                if(now - started[i] >= WORKER_STABLE * 1000L) {
+                    delay[i] = 0;
+                } else {
+                    delay[i] = backoff(delay[i]);
+                }
+                due[i] = now + delay[i];
+                if(WIFSIGNALED(status)) {
+                    printf("worker %d (pid %d) killed by %s, restarting in %ld ms\n", 
+                        i, pid, strsignal(WTERMSIG(status)), delay[i]);
+                } else {
+                    printf("worker %d (pid %d) exited with %d, restarting in %ld ms\n", 
+                        i, pid, WEXITSTATUS(status), delay[i]);
+                }
+                break;
+            }
+        }
+    }
+    sigprocmask(SIG_SETMASK, &worker_set, NULL);
+    return -1;
+}
+
+/* start the same binary again, it takes the listen fd over through handoff path */
+static void upgrade(char *argv[]) {
+    pid_t pid = fork();
+    if(pid != 0) {
+        if(pid < 0) {
+            perror("fork");
+        }
+        return;
+    }
+    /* the child must not hold connections of the old process */
+    if(syscall(SYS_close_range, 3, ~0U, 0) != 0) {
+        for(int fd = 3; fd < MAX_FD; fd++) {
+            close(fd);
+        }
+    }
+    execvp(argv[0], argv);
+    perror("execvp");
+    _exit(-1);
+}
+
+static void usage(const char *prog) {
+    printf("usage 1 : %s [options] <ip-address> <port-number>\n", prog);
+    printf("usage 2 : %s [options] <port-number>\n", prog);
+    printf("options :\n");
+    printf("    -d <dir>      document root, default %s\n", lu::http_conn::DOC_ROOT);
+    printf("    -r <cpu>      pin reactor (main) thread to cpu\n");
+    printf("    -w <cpu-list> pin worker threads to cpus, eg: 0-3,8\n");
+    printf("    -n            pin worker threads to the reactor's numa node (with -r)\n");
+    printf("    -e <min-max>  elastic worker pool, sized by queue wait & utilization\n");
+    printf("    -q <w1,w2>    priority lanes : cheap requests (cached small files) get w1\n");
+    printf("                  turns for w2 of expensive ones, eg: 8,1\n");
+    printf("    -l <number>   max connections of one client ip\n");
+    printf("    -m <MB>       file cache capacity, default %d\n", FILE_CACHE_BYTES_DEFAULT >> 20);
+    printf("    -i            answer cached small files on reactor thread\n");
+    printf("    -o            coroutine mode, connections never leave reactor thread\n");
+    printf("    -t <profile>  tcp options, eg: nodelay,cork,sndbuf=262144,rcvbuf=262144,\n");
+    printf("                  fastopen=256,busy_poll=50,incoming_cpu,zerocopy=<bytes>\n");
+    printf("    -p <route>    reverse proxy urls with prefix to backends, least outstanding\n");
+    printf("                  first, eg: /api=127.0.0.1:9000,127.0.0.1:9001 (repeatable)\n");
+    printf("    -b <bundle>   serve document root packed by asset_pack, mapped once\n");
+    printf("    -W <hot-set>  warm files up before listening : all or a manifest of urls,\n");
+    printf("                  with ,mlock to lock & ,hugepage to ask for huge pages\n");
+    printf("    -H            connction slab & output buffers on 2MB huge pages\n");
+    printf("    -P <every>    count cycles, instructions, cache, branch & dtlb misses of\n");
+    printf("                  request stages (perf_event_open) for 1 in every runs\n");
+    printf("    -c <pem>      tls certificate chain, connctions speak https (with -k)\n");
+    printf("    -k <pem>      tls private key\n");
+    printf("    -F <workers>  prefork : master listens & forks workers running all of the\n");
+    printf("                  above, files cached once in shared memory (-m sizes it).\n");
+    printf("                  reactor of worker i is pinned to cpu r + i (with -r)\n");
+    printf("    -s <path>     unix socket for listen fd handoff, a new process started\n");
+    printf("                  with the same path takes over & the old one drains\n");
+    printf("signals :\n");
+    printf("    SIGTERM/SIGINT  stop accepting, finish in-flight requests & exit\n");
+    printf("    SIGUSR2         re-exec the binary & hand the listen fd over (with -s)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *ip = NULL;
+    int port;
+
+    /* cpu placement */
+    int reactor_cpu = -1;
+    int worker_cpus[MAX_CPUS];
+    int worker_cpu_num = 0;
+    bool node_local = false;
+
+    /* worker pool, elastic when max is above min */
+    int min_threads = THREAD_NUM_DEFAULT;
+    int max_threads = THREAD_NUM_DEFAULT;
+    int lane_weights[2] = {0, 0}; /* cheap & bulk lanes, unset for one fifo */
+
+    /* zero-downtime upgrade */
+    const char *handoff_path = NULL;
+
+    /* admission control */
+    int max_per_ip = 0;
+
+    /* file cache & inline fast path */
+    size_t cache_bytes = FILE_CACHE_BYTES_DEFAULT;
+    bool inline_mode = false;
+    bool coroutine_mode = false;
+
+    /* tcp tuning */
+    lu::sock_profile profile;
+
+    /* tls termination */
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
+
+    /* asset bundle */
+    const char *bundle_path = NULL;
+
+    /* warm-up of hot set before listening */
+    const char *warm_spec = NULL;
+
+    /* connction slab & output chunks on huge pages */
+    bool huge_arena = false;
+
+    /* reverse proxy */
+    lu::upstream_pool *upstreams = NULL;
+
+    /* prefork processes instead of one */
+    int workers = 0;
+
+    /* files served */
+    const char *doc_root = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "d:r:w:ns:l:m:it:oc:k:p:b:W:e:q:HP:F:")) != -1) {
+        switch(opt) {
+            case 'd': {
+                doc_root = optarg;
+                break;
+            }
+            case 'r': {
+                reactor_cpu = atoi(optarg);
+                break;
+            }
+            case 'w': {
+                worker_cpu_num = lu::tools::parse_cpu_list(optarg, worker_cpus, MAX_CPUS);
+                if(worker_cpu_num <= 0) {
+                    printf("bad cpu list : %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'n': {
+                node_local = true;
+                break;
+            }
+            case 's': {
+                handoff_path = optarg;
+                break;
+            }
+            case 'l': {
+                max_per_ip = atoi(optarg);
+                break;
+            }
+            case 'm': {
+                cache_bytes = (size_t)atoi(optarg) << 20;
+                break;
+            }
+            case 'i': {
+                inline_mode = true;
+                break;
+            }
+            case 'o': {
+#ifdef __cpp_impl_coroutine
+                coroutine_mode = true;
+#else
+                printf("coroutine mode needs a c++20 build\n");
+                exit(-1);
+#endif
+                break;
+            }
+            case 't': {
+                if(!profile.parse(optarg)) {
+                    exit(-1);
+                }
+                break;
+            }
+            case 'c': {
+                tls_cert = optarg;
+                break;
+            }
+            case 'k': {
+                tls_key = optarg;
+                break;
+            }
+            case 'b': {
+                bundle_path = optarg;
+                break;
+            }
+            case 'W': {
+                warm_spec = optarg;
+                break;
+            }
+            case 'e': {
+                if(sscanf(optarg, "%d-%d", &min_threads, &max_threads) != 2
+                    || min_threads <= 0 || max_threads < min_threads) {
+                    printf("bad thread bounds : %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'q': {
+                if(sscanf(optarg, "%d,%d", &lane_weights[0], &lane_weights[1]) != 2
+                    || lane_weights[0] <= 0 || lane_weights[1] <= 0) {
+                    printf("bad lane weights : %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'P': {
+                lu::perf_stage::enable(atoi(optarg));
+                break;
+            }
+            case 'H': {
+                huge_arena = true;
+                break;
+            }
+            case 'F': {
+                workers = atoi(optarg);
+                if(workers <= 0 || workers > SHM_WORKERS_MAX) {
+                    printf("prefork workers are 1-%d\n", SHM_WORKERS_MAX);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'p': {
+                if(upstreams == NULL) {
+                    upstreams = new lu::upstream_pool();
+                }
+                if(!upstreams->add_route(optarg)) {
+                    exit(-1);
+                }
+                break;
+            }
+            default: {
+                usage(basename(argv[0]));
+                exit(-1);
+            }
+        }
+    }
+    if(argc - optind < 1) {
+        usage(basename(argv[0]));
+        exit(-1);
+    }
+    if((tls_cert == NULL) != (tls_key == NULL)) {
+        printf("tls needs both certificate (-c) & key (-k)\n");
+        exit(-1);
+    }
+#ifndef __TLS
+    if(tls_cert != NULL) {
+        printf("tls needs a build with TLS=1\n");
+        exit(-1);
+    }
+#endif
+    if(doc_root != NULL) {
+        /* absolute & without trailing '/', urls are appended to it */
+        static char root[PATH_MAX];
+        struct stat st;
+        if(realpath(doc_root, root) == NULL || stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            printf("document root %s is not a directory\n", doc_root);
+            exit(-1);
+        }
+        lu::http_conn::DOC_ROOT = root;
+    }
+    if(node_local && reactor_cpu < 0) {
+        printf("numa-local workers (-n) need a pinned reactor (-r)\n");
+        exit(-1);
+    }
+    if(workers > 0 && handoff_path != NULL) {
+        printf("listen fd handoff is not used in prefork mode\n");
+        exit(-1);
+    }
+    if(coroutine_mode && profile.zerocopy > 0) {
+        printf("zerocopy is not used in coroutine mode\n");
+        profile.zerocopy = 0;
+    }
+    ip = argc - optind == 1 ? "192.168.1.111" : argv[optind];
+    port = atoi(argv[argc - 1]);
+    
+    /* ignore SIGPIPE */ 
+    lu::tools::set_sigcatch(SIGPIPE, SIG_IGN);
+
+    /* prefork : master binds & forks before any thread is started, each 
+     * worker runs everything below with its own reactor & pool */
+    int listenfd = -1;
+    int worker_id = -1;
+    if(workers > 0) {
+        listenfd = bind_listener(ip, port, profile);
+        try {
+            lu::http_conn::_shm_cache = new lu::shm_cache(cache_bytes);
+        } catch(const std::exception& e) {
+            return -1;
+        }
+        worker_id = prefork(workers, lu::http_conn::_shm_cache);
+        if(worker_id < 0) {
+            lu::shm_cache::header *stats = lu::http_conn::_shm_cache->stats();
+            printf("shared cache : %u files, %luMB of %luMB, %lu copied in, %lu stale, %lu left to workers, "
+                "%lu taken over from dead workers, %u dead slots holding %luMB\n", 
+                stats->files.load(), (unsigned long)(stats->used.load() >> 20), 
+                (unsigned long)(lu::http_conn::_shm_cache->capacity() >> 20), 
+                stats->misses.load(), stats->stale.load(), stats->refused.load(), stats->orphans.load(), 
+                stats->dead.load(), (unsigned long)(stats->lost.load() >> 20));
+            if(stats->full.load() != 0) {
+                time_t full = (time_t)stats->full.load();
+                printf("shared cache : full since %s", ctime(&full));
+            }
+            for(int i = 0; i < workers; i++) {
+                printf("worker %d : %lu connctions, %lu shared hits, %u restarts\n", i, 
+                    stats->workers[i].accepted.load(), stats->workers[i].hits.load(), 
+                    stats->workers[i].restarts.load());
+            }
+            close(listenfd);
+            delete lu::http_conn::_shm_cache;
+            delete upstreams;
+            return 0;
+        }
+        if(reactor_cpu >= 0) {
+            reactor_cpu += worker_id;
+        }
+    }
+    lu::shm_cache::worker *worker_stats = worker_id >= 0 ? 
+        &lu::http_conn::_shm_cache->stats()->workers[worker_id] : NULL;
+
+    /* pin reactor first, so memory it touches first comes from its node */
+    int reactor_node = -1;
+    if(reactor_cpu >= 0) {
+        if(!lu::tools::pin_thread(pthread_self(), reactor_cpu)) {
+            printf("pin reactor to cpu %d failed\n", reactor_cpu);
+            exit(-1);
+        }
+        reactor_node = lu::tools::cpu_node(reactor_cpu);
+        if(node_local && worker_cpu_num == 0) {
+            worker_cpu_num = lu::tools::node_cpus(reactor_node, worker_cpus, MAX_CPUS);
+            if(worker_cpu_num < 0) {
+                worker_cpu_num = 0;
+            }
+        }
+    }
+
+    /* create thread pool of http connction */
+    lu::threadpool<lu::http_conn> *conn_pool = NULL;
+    try {
+        conn_pool = new lu::threadpool<lu::http_conn>(min_threads, 
+            MAX_TASKS_DEFAULT, worker_cpus, worker_cpu_num, max_threads);
+    } catch(const std::exception& e) {
+        return -1;
+    }
+    if(lane_weights[0] > 0) {
+        /* cheap ones are told apart on reactor thread, before they queue */
+        conn_pool->set_lanes(2, lane_weights, lu::http_conn::classify);
+    }
+    
+    /* possible users' http connction */
+    lu::arena *mem = NULL;
+    if(huge_arena) {
+        try {
+            mem = new lu::arena(sizeof(lu::http_conn) * MAX_FD + ARENA_BUFFER_BYTES);
+        } catch(const std::exception& e) {
+            printf("huge page arena can not be mapped, connctions go on heap\n");
+        }
+    }
+    lu::http_conn *users = NULL;
+    if(mem != NULL) {
+        if(reactor_node >= 0) {
+            lu::tools::bind_node(mem->base(), mem->size(), reactor_node); /* before first touch */
+        }
+        users = (lu::http_conn *)mem->alloc(sizeof(lu::http_conn) * MAX_FD);
+        for(int fd = 0; fd < MAX_FD; fd++) {
+            new (&users[fd]) lu::http_conn();
+        }
+        lu::out_queue::_chunks = new lu::buffer_pool(mem, sizeof(lu::out_queue::chunk));
+        lu::http_conn::_exchanges = new lu::buffer_pool(mem, sizeof(lu::upstream_exchange));
+        printf("arena : %luMB on %s, %luMB huge now\n", (unsigned long)(mem->size() >> 20), 
+            mem->backing_name(), (unsigned long)(mem->huge_bytes() >> 20));
+    } else {
+        users = new lu::http_conn[MAX_FD];
+        assert(users != NULL);
+        if(reactor_node >= 0) {
+            /* connection slab is touched by reactor & workers of its node */
+            lu::tools::bind_node(users, sizeof(lu::http_conn) * MAX_FD, reactor_node);
+        }
+    }
+    if(max_per_ip > 0) {
+        lu::http_conn::_ip_limiter = new lu::conn_limiter(MAX_FD, max_per_ip);
+    }
+    lu::http_conn::_file_cache = new lu::file_cache(cache_bytes);
+    lu::http_conn::_path_cache = new lu::path_cache();
+    lu::http_conn::_sock_profile = &profile;
+    lu::http_conn::_upstreams = upstreams;
+    lu::http_conn::_pool = coroutine_mode ? NULL : conn_pool; /* misses park on it */
+    try {
+        lu::http_conn::_async_io = new lu::async_io();
+    } catch(const std::exception& e) {
+        return -1;
+    }
+    if(bundle_path != NULL) {
+        try {
+            lu::http_conn::_bundle = new lu::bundle(bundle_path);
+        } catch(const std::exception& e) {
+            return -1;
+        }
+        printf("%u urls from bundle %s\n", lu::http_conn::_bundle->count(), bundle_path);
+    }
+    if(warm_spec != NULL) {
+        /* hot set is in memory before the first connction comes */
+        lu::warmup warm(lu::http_conn::_file_cache, lu::http_conn::_bundle);
+        if(!warm.parse(warm_spec)) {
+            printf("bad warm-up : %s\n", warm_spec);
+            exit(-1);
+        }
+        warm.run(THREAD_NUM_DEFAULT, worker_cpus, worker_cpu_num);
+    }
+#ifdef __TLS
+    if(tls_cert != NULL) {
+        try {
+            lu::http_conn::_tls = new lu::tls_context(tls_cert, tls_key);
+        } catch(const std::exception& e) {
+            return -1;
+        }
+    }
+#endif
+
+    /* listen fd, taken over from the old process if there is one */
+    if(listenfd < 0 && handoff_path != NULL) {
+        listenfd = handoff_take(handoff_path);
+        if(listenfd >= 0) {
+            printf("listen fd taken over through %s\n", handoff_path);
+            profile.apply_listener(listenfd);
+        }
+    }
+    if(listenfd < 0) {
+        listenfd = bind_listener(ip, port, profile);
+    }
+    int handoff_fd = handoff_path != NULL ? handoff_listen(handoff_path) : -1;
 
     /* epoll */
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(NUMBER_IGN); /* the size argument is ignored, but must be greater than zero */
     assert(epollfd >= 0);
 
-    lu::tools::addfd(epollfd, listenfd, false);
+    watch_listener(epollfd, listenfd, worker_id >= 0);
     lu::http_conn::_epollfd = epollfd; /* mark epoll fd in http connction */
+    if(handoff_fd >= 0) {
+        lu::tools::addfd(epollfd, handoff_fd, false);
+    }
+
+    /* unified event source for signals */
+    int ret = socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sig_pipefd);
+    assert(ret != -1);
+    lu::tools::set_nonblocking(sig_pipefd[1]);
+    lu::tools::addfd(epollfd, sig_pipefd[0], false);
+    lu::tools::set_sigcatch(SIGTERM, sig_handler);
+    lu::tools::set_sigcatch(SIGINT, sig_handler);
+    lu::tools::set_sigcatch(SIGUSR2, sig_handler);
 
-    while(true) {
+    bool accept_paused = false; /* listen fd is out of epoll for overload */
+    bool draining = false; /* no more accept, exit when connections are done */
+    bool handed_off = false; /* listen fd is owned by a new process */
+    unsigned long remote_node_conns = 0; /* connctions arriving on another numa node */
+    static int cpu_nodes[MAX_CPUS]; /* numa node of cpu, sysfs is too slow for accept path */
+    for(int cpu = 0; cpu < MAX_CPUS && profile.incoming_cpu && reactor_node >= 0; cpu++) {
+        cpu_nodes[cpu] = lu::tools::cpu_node(cpu);
+    }
+    time_t drain_deadline = 0;
+
+    while(!draining || (lu::http_conn::_user_count > 0 && time(NULL) < drain_deadline)) {
         /* waitting for events comming */
 #ifdef __DEBUG
         printf("wait...\n");
 #endif
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        bool drain_request = false;
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, 
+            (draining || accept_paused || upstreams != NULL) ? TICK_MS : -1);
         if((num < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
@@ -90,6 +749,18 @@ int main(int argc, char *argv[]) {
         /* traverse events */
         for(int i = 0; i < num; i++) {
             int curfd = events[i].data.fd;
+            if((events[i].events & EPOLLERR) && curfd < MAX_FD && users[curfd].zerocopy_pending()) {
+                /* zerocopy completions come as EPOLLERR, not a broken connction */
+                if(!users[curfd].reap()) {
+                    users[curfd].close();
+                    continue;
+                }
+                events[i].events &= ~EPOLLERR;
+                if(!(events[i].events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP))) {
+                    users[curfd].rearm(); /* oneshot event is used up */
+                    continue;
+                }
+            }
             if(listenfd == curfd) {
                 /* new connction comming */
 #ifdef __DEBUG
@@ -99,20 +770,84 @@ int main(int argc, char *argv[]) {
                 socklen_t client_addr_len = sizeof(client_addr);
                 int connfd = accept(listenfd, (struct sockaddr *)&client_addr, &client_addr_len);
                 if(connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    perror("");
+                    if(errno != EAGAIN) { /* prefork : another worker took it */
+                        printf("errno is: %d\n", errno);
+                        perror("");
+                    }
                     continue;
                 }
-                if(lu::http_conn::_user_count >= MAX_FD) {
-                    lu::tools::show_err(connfd, "Server busy");
+                if(worker_stats != NULL) {
+                    worker_stats->accepted.fetch_add(1, std::memory_order_relaxed);
+                }
+                if(connfd >= MAX_FD || lu::http_conn::_user_count >= MAX_FD) {
+                    refuse(connfd, tls_cert == NULL);
+                    continue;
+                }
+                if(lu::http_conn::_ip_limiter != NULL 
+                    && !lu::http_conn::_ip_limiter->acquire(client_addr.sin_addr.s_addr)) {
+                    /* too many connctions from this client */
+                    refuse(connfd, tls_cert == NULL);
                     continue;
                 }
                 /* initialize client connction */
-                users[connfd].init(connfd, client_addr);
+                int incoming_cpu = profile.apply_conn(connfd);
+                if(incoming_cpu >= 0 && incoming_cpu < MAX_CPUS && reactor_node >= 0 
+                    && cpu_nodes[incoming_cpu] != reactor_node) {
+                    remote_node_conns++;
+                }
+                users[connfd].init(connfd, client_addr, incoming_cpu);
+#ifdef __cpp_impl_coroutine
+                if(coroutine_mode) {
+                    users[connfd].start();
+                }
+#endif
+            } else if(curfd == sig_pipefd[0]) {
+                char signals[64];
+                int cnt = recv(sig_pipefd[0], signals, sizeof(signals), 0);
+                for(int j = 0; j < cnt; j++) {
+                    if(signals[j] == SIGUSR2 && handoff_fd >= 0) {
+                        upgrade(argv);
+                    } else if(signals[j] == SIGTERM || signals[j] == SIGINT) {
+                        drain_request = true;
+                    }
+                }
+            } else if(curfd == handoff_fd) {
+                /* new process is up, give it the listen fd & retire */
+                int sock = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+                if(sock >= 0) {
+                    if(lu::tools::send_fd(sock, listenfd)) {
+                        handed_off = true;
+                        drain_request = true;
+                    }
+                    close(sock);
+                }
+            } else if(upstreams != NULL && upstreams->lent(curfd) != NULL) {
+                /* backend connction : relay of its proxied request goes on */
+                lu::http_conn *conn = upstreams->lent(curfd)->owner;
+#ifdef __cpp_impl_coroutine
+                if(coroutine_mode) {
+                    conn->resume();
+                    continue;
+                }
+#endif
+                if(!conn->relay()) {
+                    conn->close();
+                }
+#ifdef __cpp_impl_coroutine
+            } else if(coroutine_mode) {
+                /* any event of connction : let its coroutine go on */
+                users[curfd].resume();
+#endif
             } else if(events[i].events & (EPOLLIN)) {
                 /* read events ready */
                 if(users[curfd].read()) {
-                    conn_pool->append(&users[curfd]);
+                    if(inline_mode && users[curfd].process_inline()) {
+                        continue; /* answered on reactor thread */
+                    }
+                    if(!conn_pool->append(&users[curfd])) {
+                        /* queue is full, fail fast instead of leaving it unarmed */
+                        users[curfd].overload();
+                    }
                 } else {
                     users[curfd].close();
                 }
@@ -126,13 +861,105 @@ int main(int argc, char *argv[]) {
                 users[curfd].close();
             }
         }
+
+        if(upstreams != NULL) {
+            upstreams->check(time(NULL));
+        }
+        if(!draining) {
+            int tasks = conn_pool->size();
+            if(!accept_paused && (lu::http_conn::_user_count >= CONNS_HIGH_WATERMARK 
+                || tasks >= TASKS_HIGH_WATERMARK)) {
+                /* new connctions wait in the kernel backlog */
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, NULL);
+                accept_paused = true;
+            } else if(accept_paused && lu::http_conn::_user_count <= CONNS_LOW_WATERMARK 
+                && tasks <= TASKS_LOW_WATERMARK) {
+                watch_listener(epollfd, listenfd, worker_id >= 0);
+                accept_paused = false;
+            }
+        }
+        if(drain_request && !draining) {
+            printf("draining %d connctions...\n", lu::http_conn::_user_count.load());
+            draining = true;
+            drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+            lu::http_conn::_draining = true;
+            lu::tools::removefd(epollfd, listenfd);
+            listenfd = -1;
+            if(handoff_fd >= 0) {
+                lu::tools::removefd(epollfd, handoff_fd);
+                handoff_fd = -1;
+                if(!handed_off) {
+                    unlink(handoff_path);
+                }
+            }
+        }
+        if(draining) {
+            /* keep-alive connctions waiting for next request can go now */
+            for(int fd = 0; fd < MAX_FD; fd++) {
+                if(users[fd].idle()) {
+                    users[fd].retire();
+                }
+            }
+        }
     }
 
-    /* release resource */
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
+    if(remote_node_conns > 0) {
+        /* irq affinity of the nic should be moved to the reactor's node */
+        printf("%lu connctions arrived on another numa node than reactor\n", remote_node_conns);
+    }
+
+    /* release resource, queued tasks are finished before workers exit */
+    lu::lock_stats queue = conn_pool->queue_stats();
+    printf("task queue : %lu contended, %lu slept, %lu idle wakeups\n", 
+        queue.contended, queue.sleeps, conn_pool->wakeups());
+    if(conn_pool->lanes() > 1) {
+        printf("lanes : %lu cheap & %lu bulk tasks\n", 
+            conn_pool->taken(lu::http_conn::LANE_CHEAP), conn_pool->taken(lu::http_conn::LANE_BULK));
+    }
+    lu::perf_stage::report();
+    if(max_threads > min_threads) {
+        printf("workers : %d active of %d-%d, grown %lu & shrunk %lu times\n", 
+            conn_pool->active(), min_threads, max_threads, conn_pool->grown(), conn_pool->shrunk());
+    }
     delete conn_pool;
+    delete lu::http_conn::_async_io; /* reads in flight touch mappings of connctions */
+    for(int fd = 0; fd < MAX_FD; fd++) {
+        users[fd].close();
+    }
+    if(listenfd >= 0) {
+        close(listenfd);
+    }
+    if(handoff_fd >= 0) {
+        close(handoff_fd);
+        unlink(handoff_path);
+    }
+    close(sig_pipefd[0]);
+    close(sig_pipefd[1]);
+    close(epollfd);
+    if(mem != NULL) {
+        for(int fd = 0; fd < MAX_FD; fd++) {
+            users[fd].~http_conn();
+        }
+        printf("arena : %luMB used, %luMB huge, %lu buffers from heap\n", 
+            (unsigned long)(mem->used() >> 20), (unsigned long)(mem->huge_bytes() >> 20), 
+            lu::out_queue::_chunks->spilled() + lu::http_conn::_exchanges->spilled());
+        delete lu::out_queue::_chunks;
+        delete lu::http_conn::_exchanges;
+        lu::out_queue::_chunks = NULL;
+        lu::http_conn::_exchanges = NULL;
+        delete mem;
+    } else {
+        delete [] users;
+    }
+    delete lu::http_conn::_ip_limiter;
+    delete lu::http_conn::_file_cache;
+    delete lu::http_conn::_path_cache;
+    delete upstreams;
+    delete lu::http_conn::_bundle;
+    delete lu::http_conn::_shm_cache;
+#ifdef __TLS
+    delete lu::http_conn::_tls;
+#endif
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "out_queue.h"
+
+#include <string.h>
+#include <new>
+
+namespace lu {
+
+buffer_pool *out_queue::_chunks = NULL;
+
+out_queue::out_queue() : _head(0), _tail(NULL), _bytes(0) {}
+
+out_queue::~out_queue() {
+    clear();
+    release_held();
+}
+
+/* bytes which stay valid until they are sent or the queue is cleared */
+void out_queue::push(const char *data, size_t len) {
+    if(len == 0) {
+        return;
+    }
+    segment s = {data, len, NULL, NULL, NULL, -1};
+    _segments.push_back(s);
+    _bytes += len;
+}
+
+/* copy of bytes, into the last chunk while it has room */
+void out_queue::push_copy(const char *data, size_t len) {
+    while(len > 0) {
+        if(_tail == NULL || _tail->used == OUT_CHUNK_SIZE) {
+            if(_tail != NULL) {
+                unref(_tail);
+            }
+            _tail = _chunks != NULL ? new (_chunks->get()) chunk : new chunk;
+            _tail->refs = 1;
+            _tail->used = 0;
+        }
+        size_t n = OUT_CHUNK_SIZE - _tail->used;
+        if(n > len) {
+            n = len;
+        }
+        char *dst = _tail->data + _tail->used;
+        memcpy(dst, data, n);
+        _tail->used += n;
+        if(!empty() && _segments.back().buf == _tail 
+            && _segments.back().data + _segments.back().len == dst) {
+            _segments.back().len += n; /* grows in place */
+        } else {
+            segment s = {dst, n, _tail, NULL, NULL, -1};
+            _tail->refs++;
+            _segments.push_back(s);
+        }
+        _bytes += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/* len bytes of file from off, the queue keeps its own reference of file */
+void out_queue::push_file(file_cache *cache, file_cache::entry *file, size_t off, size_t len) {
+    if(len == 0) {
+        return;
+    }
+    cache->retain(file);
+    segment s = {file->address + off, len, NULL, cache, file, -1};
+    _segments.push_back(s);
+    _bytes += len;
+}
+
+/* iovecs of queued bytes from the head, at most max, return count. with
+ * zerocopy_min, file slices from that size go apart from other bytes :
+ * zerocopy tells if the iovecs are such slices */
+int out_queue::fill(struct iovec *iov, int max, size_t zerocopy_min, bool *zerocopy) const {
+    bool zc = false;
+    if(zerocopy_min > 0) {
+        const segment &s = _segments[_head];
+        zc = s.file != NULL && s.len >= zerocopy_min;
+        *zerocopy = zc;
+    }
+    int cnt = 0;
+    for(size_t i = _head; i < _segments.size() && cnt < max; i++, cnt++) {
+        const segment &s = _segments[i];
+        if(zerocopy_min > 0 && (s.file != NULL && s.len >= zerocopy_min) != zc) {
+            break; /* the other kind of send */
+        }
+        iov[cnt].iov_base = (void *)s.data;
+        iov[cnt].iov_len = s.len;
+    }
+    return cnt;
+}
+
+/* n bytes of head were sent, by zerocopy send zc if it is not -1 : drop 
+ * segments done, advance partial one */
+void out_queue::consume(size_t n, long zc) {
+    _bytes -= n;
+    while(n > 0) {
+        segment &s = _segments[_head];
+        if(zc >= 0) {
+            s.zc = zc;
+        }
+        if(n < s.len) {
+            s.data += n;
+            s.len -= n;
+            return;
+        }
+        n -= s.len;
+        pop();
+    }
+}
+
+/* zerocopy sends lo..hi are complete, release files they held */
+void out_queue::complete(uint32_t lo, uint32_t hi) {
+    size_t kept = 0;
+    for(size_t i = 0; i < _held.size(); i++) {
+        if(_held[i].id - lo <= hi - lo) { /* in range, ids wrap around */
+            _held[i].cache->release(_held[i].file);
+        } else {
+            _held[kept++] = _held[i];
+        }
+    }
+    _held.resize(kept);
+}
+
+/* socket is closing : release held files, pages in flight are pinned by kernel */
+void out_queue::release_held() {
+    for(size_t i = 0; i < _held.size(); i++) {
+        _held[i].cache->release(_held[i].file);
+    }
+    _held.clear();
+}
+
+/* drop everything, releasing chunks & files. files held by zerocopy sends
+ * stay held */
+void out_queue::clear() {
+    while(!empty()) {
+        pop();
+    }
+    if(_tail != NULL) {
+        unref(_tail);
+        _tail = NULL;
+    }
+    _bytes = 0;
+}
+
+/* drop first segment */
+void out_queue::pop() {
+    segment &s = _segments[_head++];
+    if(s.buf != NULL) {
+        unref(s.buf);
+    }
+    if(s.file != NULL && s.zc >= 0) {
+        held h = {s.cache, s.file, (uint32_t)s.zc};
+        _held.push_back(h); /* kernel may still read its pages */
+    } else if(s.file != NULL) {
+        s.cache->release(s.file);
+    }
+    if(_head == _segments.size()) {
+        _segments.clear(); /* capacity is kept for next response */
+        _head = 0;
+    }
+}
+
+void out_queue::unref(chunk *c) {
+    if(--c->refs == 0) {
+        if(_chunks != NULL) {
+            _chunks->put(c);
+        } else {
+            delete c;
+        }
+    }
+}
+
+}
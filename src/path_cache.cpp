@@ -0,0 +1,164 @@
+#include "path_cache.h"
+
+#include <string.h>
+#include <errno.h>
+
+namespace lu {
+
+path_cache::path_cache(size_t max_entries)
+    : _max_entries(max_entries),
+    _hits(0),
+    _negative_hits(0) {}
+
+/* canonical path of url into path (len bytes), or negative result of it */
+path_cache::RESULT path_cache::resolve(const char *url, char *path, size_t len) {
+    std::string key(url, key_length(url));
+    time_t now = time(NULL);
+    _locker.lock();
+    std::unordered_map<std::string, item>::iterator it = _map.find(key);
+    if(it != _map.end()) {
+        item &i = it->second;
+        if(i.expires == 0 || now < i.expires) {
+            _lru.splice(_lru.begin(), _lru, i.lru);
+            _hits++;
+            RESULT result = i.result;
+            if(result == PATH_OK) {
+                if(i.canonical.size() >= len) {
+                    result = PATH_BAD;
+                } else {
+                    memcpy(path, i.canonical.c_str(), i.canonical.size() + 1);
+                }
+            } else if(result != PATH_BAD) {
+                _negative_hits++;
+            }
+            _locker.unlock();
+            return result;
+        }
+    }
+    _locker.unlock();
+
+    /* canonicalize without lock */
+    item i;
+    i.expires = 0;
+    i.result = canonicalize(key.c_str(), key.size(), path, len) ? PATH_OK : PATH_BAD;
+    if(i.result == PATH_OK) {
+        i.canonical = path;
+    }
+    _locker.lock();
+    store(key, i);
+    _locker.unlock();
+    return i.result;
+}
+
+/* file of url could not be opened with err, remember it for a while */
+void path_cache::fail(const char *url, int err) {
+    /* only answers that stay true, a transient error is not remembered */
+    if(err != EACCES && err != ENOENT && err != ENOTDIR && err != EISDIR) {
+        return;
+    }
+    std::string key(url, key_length(url));
+    item i;
+    i.result = err == EACCES ? PATH_FORBIDDEN : PATH_MISSING;
+    i.expires = time(NULL) + PATH_CACHE_NEGATIVE_TTL;
+    _locker.lock();
+    store(key, i);
+    _locker.unlock();
+}
+
+/* url key : path part, query is not part of resolution */
+size_t path_cache::key_length(const char *url) {
+    return strcspn(url, "?#");
+}
+
+/* insert or replace item of key, locked */
+void path_cache::store(const std::string &key, const item &i) {
+    std::unordered_map<std::string, item>::iterator it = _map.find(key);
+    if(it != _map.end()) {
+        std::list<std::string>::iterator lru = it->second.lru;
+        it->second = i;
+        it->second.lru = lru;
+        _lru.splice(_lru.begin(), _lru, lru);
+        return;
+    }
+    if(_map.size() >= _max_entries) {
+        _map.erase(_lru.back());
+        _lru.pop_back();
+    }
+    _lru.push_front(key);
+    item &stored = _map[key];
+    stored = i;
+    stored.lru = _lru.begin();
+}
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* url path without query, percent-decoded & dot segments removed. false for
+ * malformed escapes, encoded NUL or '/' or if it does not fit in len */
+bool path_cache::canonicalize(const char *url, size_t url_len, char *out, size_t len) {
+    if(url_len == 0 || url[0] != '/' || len < 2) {
+        return false;
+    }
+    /* out always starts with '/', each segment is copied behind it,
+     * "." is dropped, ".." takes back the last segment (never above root) */
+    size_t o = 0;
+    out[o++] = '/';
+    size_t i = 1;
+    while(i <= url_len) {
+        /* one segment, decoded into out */
+        size_t seg = o;
+        for(; i < url_len && url[i] != '/'; i++) {
+            char c = url[i];
+            if(c == '%') {
+                int hi = i + 2 < url_len ? hex_value(url[i + 1]) : -1;
+                int lo = hi >= 0 ? hex_value(url[i + 2]) : -1;
+                if(lo < 0) {
+                    return false;
+                }
+                c = (char)(hi << 4 | lo);
+                i += 2;
+                if(c == '\0' || c == '/') { /* encoded '/' could hide ".." segments */
+                    return false;
+                }
+            }
+            if(o + 1 >= len) {
+                return false;
+            }
+            out[o++] = c;
+        }
+        bool last = i >= url_len;
+        i++; /* skip '/' */
+        size_t seg_len = o - seg;
+        if(seg_len == 1 && out[seg] == '.') {
+            o = seg;
+        } else if(seg_len == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+            o = seg - 1; /* slash before segment */
+            while(o > 0 && out[o - 1] != '/') {
+                o--;
+            }
+            if(o == 0) {
+                o = 1;
+            }
+        } else if(seg_len > 0 && !last) {
+            if(o + 1 >= len) {
+                return false;
+            }
+            out[o++] = '/';
+        }
+        /* empty segment (//) is dropped */
+    }
+    out[o] = '\0';
+    return true;
+}
+
+}
@@ -0,0 +1,196 @@
+#include "perf_stage.h"
+#include "locker.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+
+namespace lu {
+
+/* counters of one thread, kept after it exits for report */
+struct perf_stage::thread_state {
+    pid_t tid;
+    int fds[COUNTER_COUNT]; /* group, cycles leads. -1 if not supported */
+    int slots[COUNTER_COUNT]; /* index of counter in group read, -1 if none */
+    int opened; /* counters in group */
+    perf_stage::scope *top; /* innermost counted stage */
+    unsigned long ticks[STAGE_COUNT]; /* runs of stage, sampled or not */
+    unsigned long samples[STAGE_COUNT];
+    uint64_t sums[STAGE_COUNT][COUNTER_COUNT];
+};
+
+bool perf_stage::_enabled = false;
+int perf_stage::_every = PERF_SAMPLE_EVERY;
+
+static locker states_locker;
+static std::vector<perf_stage::thread_state *> states; /* of every thread counted */
+static thread_local perf_stage::thread_state *local_state = NULL;
+static thread_local bool local_failed = false;
+
+static const char *STAGE_NAMES[perf_stage::STAGE_COUNT] = {
+    "process_read", "do_request", "process_write", "flush"
+};
+
+static int open_counter(uint32_t type, uint64_t config, int group, bool kernel) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = kernel ? 0 : 1; /* writev is mostly kernel work */
+    attr.exclude_hv = 1;
+    attr.disabled = group == -1 ? 1 : 0;
+    /* not leaked into the binary re-exec'ed on SIGUSR2 */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+void perf_stage::enable(int every) {
+    _every = every > 0 ? every : PERF_SAMPLE_EVERY;
+    _enabled = true;
+}
+
+perf_stage::thread_state *perf_stage::state() {
+    if(local_state != NULL || local_failed) {
+        return local_state;
+    }
+    static const struct { uint32_t type; uint64_t config; } events[COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+    };
+    thread_state *s = new thread_state();
+    memset(s, 0, sizeof(*s));
+    s->tid = syscall(SYS_gettid);
+    /* kernel side too if perf_event_paranoid lets us, else user side only */
+    bool kernel = true;
+    s->fds[0] = open_counter(events[0].type, events[0].config, -1, kernel);
+    if(s->fds[0] < 0) {
+        kernel = false;
+        s->fds[0] = open_counter(events[0].type, events[0].config, -1, kernel);
+    }
+    if(s->fds[0] < 0) {
+        delete s;
+        local_failed = true;
+        return NULL;
+    }
+    s->slots[0] = 0;
+    s->opened = 1;
+    for(int i = 1; i < COUNTER_COUNT; i++) {
+        s->fds[i] = open_counter(events[i].type, events[i].config, s->fds[0], kernel);
+        s->slots[i] = s->fds[i] >= 0 ? s->opened++ : -1;
+    }
+    ioctl(s->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    states_locker.lock();
+    states.push_back(s);
+    states_locker.unlock();
+    local_state = s;
+    return s;
+}
+
+/* all counters of group in one read */
+static bool read_group(perf_stage::thread_state *s, uint64_t *out) {
+    uint64_t buf[1 + perf_stage::COUNTER_COUNT];
+    if(read(s->fds[0], buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (1 + s->opened))) {
+        return false;
+    }
+    for(int i = 0; i < perf_stage::COUNTER_COUNT; i++) {
+        out[i] = s->slots[i] >= 0 ? buf[1 + s->slots[i]] : 0;
+    }
+    return true;
+}
+
+/* a stage inside a counted one is always counted, its counts are taken
+ * out of the outer one. otherwise one in _every runs is */
+void perf_stage::scope::begin(STAGE stage) {
+    thread_state *s = state();
+    if(s == NULL) {
+        return;
+    }
+    if(s->ticks[stage]++ % _every != 0 && s->top == NULL) {
+        return;
+    }
+    if(!read_group(s, _begin)) {
+        return;
+    }
+    _state = s;
+    _stage = stage;
+    _parent = s->top;
+    memset(_nested, 0, sizeof(_nested));
+    s->top = this;
+}
+
+void perf_stage::scope::end() {
+    uint64_t now[COUNTER_COUNT];
+    bool ok = read_group(_state, now);
+    _state->top = _parent;
+    if(!ok) {
+        return;
+    }
+    for(int i = 0; i < COUNTER_COUNT; i++) {
+        uint64_t delta = now[i] - _begin[i];
+        _state->sums[_stage][i] += delta - _nested[i];
+        if(_parent != NULL) {
+            _parent->_nested[i] += delta;
+        }
+    }
+    _state->samples[_stage]++;
+}
+
+/* one line per stage : samples, cycles & instructions per run, ipc, misses
+ * per thousand instructions */
+static void print_stage(const char *who, int stage, unsigned long samples, const uint64_t *sums) {
+    if(samples == 0) {
+        return;
+    }
+    double ki = sums[perf_stage::INSTRUCTIONS] / 1000.0;
+    printf("  %-8s %-14s %8lu %10.0f %10.0f %6.2f %8.2f %8.2f %8.2f\n", who, STAGE_NAMES[stage], 
+        samples, (double)sums[perf_stage::CYCLES] / samples, 
+        (double)sums[perf_stage::INSTRUCTIONS] / samples,
+        sums[perf_stage::CYCLES] > 0 ? sums[perf_stage::INSTRUCTIONS] / (double)sums[perf_stage::CYCLES] : 0,
+        ki > 0 ? sums[perf_stage::CACHE_MISSES] / ki : 0, 
+        ki > 0 ? sums[perf_stage::BRANCH_MISSES] / ki : 0,
+        ki > 0 ? sums[perf_stage::DTLB_MISSES] / ki : 0);
+}
+
+void perf_stage::report() {
+    if(!_enabled) {
+        return;
+    }
+    states_locker.lock();
+    if(states.empty()) {
+        states_locker.unlock();
+        printf("perf counters : not available (no pmu, or perf_event_paranoid too high)\n");
+        return;
+    }
+    printf("perf counters : 1 in %d runs of each stage, misses per 1000 instructions\n", _every);
+    printf("  %-8s %-14s %8s %10s %10s %6s %8s %8s %8s\n", "thread", "stage", "samples", 
+        "cycles", "instrs", "ipc", "llc", "branch", "dtlb");
+    unsigned long samples[STAGE_COUNT] = {0};
+    uint64_t sums[STAGE_COUNT][COUNTER_COUNT] = {{0}};
+    for(size_t t = 0; t < states.size(); t++) {
+        thread_state *s = states[t];
+        char who[16];
+        snprintf(who, sizeof(who), "%d", (int)s->tid);
+        for(int i = 0; i < STAGE_COUNT; i++) {
+            print_stage(who, i, s->samples[i], s->sums[i]);
+            samples[i] += s->samples[i];
+            for(int c = 0; c < COUNTER_COUNT; c++) {
+                sums[i][c] += s->sums[i][c];
+            }
+        }
+    }
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        print_stage("all", i, samples[i], sums[i]);
+    }
+    states_locker.unlock();
+}
+
+}
@@ -0,0 +1,320 @@
+#include "shm_cache.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+#include <exception>
+
+#include "bundle.h"
+
+namespace lu {
+
+static inline size_t page_align(size_t n) {
+    return (n + SHM_CACHE_PAGE - 1) & ~(size_t)(SHM_CACHE_PAGE - 1);
+}
+
+/* segment with bytes of content, throw if it can not be made */
+shm_cache::shm_cache(size_t bytes, size_t max_file)
+    : _fd(-1),
+    _capacity(page_align(bytes)),
+    _max_file(max_file),
+    _index_bytes(page_align(sizeof(header) + sizeof(slot) * SHM_CACHE_SLOTS)),
+    _header(NULL),
+    _slots(NULL),
+    _content(NULL),
+    _files(NULL),
+    _worker(0) {
+    _fd = memfd_create("lu-file-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(_fd < 0 || ftruncate(_fd, _index_bytes + _capacity) != 0) {
+        perror("shm cache");
+        if(_fd >= 0) {
+            ::close(_fd);
+        }
+        throw std::exception();
+    }
+    /* size is fixed, no mapping can be cut short under a sender */
+    fcntl(_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    void *index = mmap(NULL, _index_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    void *content = mmap(NULL, _capacity, PROT_READ, MAP_SHARED, _fd, _index_bytes);
+    if(index == MAP_FAILED || content == MAP_FAILED) {
+        perror("shm cache mmap");
+        if(index != MAP_FAILED) {
+            munmap(index, _index_bytes);
+        }
+        if(content != MAP_FAILED) {
+            munmap(content, _capacity);
+        }
+        ::close(_fd);
+        throw std::exception();
+    }
+    /* a new memfd reads as zeros : every slot is empty */
+    _header = new (index) header();
+    _slots = (slot *)((char *)index + sizeof(header));
+    _content = (char *)content;
+    _files = new std::atomic<file_cache::entry *>[SHM_CACHE_SLOTS]();
+}
+
+shm_cache::~shm_cache() {
+    for(uint32_t i = 0; i < SHM_CACHE_SLOTS; i++) {
+        delete _files[i].load(std::memory_order_relaxed);
+    }
+    delete [] _files;
+    munmap(_content, _capacity);
+    munmap(_header, _index_bytes);
+    ::close(_fd);
+}
+
+/* ready file of path or NULL. with validate, a file not checked for
+ * FILE_CACHE_VALIDATE seconds is stat'ed, otherwise NULL is returned for
+ * it. entries are pinned, never released */
+file_cache::entry *shm_cache::find(const char *path, bool validate) {
+    uint64_t h = bundle::hash(path, strlen(path)) >> 2;
+    uint64_t ready = tag(h, SLOT_READY);
+    for(uint32_t i = h & (SHM_CACHE_SLOTS - 1); ; i = (i + 1) & (SHM_CACHE_SLOTS - 1)) {
+        uint64_t t = _slots[i].tag.load(std::memory_order_acquire);
+        if(t == 0) { /* index is never full, probe ends on an empty slot */
+            return NULL;
+        }
+        slot &s = _slots[i];
+        if(t != ready || strcmp(s.path, path) != 0) {
+            continue;
+        }
+        time_t now = time(NULL);
+        if(now - s.checked.load(std::memory_order_relaxed) >= FILE_CACHE_VALIDATE) {
+            if(!validate) {
+                return NULL;
+            }
+            /* one stat per period for all workers, whoever comes first */
+            struct stat st;
+            if(stat(path, &st) == 0 && st.st_ino == s.ino && (uint64_t)st.st_size == s.size
+                && st.st_mtime == s.mtime) {
+                s.checked.store(now, std::memory_order_relaxed);
+            } else {
+                if(s.tag.compare_exchange_strong(t, tag(h, SLOT_DEAD), std::memory_order_relaxed)) {
+                    _header->files.fetch_sub(1, std::memory_order_relaxed);
+                    _header->stale.fetch_add(1, std::memory_order_relaxed);
+                    _header->dead.fetch_add(1, std::memory_order_relaxed);
+                    _header->lost.fetch_add(page_align(s.size), std::memory_order_relaxed);
+                }
+                continue; /* a fresh copy may be further on */
+            }
+        }
+        _header->workers[_worker].hits.fetch_add(1, std::memory_order_relaxed);
+        return entry_of(i);
+    }
+}
+
+/* copy path into segment. NULL on failure with err set to errno of
+ * open/fstat, EACCES if others can not read, EISDIR for dir, ENOSPC if
+ * it is too big, there is no room, it can not be copied or another
+ * worker is copying it : serve it from private cache then */
+file_cache::entry *shm_cache::store(const char *path, int &err) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        err = errno;
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        err = errno;
+        ::close(fd);
+        return NULL;
+    }
+    /* access : others can read or not */
+    if(!(st.st_mode & S_IROTH)) {
+        ::close(fd);
+        err = EACCES;
+        return NULL;
+    }
+    /* is or not a dir */
+    if(S_ISDIR(st.st_mode)) {
+        ::close(fd);
+        err = EISDIR;
+        return NULL;
+    }
+    err = ENOSPC;
+    uint32_t taken = _header->taken.load(std::memory_order_relaxed);
+    do {
+        if(!S_ISREG(st.st_mode) || (size_t)st.st_size > _max_file
+            || (size_t)st.st_size > _capacity || strlen(path) >= SHM_CACHE_PATH_MAX) {
+            _header->refused.fetch_add(1, std::memory_order_relaxed);
+            ::close(fd);
+            return NULL;
+        }
+        if(taken >= SHM_CACHE_FILL
+            || _header->used.load(std::memory_order_relaxed) + st.st_size > _capacity) {
+            _header->refused.fetch_add(1, std::memory_order_relaxed);
+            note_full();
+            ::close(fd);
+            return NULL;
+        }
+    } while(!_header->taken.compare_exchange_weak(taken, taken + 1, std::memory_order_relaxed));
+
+    /* claim an empty slot, unless the path is there or on its way. owner
+     * is claimed before tag : a slot of a dead owner, empty or loading, is
+     * taken over, the copy is made again */
+    uint64_t h = bundle::hash(path, strlen(path)) >> 2;
+    pid_t self = getpid();
+    uint32_t i = h & (SHM_CACHE_SLOTS - 1);
+    while(true) {
+        slot &s = _slots[i];
+        uint64_t t = s.tag.load(std::memory_order_acquire);
+        if(t == 0 || t == tag(h, SLOT_LOADING)) {
+            pid_t owner = s.owner.load(std::memory_order_acquire);
+            if(owner != 0 && alive(owner)) {
+                if(t == 0) {
+                    continue; /* claimed, its tag comes next */
+                }
+                /* single flight across workers : the copy in progress is theirs */
+                _header->taken.fetch_sub(1, std::memory_order_relaxed);
+                ::close(fd);
+                return NULL;
+            }
+            if(!s.owner.compare_exchange_strong(owner, self, std::memory_order_acq_rel)) {
+                continue; /* another worker claimed or took it over first */
+            }
+            if(owner != 0) { /* counted in taken by the dead one */
+                _header->taken.fetch_sub(1, std::memory_order_relaxed);
+                _header->orphans.fetch_add(1, std::memory_order_relaxed);
+            }
+            s.tag.store(tag(h, SLOT_LOADING), std::memory_order_release);
+            break;
+        }
+        if(t == tag(h, SLOT_READY) && strcmp(s.path, path) == 0) {
+            _header->taken.fetch_sub(1, std::memory_order_relaxed);
+            ::close(fd);
+            err = 0;
+            return entry_of(i);
+        }
+        i = (i + 1) & (SHM_CACHE_SLOTS - 1);
+    }
+
+    /* copy through the memfd, content mapping stays read-only */
+    slot &s = _slots[i];
+    int64_t off = reserve(st.st_size);
+    if(off < 0) {
+        note_full();
+    }
+    size_t reserved = off >= 0 ? page_align(st.st_size) : 0;
+    char *address = NULL;
+    if(off >= 0 && st.st_size > 0) {
+        address = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(address == MAP_FAILED) {
+            address = NULL;
+            off = -1;
+        }
+    }
+    for(size_t done = 0; address != NULL && done < (size_t)st.st_size; ) {
+        ssize_t n = pwrite(_fd, address + done, st.st_size - done, _index_bytes + off + done);
+        if(n <= 0) {
+            off = -1;
+            break;
+        }
+        done += n;
+    }
+    if(address != NULL) {
+        munmap(address, st.st_size);
+    }
+    /* file changed while it was copied */
+    struct stat now_st;
+    if(off >= 0 && (fstat(fd, &now_st) != 0 || now_st.st_size != st.st_size
+        || now_st.st_mtime != st.st_mtime)) {
+        off = -1;
+    }
+    ::close(fd);
+    if(off < 0) { /* pages reserved are lost, slot never matches */
+        s.tag.store(tag(h, SLOT_DEAD), std::memory_order_release);
+        _header->refused.fetch_add(1, std::memory_order_relaxed);
+        _header->dead.fetch_add(1, std::memory_order_relaxed);
+        _header->lost.fetch_add(reserved, std::memory_order_relaxed);
+        return NULL;
+    }
+    strcpy(s.path, path);
+    s.off = off;
+    s.size = st.st_size;
+    s.ino = st.st_ino;
+    s.mtime = st.st_mtime;
+    s.mode = st.st_mode;
+    s.checked.store(time(NULL), std::memory_order_relaxed);
+    s.tag.store(tag(h, SLOT_READY), std::memory_order_release); /* publish */
+    _header->files.fetch_add(1, std::memory_order_relaxed);
+    _header->misses.fetch_add(1, std::memory_order_relaxed);
+    err = 0;
+    return entry_of(i);
+}
+
+/* entry of this process for ready slot i */
+file_cache::entry *shm_cache::entry_of(uint32_t i) {
+    file_cache::entry *e = _files[i].load(std::memory_order_acquire);
+    if(e != NULL) {
+        return e;
+    }
+    const slot &s = _slots[i];
+    e = new file_cache::entry;
+    e->path = s.path;
+    bzero(&e->st, sizeof(e->st));
+    e->st.st_mode = s.mode;
+    e->st.st_size = s.size;
+    e->st.st_ino = s.ino;
+    e->st.st_mtime = s.mtime;
+    e->address = _content + s.off;
+    e->checked = 0;
+    e->refs = 1;
+    e->cached = false;
+    e->pinned = true; /* pages live as long as segment */
+    e->head = NULL;
+    e->head_len = 0;
+    file_cache::entry *other = NULL;
+    if(!_files[i].compare_exchange_strong(other, e, std::memory_order_acq_rel)) {
+        delete e; /* another thread of this process made it first */
+        return other;
+    }
+    return e;
+}
+
+/* pid is this process or a running worker */
+bool shm_cache::alive(pid_t pid) const {
+    if(pid == getpid()) {
+        return true; /* another thread of ours */
+    }
+    for(int i = 0; i < SHM_WORKERS_MAX; i++) {
+        if(_header->workers[i].pid.load(std::memory_order_relaxed) == pid) {
+            return true; /* master clears it once the worker is reaped */
+        }
+    }
+    return false;
+}
+
+/* no room for a file : logged once, segment only serves what it has */
+void shm_cache::note_full() {
+    int64_t never = 0;
+    if(_header->full.load(std::memory_order_relaxed) != 0
+        || !_header->full.compare_exchange_strong(never, time(NULL), std::memory_order_relaxed)) {
+        return;
+    }
+    printf("shared cache full : %u of %d slots taken, %luMB of %luMB used, %u dead slots "
+        "hold %luMB, new files go to private caches\n", 
+        _header->taken.load(std::memory_order_relaxed), SHM_CACHE_FILL, 
+        (unsigned long)(_header->used.load(std::memory_order_relaxed) >> 20), 
+        (unsigned long)(_capacity >> 20), _header->dead.load(std::memory_order_relaxed), 
+        (unsigned long)(_header->lost.load(std::memory_order_relaxed) >> 20));
+}
+
+/* reserve size bytes of content, -1 if there is no room */
+int64_t shm_cache::reserve(size_t size) {
+    uint64_t used = _header->used.load(std::memory_order_relaxed);
+    do {
+        if(used + page_align(size) > _capacity) {
+            return -1;
+        }
+    } while(!_header->used.compare_exchange_weak(used, used + page_align(size),
+        std::memory_order_relaxed));
+    return used;
+}
+
+}
@@ -0,0 +1,108 @@
+#include "sock_profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace lu {
+
+sock_profile::sock_profile() 
+    : nodelay(false), 
+    corked(false), 
+    sndbuf(0), 
+    rcvbuf(0), 
+    fastopen(0), 
+    busy_poll(0), 
+    incoming_cpu(false), 
+    zerocopy(0) {}
+
+/* parse "nodelay,cork,sndbuf=N,rcvbuf=N,fastopen=N,busy_poll=N,incoming_cpu,zerocopy=N" */
+bool sock_profile::parse(const char *spec) {
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char *save = NULL;
+    for(char *opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        if(val != NULL) {
+            *val++ = '\0';
+        }
+        if(strcmp(opt, "nodelay") == 0) {
+            nodelay = true;
+        } else if(strcmp(opt, "cork") == 0) {
+            corked = true;
+        } else if(strcmp(opt, "incoming_cpu") == 0) {
+            incoming_cpu = true;
+        } else if(val == NULL) {
+            printf("socket option %s needs a value\n", opt);
+            return false;
+        } else if(strcmp(opt, "sndbuf") == 0) {
+            sndbuf = atoi(val);
+        } else if(strcmp(opt, "rcvbuf") == 0) {
+            rcvbuf = atoi(val);
+        } else if(strcmp(opt, "fastopen") == 0) {
+            fastopen = atoi(val);
+        } else if(strcmp(opt, "busy_poll") == 0) {
+            busy_poll = atoi(val);
+        } else if(strcmp(opt, "zerocopy") == 0) {
+            zerocopy = atoi(val);
+        } else {
+            printf("unknow socket option %s\n", opt);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* before listen() : buffer sizes decide the window scale of connections.
+ * zerocopy is turned off if the socket refuses SO_ZEROCOPY */
+void sock_profile::apply_listener(int listenfd) {
+    int on = 1;
+    if(nodelay && setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        perror("TCP_NODELAY");
+    }
+    if(sndbuf > 0 && setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0) {
+        perror("SO_SNDBUF");
+    }
+    if(rcvbuf > 0 && setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0) {
+        perror("SO_RCVBUF");
+    }
+    if(fastopen > 0 && setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) != 0) {
+        perror("TCP_FASTOPEN");
+    }
+    if(busy_poll > 0 && setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0) {
+        perror("SO_BUSY_POLL");
+    }
+    /* accepted connctions inherit it, MSG_ZEROCOPY is ignored without it */
+    if(zerocopy > 0 && setsockopt(listenfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        perror("SO_ZEROCOPY");
+        zerocopy = 0;
+    }
+}
+
+/* accepted connction, return its SO_INCOMING_CPU or -1 */
+int sock_profile::apply_conn(int connfd) const {
+    if(!incoming_cpu) {
+        return -1;
+    }
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if(getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+        return -1;
+    }
+    return cpu;
+}
+
+/* TCP_CORK on/off around writing one response */
+void sock_profile::cork(int connfd, bool on) const {
+    if(!corked) {
+        return;
+    }
+    int val = on ? 1 : 0;
+    setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+}
+
+}
@@ -0,0 +1,79 @@
+#ifdef __TLS
+
+#include "tls.h"
+
+#include <stdio.h>
+#include <exception>
+
+namespace lu {
+
+/* load pem certificate chain & private key, throw if they are not usable */
+tls_context::tls_context(const char *cert, const char *key) : _ctx(NULL) {
+    _ctx = SSL_CTX_new(TLS_server_method());
+    if(_ctx == NULL) {
+        ERR_print_errors_fp(stdout);
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+    if(SSL_CTX_use_certificate_chain_file(_ctx, cert) != 1
+        || SSL_CTX_use_PrivateKey_file(_ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(_ctx) != 1) {
+        printf("tls : bad certificate %s or key %s\n", cert, key);
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(_ctx);
+        throw std::exception();
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    /* records are sealed by kernel once the handshake is done */
+    SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    /* write returns after each record, the write loop resumes from where it stops */
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+        | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_alpn_select_cb(_ctx, select_alpn, NULL);
+}
+
+tls_context::~tls_context() {
+    SSL_CTX_free(_ctx);
+}
+
+/* tls session of an accepted connction, NULL on failure */
+SSL *tls_context::create(int connfd) const {
+    SSL *ssl = SSL_new(_ctx);
+    if(ssl == NULL) {
+        return NULL;
+    }
+    if(SSL_set_fd(ssl, connfd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+/* is record layer of sending in kernel : plain writev on socket is encrypted */
+bool tls_context::ktls_send(SSL *ssl) {
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+    (void)ssl;
+    return false;
+#endif
+}
+
+/* ALPN : h2 if client offers it, else http/1.1 */
+int tls_context::select_alpn(SSL *, const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned int inlen, void *) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char *sel = NULL;
+    if(SSL_select_next_proto(&sel, outlen, protos, sizeof(protos) - 1, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK; /* no ALPN : http/1.1 */
+    }
+    *out = sel;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+}
+
+#endif
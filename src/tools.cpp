@@ -1,5 +1,11 @@
 #include "tools.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
 namespace lu {
 
 /* set signal catch */
@@ -55,4 +61,219 @@ void tools::modifyfd(int epollfd, int fd, int ev) {
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-}
\ No newline at end of file
+/* arm fd like modifyfd, adding it to epoll if it is not there yet */
+void tools::armfd(int epollfd, int fd, int ev) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    if(epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) != 0 && errno == ENOENT) {
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+/* Content-Length value : decimal digits between optional blanks, at most max */
+bool tools::parse_length(const char *value, long max, long &length) {
+    const char *p = value;
+    while(*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if(*p < '0' || *p > '9') {
+        return false;
+    }
+    length = 0;
+    for(; *p >= '0' && *p <= '9'; p++) {
+        if(length > (max - (*p - '0')) / 10) {
+            return false;
+        }
+        length = length * 10 + (*p - '0');
+    }
+    while(*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return *p == '\0' || *p == '\r';
+}
+
+/* quality of one coding after its ';', 1 if there is no q parameter */
+static double coding_quality(const char *p, const char *end) {
+    while(p < end) {
+        while(p < end && (*p == ';' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if(end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            return strtod(p + 2, NULL);
+        }
+        while(p < end && *p != ';') {
+            p++;
+        }
+    }
+    return 1;
+}
+
+/* Accept-Encoding value allows gzip, eg: "gzip, deflate", "*;q=0.5" */
+bool tools::accepts_gzip(const char *value) {
+    int gzip = -1, any = -1; /* -1 : not listed, 0 : refused, 1 : accepted */
+    const char *p = value;
+    while(*p != '\0' && *p != '\r') {
+        const char *end = p + strcspn(p, ",\r");
+        while(*p == ' ' || *p == '\t') {
+            p++;
+        }
+        size_t len = strcspn(p, ";, \t\r");
+        int ok = coding_quality(p + len, end) > 0;
+        if((len == 4 && strncasecmp(p, "gzip", 4) == 0) 
+            || (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            gzip = ok;
+        } else if(len == 1 && *p == '*') {
+            any = ok;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return gzip != -1 ? gzip == 1 : any == 1;
+}
+
+/* parse cpu list like "0-3,8,10-11" into cpus, return cpu count or -1 */
+int tools::parse_cpu_list(const char *list, int *cpus, int max) {
+    int cnt = 0;
+    const char *p = list;
+    while(*p != '\0' && *p != '\n') {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if(*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for(long cpu = first; cpu <= last && cnt < max; cpu++) {
+            cpus[cnt++] = cpu;
+        }
+        if(*p == ',') {
+            p++;
+        } else if(*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return cnt;
+}
+
+/* numa node of cpu, 0 if unknown */
+int tools::cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(dir == NULL) {
+        return 0;
+    }
+    /* the cpu dir contains a "node<N>" link to its node */
+    int node = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "node", 4) == 0) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* cpus belong to numa node, return cpu count or -1 */
+int tools::node_cpus(int node, int *cpus, int max) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        return -1;
+    }
+    char list[256];
+    int cnt = -1;
+    if(fgets(list, sizeof(list), fp) != NULL) {
+        cnt = parse_cpu_list(list, cpus, max);
+    }
+    fclose(fp);
+    return cnt;
+}
+
+/* pin thread to one cpu */
+bool tools::pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+/* prefer allocating pages of [addr, addr + len) from numa node.
+ * pages already touched are moved, the rest follow the policy on first touch */
+bool tools::bind_node(void *addr, size_t len, int node) {
+    const int MPOL_PREFERRED_ = 1;
+    const unsigned MPOL_MF_MOVE_ = 1 << 1;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(page - 1);
+    if(end <= start || node < 0 || node >= 64) {
+        return false;
+    }
+    unsigned long nodemask = 1UL << node;
+    return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED_, 
+        &nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE_) == 0;
+}
+
+/* pass fd to the process on the other end of unix socket (SCM_RIGHTS) */
+bool tools::send_fd(int sock, int fd) {
+    char data = 0; /* at least one byte of real data must be sent */
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    bzero(control, sizeof(control));
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1;
+}
+
+/* receive fd passed by send_fd, -1 on failure */
+int tools::recv_fd(int sock) {
+    char data;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+}
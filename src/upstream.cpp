@@ -0,0 +1,443 @@
+#include "upstream.h"
+#include "tools.h"
+#include "path_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace lu {
+
+upstream_pool::upstream_pool() : _lent(new std::atomic<conn *>[UPSTREAM_FD_MAX]()) {}
+
+upstream_pool::~upstream_pool() {
+    /* client connctions are closed by now, nothing is lent */
+    for(size_t i = 0; i < _routes.size(); i++) {
+        route *r = _routes[i];
+        for(size_t j = 0; j < r->backends.size(); j++) {
+            backend *be = r->backends[j];
+            for(size_t k = 0; k < be->idle.size(); k++) {
+                destroy(be->idle[k]);
+            }
+            if(be->probe_fd >= 0) {
+                close(be->probe_fd);
+            }
+            delete be;
+        }
+        delete r;
+    }
+    delete [] _lent;
+}
+
+/* add route "/prefix=ip:port[,ip:port...]" */
+bool upstream_pool::add_route(const char *spec) {
+    char buf[512];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char *list = strchr(buf, '=');
+    if(buf[0] != '/' || list == NULL) {
+        printf("bad proxy route %s, eg: /api=127.0.0.1:9000,127.0.0.1:9001\n", spec);
+        return false;
+    }
+    *list++ = '\0';
+    /* urls are matched canonical, so is the prefix */
+    char prefix[512];
+    if(!path_cache::canonicalize(buf, strlen(buf), prefix, sizeof(prefix))) {
+        printf("bad proxy route prefix %s\n", buf);
+        return false;
+    }
+    route *r = new route();
+    r->prefix = prefix;
+    r->next = 0;
+    bool bad = false;
+    char *save = NULL;
+    for(char *item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *port = strrchr(item, ':');
+        backend *be = new backend();
+        bzero(&be->addr, sizeof(be->addr));
+        be->addr.sin_family = AF_INET;
+        if(port == NULL || atoi(port + 1) <= 0) {
+            be->addr.sin_port = 0;
+        } else {
+            *port = '\0';
+            be->addr.sin_port = htons(atoi(port + 1));
+        }
+        if(be->addr.sin_port == 0 || inet_pton(AF_INET, item, &be->addr.sin_addr) != 1) {
+            printf("bad backend address %s of proxy route %s\n", item, spec);
+            delete be;
+            bad = true;
+            continue;
+        }
+        snprintf(be->name, sizeof(be->name), "%s:%d", item, ntohs(be->addr.sin_port));
+        be->outstanding = 0;
+        be->fails = 0;
+        be->healthy = true; /* until proven otherwise */
+        be->probe_fd = -1;
+        be->next_check = 0;
+        r->backends.push_back(be);
+    }
+    if(bad || r->backends.size() == 0) {
+        for(size_t i = 0; i < r->backends.size(); i++) {
+            delete r->backends[i];
+        }
+        delete r;
+        return false;
+    }
+    _routes.push_back(r);
+    return true;
+}
+
+/* route of canonical path, NULL if it is not proxied. a prefix ends on a
+ * segment boundary : /api takes /api & /api/x, not /apix */
+upstream_pool::route *upstream_pool::match(const char *path) {
+    for(size_t i = 0; i < _routes.size(); i++) {
+        const std::string &prefix = _routes[i]->prefix;
+        if(strncmp(path, prefix.c_str(), prefix.size()) == 0 && (prefix.back() == '/' 
+            || path[prefix.size()] == '\0' || path[prefix.size()] == '/')) {
+            return _routes[i];
+        }
+    }
+    return NULL;
+}
+
+/* connction to the least outstanding healthy backend of route, idle one
+ * first unless fresh. NULL if no backend can take it */
+upstream_pool::conn *upstream_pool::acquire(route *r, http_conn *owner, bool fresh) {
+    _locker.lock();
+    backend *be = NULL;
+    size_t n = r->backends.size();
+    for(size_t i = 0; i < n; i++) {
+        backend *cur = r->backends[(r->next + i) % n];
+        if(cur->healthy && (be == NULL || cur->outstanding < be->outstanding)) {
+            be = cur;
+        }
+    }
+    if(be == NULL) {
+        _locker.unlock();
+        return NULL;
+    }
+    r->next++;
+    be->outstanding++;
+    conn *c = NULL;
+    while(!fresh && c == NULL && !be->idle.empty()) {
+        c = be->idle.back();
+        be->idle.pop_back();
+        if(!alive(c)) {
+            destroy(c);
+            c = NULL;
+        }
+    }
+    _locker.unlock();
+
+    if(c != NULL) {
+        c->reused = true;
+    } else {
+        int fd = connect_backend(be);
+        if(fd < 0 || fd >= UPSTREAM_FD_MAX) {
+            if(fd >= 0) {
+                close(fd);
+            }
+            _locker.lock();
+            be->outstanding--;
+            if(++be->fails >= UPSTREAM_FAILS_MAX && be->healthy) {
+                be->healthy = false;
+                printf("upstream %s is down\n", be->name);
+            }
+            _locker.unlock();
+            return NULL;
+        }
+        c = new conn();
+        c->fd = fd;
+        c->pipe[0] = c->pipe[1] = -1;
+        c->be = be;
+        c->reused = false;
+    }
+    c->owner = owner;
+    _lent[c->fd].store(c, std::memory_order_release); /* reactor looks it up */
+    return c;
+}
+
+/* exchange on c is over : keep it for next request if reusable, failed
+ * counts against its backend */
+void upstream_pool::release(conn *c, bool reusable, bool failed) {
+    _lent[c->fd].store(NULL, std::memory_order_release);
+    c->owner = NULL;
+    backend *be = c->be;
+    _locker.lock();
+    be->outstanding--;
+    if(!failed) {
+        be->fails = 0;
+    } else if(++be->fails >= UPSTREAM_FAILS_MAX && be->healthy) {
+        be->healthy = false;
+        printf("upstream %s is down\n", be->name);
+    }
+    if(reusable && be->idle.size() < UPSTREAM_IDLE_MAX) {
+        be->idle.push_back(c);
+        c = NULL;
+    }
+    _locker.unlock();
+    if(c != NULL) {
+        destroy(c);
+    }
+}
+
+/* health checks due by now, called on reactor ticks */
+void upstream_pool::check(time_t now) {
+    _locker.lock();
+    for(size_t i = 0; i < _routes.size(); i++) {
+        for(size_t j = 0; j < _routes[i]->backends.size(); j++) {
+            backend *be = _routes[i]->backends[j];
+            if(be->probe_fd >= 0) {
+                /* connect probe in progress : writable once it is decided */
+                struct pollfd pfd = {be->probe_fd, POLLOUT, 0};
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if(poll(&pfd, 1, 0) > 0) {
+                    getsockopt(be->probe_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                } else if(now < be->next_check) {
+                    continue;
+                } else {
+                    err = ETIMEDOUT;
+                }
+                close(be->probe_fd);
+                be->probe_fd = -1;
+                if(err == 0 && !be->healthy) {
+                    printf("upstream %s is back\n", be->name);
+                } else if(err != 0 && be->healthy) {
+                    printf("upstream %s is down : %s\n", be->name, strerror(err));
+                }
+                be->healthy = err == 0;
+                be->fails = err == 0 ? 0 : be->fails;
+            } else if(now >= be->next_check) {
+                be->next_check = now + UPSTREAM_CHECK_INTERVAL;
+                be->probe_fd = connect_backend(be);
+                if(be->probe_fd < 0 && be->healthy) {
+                    be->healthy = false;
+                    printf("upstream %s is down\n", be->name);
+                }
+            }
+        }
+    }
+    _locker.unlock();
+}
+
+/* new nonblocking connction to backend, -1 if connect fails at once */
+int upstream_pool::connect_backend(const backend *be) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(connect(fd, (const struct sockaddr *)&be->addr, sizeof(be->addr)) != 0
+        && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* is idle connction still open, nothing may be readable on it */
+bool upstream_pool::alive(const conn *c) {
+    char b;
+    return recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN;
+}
+
+void upstream_pool::destroy(conn *c) {
+    close(c->fd);
+    if(c->pipe[0] >= 0) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    delete c;
+}
+
+upstream_exchange::upstream_exchange()
+    : up(NULL),
+    req_sent(0),
+    buf_len(0),
+    buf_sent(0),
+    head_done(false),
+    head_sent(0),
+    pipe_bytes(0),
+    body(BODY_EOF),
+    remaining(0),
+    chunk(CHUNK_SIZE),
+    done(false),
+    reusable(false),
+    keep_alive(false),
+    up_failed(false) {}
+
+/* response head in buf : rewrite it into head with our Connection header
+ * & keep body bytes behind it in buf. 1 done, 0 more bytes, -1 bad response */
+int upstream_exchange::take_head(bool keep_alive) {
+    char *end = (char *)memmem(buf, buf_len, "\r\n\r\n", 4);
+    if(end == NULL) {
+        return buf_len >= UPSTREAM_BUFFER_SIZE ? -1 : 0;
+    }
+    int head_len = end + 4 - buf;
+    end[2] = '\0'; /* head is "line\r\n...line\r\n" now */
+    /* status line : HTTP/1.x nnn reason */
+    if(strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') {
+        return -1;
+    }
+    int status = atoi(buf + 9);
+    reusable = buf[7] == '1';
+    body = BODY_EOF;
+    bool length_seen = false;
+    long content_length = 0;
+    if(status / 100 == 1 || status == 204 || status == 304) {
+        body = BODY_NONE;
+    }
+    head.clear();
+    for(char *line = buf; *line != '\0'; ) {
+        char *eol = strstr(line, "\r\n");
+        *eol = '\0';
+        char *next = eol + 2;
+        const char *value = strchr(line, ':');
+        value = value == NULL ? "" : value + 1;
+        if(strncasecmp(line, "Content-Length:", 15) == 0) {
+            /* a bad or disagreeing one leaves the end of body unknown & the
+             * pooled connction out of step */
+            long length = 0;
+            if(!tools::parse_length(value, LONG_MAX, length) 
+                || (length_seen && length != content_length)) {
+                return -1;
+            }
+            length_seen = true;
+            content_length = length;
+            if(body == BODY_EOF) {
+                body = BODY_LENGTH;
+                remaining = length;
+            }
+        } else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            if(body != BODY_NONE && strcasestr(value, "chunked") != NULL) {
+                body = BODY_CHUNKED;
+                remaining = 0;
+            }
+        } else if(strncasecmp(line, "Connection:", 11) == 0) {
+            /* hop-by-hop : ours goes to client */
+            if(strcasestr(value, "close") != NULL) {
+                reusable = false;
+            } else if(strcasestr(value, "keep-alive") != NULL) {
+                reusable = true;
+            }
+            line = next;
+            continue;
+        } else if(strncasecmp(line, "Keep-Alive:", 11) == 0
+            || strncasecmp(line, "Proxy-Connection:", 17) == 0) {
+            line = next;
+            continue;
+        }
+        head.append(line).append("\r\n");
+        line = next;
+    }
+    if(body == BODY_EOF) { /* only closing tells client where body ends */
+        reusable = false;
+        keep_alive = false;
+    }
+    this->keep_alive = keep_alive;
+    head.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+
+    /* body bytes came with head */
+    buf_len -= head_len;
+    memmove(buf, buf + head_len, buf_len);
+    head_done = true;
+    buf_len = scan(buf, buf_len);
+    return 1;
+}
+
+/* body bytes came, return how many belong to this response */
+int upstream_exchange::scan(const char *data, int len) {
+    switch(body) {
+        case BODY_NONE: {
+            done = true;
+            reusable = reusable && len == 0;
+            return 0;
+        }
+        case BODY_LENGTH: {
+            int take = len < remaining ? len : remaining;
+            remaining -= take;
+            done = remaining == 0;
+            reusable = reusable && take == len;
+            return take;
+        }
+        case BODY_EOF: {
+            return len;
+        }
+        default: {
+            break;
+        }
+    }
+    /* chunked : bytes are relayed as they are, only the end is looked for */
+    int i = 0;
+    for(; i < len && !done; i++) {
+        char c = data[i];
+        switch(chunk) {
+            case CHUNK_SIZE: {
+                int v = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f'
+                    ? (c | 0x20) - 'a' + 10 : -1;
+                if(v >= 0 && remaining < (1L << 40)) {
+                    remaining = remaining * 16 + v;
+                    break;
+                }
+                chunk = CHUNK_EXT;
+            }
+            /* fall through */
+            case CHUNK_EXT: {
+                if(c == '\n') {
+                    chunk = remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                break;
+            }
+            case CHUNK_DATA: {
+                long take = len - i < remaining ? len - i : remaining;
+                remaining -= take;
+                i += take - 1;
+                if(remaining == 0) {
+                    chunk = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR: {
+                chunk = CHUNK_DATA_LF;
+                break;
+            }
+            case CHUNK_DATA_LF: {
+                chunk = CHUNK_SIZE;
+                break;
+            }
+            case CHUNK_TRAILER: { /* start of a trailer line, empty one ends body */
+                if(c == '\r') {
+                    chunk = CHUNK_END;
+                } else if(c == '\n') {
+                    done = true;
+                } else {
+                    chunk = CHUNK_TRAILER_LINE;
+                }
+                break;
+            }
+            case CHUNK_TRAILER_LINE: {
+                if(c == '\n') {
+                    chunk = CHUNK_TRAILER;
+                }
+                break;
+            }
+            case CHUNK_END: {
+                done = true;
+                break;
+            }
+        }
+    }
+    reusable = reusable && i == len;
+    return i;
+}
+
+}
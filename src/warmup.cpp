@@ -0,0 +1,212 @@
+#include "warmup.h"
+#include "threadpool.h"
+#include "http_conn.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace lu {
+
+warmup::warmup(file_cache *cache, bundle *assets)
+    : _cache(cache),
+    _assets(assets),
+    _policy(0),
+    _files(0),
+    _failed(0),
+    _unlocked(0),
+    _bytes(0) {}
+
+/* parse "all|<manifest>[,mlock][,hugepage]". all is every file of document
+ * root, manifest lists urls one per line, '#' starts a comment */
+bool warmup::parse(const char *spec) {
+    char buf[512];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char *save = NULL;
+    char *what = strtok_r(buf, ",", &save);
+    for(char *opt = strtok_r(NULL, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        if(strcmp(opt, "mlock") == 0) {
+            _policy |= WARM_MLOCK;
+        } else if(strcmp(opt, "hugepage") == 0) {
+            _policy |= WARM_HUGEPAGE;
+        } else {
+            printf("unknown warm-up option %s\n", opt);
+            return false;
+        }
+    }
+    if(what == NULL) {
+        return false;
+    }
+    if(strcmp(what, "all") == 0) {
+        if(_assets != NULL) {
+            /* whole bundle by ranges, so threads share it */
+            char *data = (char *)_assets->data();
+            for(size_t off = 0; off < _assets->size(); off += WARM_RANGE_BYTES) {
+                task t = {this, "", data + off, 0};
+                t.len = _assets->size() - off < WARM_RANGE_BYTES ? _assets->size() - off : WARM_RANGE_BYTES;
+                _tasks.push_back(t);
+            }
+        } else {
+            add_tree(http_conn::DOC_ROOT);
+        }
+        return true;
+    }
+    FILE *fp = fopen(what, "r");
+    if(fp == NULL) {
+        perror(what);
+        return false;
+    }
+    char line[http_conn::FILENAME_LEN];
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *url = line + strspn(line, " \t");
+        url[strcspn(url, " \t")] = '\0';
+        if(*url == '/') {
+            add_url(url);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+/* hot url of manifest */
+void warmup::add_url(const char *url) {
+    if(_assets != NULL) {
+        for(int gz = 0; gz < 2; gz++) {
+            file_cache::entry *e = _assets->find(url, gz);
+            if(e != NULL && (gz == 0 || e != _assets->find(url, false))) {
+                task t = {this, "", e->address, (size_t)e->st.st_size};
+                _tasks.push_back(t);
+            }
+        }
+        return;
+    }
+    char path[http_conn::FILENAME_LEN];
+    if(snprintf(path, sizeof(path), "%s%s", http_conn::DOC_ROOT, url) < (int)sizeof(path)) {
+        task t = {this, path, NULL, 0};
+        _tasks.push_back(t);
+    }
+}
+
+/* every file under dir */
+void warmup::add_tree(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if(d == NULL) {
+        perror(dir.c_str());
+        return;
+    }
+    for(struct dirent *de = readdir(d); de != NULL; de = readdir(d)) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        std::string path = dir + "/" + de->d_name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            add_tree(path);
+        } else if(S_ISREG(st.st_mode)) {
+            task t = {this, path, NULL, 0};
+            _tasks.push_back(t);
+        }
+    }
+    closedir(d);
+}
+
+/* warm hot set with threads, return when it is done */
+void warmup::run(int thread_number, const int *cpus, int cpu_number) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    try {
+        threadpool<task> pool(thread_number, _tasks.size() + 1, cpus, cpu_number);
+        for(size_t i = 0; i < _tasks.size(); i++) {
+            pool.append(&_tasks[i]);
+        }
+        pool.stop(); /* queued tasks are finished before threads exit */
+    } catch(const std::exception& e) {
+        for(size_t i = 0; i < _tasks.size(); i++) {
+            _tasks[i].process();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
+    printf("warm-up : %d %s, %zu KB in %ld ms", _files, _assets != NULL ? "ranges" : "files", 
+        _bytes >> 10, ms);
+    if(_failed > 0) {
+        printf(", %d failed", _failed);
+    }
+    if(_unlocked > 0) {
+        printf(", %d not locked (RLIMIT_MEMLOCK?)", _unlocked);
+    }
+    if(_assets == NULL && _cache->bytes() < _bytes) {
+        printf(", %zu KB kept by file cache (-m)", _cache->bytes() >> 10);
+    }
+    printf("\n");
+    _tasks.clear();
+}
+
+/* one task done */
+void warmup::done(size_t bytes, bool ok, bool locked) {
+    _locker.lock();
+    if(ok) {
+        _files++;
+        _bytes += bytes;
+    } else {
+        _failed++;
+    }
+    if(!locked) {
+        _unlocked++;
+    }
+    _locker.unlock();
+}
+
+/* map file into cache or fault bundle range in */
+void warmup::task::process() {
+    if(path.empty()) {
+        owner->done(len, true, touch(addr, len, owner->_policy));
+        return;
+    }
+    int err = 0;
+    file_cache::entry *e = owner->_cache->acquire(path.c_str(), err);
+    if(e == NULL) {
+        owner->done(0, false, true);
+        return;
+    }
+    /* file too big for cache is not kept mapped, its page cache still is warm */
+    bool locked = touch(e->address, e->st.st_size, owner->_policy);
+    owner->done(e->st.st_size, true, locked);
+    owner->_cache->release(e);
+}
+
+/* advise & fault in pages of [addr, addr + len), false if mlock failed */
+bool warmup::touch(char *addr, size_t len, int policy) {
+    if(addr == NULL || len == 0) {
+        return true;
+    }
+    static const long page = sysconf(_SC_PAGESIZE);
+    char *start = (char *)((unsigned long)addr & ~(page - 1));
+    size_t span = addr + len - start;
+    madvise(start, span, MADV_WILLNEED); /* readahead whole range at once */
+    if(policy & WARM_HUGEPAGE) {
+        /* file mappings only get huge pages with CONFIG_READ_ONLY_THP_FOR_FS */
+        madvise(start, span, MADV_HUGEPAGE);
+    }
+    if((policy & WARM_MLOCK) && mlock(start, span) == 0) {
+        return true; /* locked pages are faulted in */
+    }
+    /* fault pages in, so first requests find page tables filled */
+    char sum = 0;
+    for(char *p = addr; p < addr + len; p += page) {
+        sum += *(volatile char *)p;
+    }
+    (void)sum;
+    return !(policy & WARM_MLOCK);
+}
+
+}
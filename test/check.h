@@ -0,0 +1,22 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* behavior checks, one program per module : make check.
+ * a failed CHECK is printed & counted, the program exits with the count */
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while(0)
+
+#define CHECK_DONE() do { \
+    printf("%s: %s\n", __FILE__, check_failures == 0 ? "ok" : "FAILED"); \
+    return check_failures == 0 ? 0 : 1; \
+} while(0)
+
+#endif
@@ -0,0 +1,73 @@
+#include <arpa/inet.h>
+
+#include "check.h"
+#include "conn_limiter.h"
+
+using namespace lu;
+
+/* network order address of a.b.c.d */
+static uint32_t addr(int a, int b, int c, int d) {
+    return htonl((uint32_t)a << 24 | b << 16 | c << 8 | d);
+}
+
+/* limit per ip, counts & release */
+static void check_counts() {
+    conn_limiter limiter(16, 2);
+    uint32_t ip = addr(192, 168, 1, 1);
+    CHECK(limiter.acquire(ip) && limiter.acquire(ip));
+    CHECK(!limiter.acquire(ip)); /* at limit */
+    CHECK(limiter.count(ip) == 2);
+    limiter.release(ip);
+    CHECK(limiter.count(ip) == 1 && limiter.acquire(ip));
+    limiter.release(ip);
+    limiter.release(ip);
+    CHECK(limiter.count(ip) == 0);
+    limiter.release(ip); /* not counted, ignored */
+    CHECK(limiter.count(ip) == 0);
+}
+
+/* clients of one /16 spread over the table, probes stay short */
+static void check_subnet() {
+    conn_limiter limiter(65536 * 2, 4);
+    bool all = true;
+    for(int c = 0; c < 256; c++) {
+        for(int d = 0; d < 256; d++) {
+            all = limiter.acquire(addr(10, 0, c, d)) && all;
+        }
+    }
+    CHECK(all);
+    uint32_t longest = limiter.max_probe();
+    if(longest >= 64) {
+        printf("  10.0.0.0/16 : longest probe %u\n", longest);
+    }
+    CHECK(longest < 64);
+    /* backward shift deletion keeps every other ip findable */
+    for(int c = 0; c < 256; c += 2) {
+        for(int d = 0; d < 256; d++) {
+            limiter.release(addr(10, 0, c, d));
+        }
+    }
+    bool found = true;
+    for(int c = 0; c < 256; c++) {
+        for(int d = 0; d < 256; d++) {
+            found = limiter.count(addr(10, 0, c, d)) == (c % 2) && found;
+        }
+    }
+    CHECK(found);
+}
+
+/* one slot stays empty, a full table refuses new ips */
+static void check_full() {
+    conn_limiter limiter(4, 1);
+    CHECK(limiter.acquire(addr(1, 1, 1, 1)) && limiter.acquire(addr(2, 2, 2, 2)));
+    CHECK(limiter.acquire(addr(3, 3, 3, 3)));
+    CHECK(!limiter.acquire(addr(4, 4, 4, 4)));
+    CHECK(limiter.count(addr(4, 4, 4, 4)) == 0);
+}
+
+int main() {
+    check_counts();
+    check_subnet();
+    check_full();
+    CHECK_DONE();
+}
@@ -0,0 +1,140 @@
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "header_index.h"
+
+using namespace lu;
+
+/* header lines laid out like the read buffer : each ends in "\0\0" where
+ * parse_line cut its CRLF, fields are added the way parse_headers does */
+struct request {
+    std::vector<char> buf;
+    header_index headers;
+
+    request(const std::vector<const char *> &lines) {
+        buf.reserve(4096); /* headers keep pointers into it */
+        std::vector<int> begins;
+        for(const char *line : lines) {
+            begins.push_back(buf.size());
+            buf.insert(buf.end(), line, line + strlen(line));
+            buf.push_back('\0');
+            buf.push_back('\0');
+        }
+        headers.clear(buf.data());
+        ok = true;
+        for(size_t i = 0; i < lines.size() && ok; i++) {
+            int begin = begins[i];
+            const char *colon = strchr(&buf[begin], ':');
+            if(colon == NULL) {
+                ok = false;
+                break;
+            }
+            std::string_view name(&buf[begin], colon - &buf[begin]);
+            ok = headers.add(begin, colon - buf.data(), begin + strlen(lines[i]),
+                header_index::hash(name));
+        }
+    }
+    bool ok; /* every line was added */
+};
+
+/* name => well-known field it is, HEADER_OTHER for the rest */
+static const struct {
+    const char *name;
+    header_index::KNOWN known;
+} names[] = {
+    { "Content-Length", header_index::HEADER_CONTENT_LENGTH },
+    { "content-length", header_index::HEADER_CONTENT_LENGTH },
+    { "CONTENT-LENGTH", header_index::HEADER_CONTENT_LENGTH },
+    { "Transfer-Encoding", header_index::HEADER_TRANSFER_ENCODING },
+    { "tRANSFER-eNCODING", header_index::HEADER_TRANSFER_ENCODING },
+    { "Host", header_index::HEADER_HOST },
+    { "Connection", header_index::HEADER_CONNECTION },
+    { "Expect", header_index::HEADER_EXPECT },
+    { "Content-Lengthx", header_index::HEADER_OTHER },
+    { "Content-Lengt", header_index::HEADER_OTHER },
+    { "Content_Length", header_index::HEADER_OTHER },
+    { "X-Content-Length", header_index::HEADER_OTHER },
+    { "Hos", header_index::HEADER_OTHER },
+};
+
+static void check_lookup() {
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char *name = names[i].name;
+        header_index::KNOWN k = header_index::lookup(name, strlen(name), header_index::hash(name));
+        if(k != names[i].known) {
+            printf("  %s => %d, expected %d\n", name, k, names[i].known);
+        }
+        CHECK(k == names[i].known);
+    }
+    /* hash folded a byte at a time is hash of the lower case name */
+    uint32_t h = header_index::HASH_SEED;
+    for(const char *c = "HoSt"; *c; c++) {
+        h = header_index::hash_byte(h, *c);
+    }
+    CHECK(h == header_index::hash("host"));
+}
+
+static void check_fields() {
+    request r({ "Host: example.com", "content-length:\t 12 \t", "X-Empty:", "X-Custom:  a b  ",
+        "Cookie: a=1", "cookie: b=2" });
+    CHECK(r.ok);
+    CHECK(r.headers.size() == 6);
+    /* values trimmed & '\0' terminated in place */
+    CHECK(r.headers.get(header_index::HEADER_HOST) == "example.com");
+    std::string_view length = r.headers.get(header_index::HEADER_CONTENT_LENGTH);
+    CHECK(length == "12" && length.data()[length.size()] == '\0');
+    CHECK(r.headers.get("x-empty") == "" && r.headers.get("x-empty").data() != NULL);
+    CHECK(r.headers.get("X-CUSTOM") == "a b");
+    CHECK(r.headers.name(3) == "X-Custom" && r.headers.known(3) == header_index::HEADER_OTHER);
+    /* repeated : first one */
+    CHECK(r.headers.get(header_index::HEADER_COOKIE) == "a=1");
+    CHECK(r.headers.get("COOKIE") == "a=1");
+    CHECK(r.headers.known(5) == header_index::HEADER_COOKIE);
+    /* absent */
+    CHECK(!r.headers.has(header_index::HEADER_TRANSFER_ENCODING));
+    CHECK(r.headers.get(header_index::HEADER_TRANSFER_ENCODING).data() == NULL);
+    CHECK(r.headers.get("x-missing").data() == NULL);
+    /* clear forgets all */
+    r.headers.clear(r.buf.data());
+    CHECK(r.headers.size() == 0 && !r.headers.has(header_index::HEADER_HOST));
+}
+
+/* names a proxy could disagree on with its backend are refused */
+static void check_bad_names() {
+    CHECK(!request({ "Content-Length : 5" }).ok);
+    CHECK(!request({ "Content-Length\t: 5" }).ok);
+    CHECK(!request({ " Transfer-Encoding: chunked" }).ok);
+    CHECK(!request({ ": value" }).ok);
+    CHECK(!request({ "Bad\x01Name: value" }).ok);
+    CHECK(!request({ "Host: a", "Bad Name: b" }).ok);
+    CHECK(request({ "X-Fine!#$%&'*+.^_`|~: 1" }).ok);
+}
+
+/* more than HEADER_INDEX_MAX fields is refused, full() tells it from a bad field */
+static void check_full() {
+    std::vector<std::string> lines;
+    std::vector<const char *> ptrs;
+    for(int i = 0; i < HEADER_INDEX_MAX + 1; i++) {
+        lines.push_back("X-" + std::to_string(i) + ": v");
+    }
+    for(size_t i = 0; i < lines.size(); i++) {
+        ptrs.push_back(lines[i].c_str());
+    }
+    request full(std::vector<const char *>(ptrs.begin(), ptrs.end() - 1));
+    CHECK(full.ok && full.headers.size() == HEADER_INDEX_MAX && full.headers.full());
+    request over(ptrs);
+    CHECK(!over.ok && over.headers.size() == HEADER_INDEX_MAX);
+    /* a bad name is refused with room left, that is not a full table */
+    request bad({ "Host: a", "Bad Name: b" });
+    CHECK(!bad.ok && !bad.headers.full());
+}
+
+int main() {
+    check_lookup();
+    check_fields();
+    check_bad_names();
+    check_full();
+    CHECK_DONE();
+}
@@ -0,0 +1,181 @@
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "hpack.h"
+
+using namespace lu;
+
+/* bytes of hex string, blanks ignored */
+static std::vector<uint8_t> bytes(const char *hex) {
+    std::vector<uint8_t> out;
+    int hi = -1;
+    for(const char *c = hex; *c; c++) {
+        if(*c == ' ') {
+            continue;
+        }
+        int v = *c <= '9' ? *c - '0' : *c - 'a' + 10;
+        if(hi < 0) {
+            hi = v;
+        } else {
+            out.push_back((uint8_t)(hi << 4 | v));
+            hi = -1;
+        }
+    }
+    return out;
+}
+
+/* decode hex block, true if it decodes to exactly the name/value pairs */
+static bool decodes(hpack::decoder &d, const char *hex, const char *const *expected, size_t n) {
+    std::vector<uint8_t> block = bytes(hex);
+    std::vector<hpack::header> headers;
+    if(!d.decode(block.data(), block.size(), headers) || headers.size() != n) {
+        return false;
+    }
+    for(size_t i = 0; i < n; i++) {
+        if(headers[i].name != expected[2 * i] || headers[i].value != expected[2 * i + 1]) {
+            printf("  %s: %s, expected %s: %s\n", headers[i].name.c_str(), headers[i].value.c_str(),
+                expected[2 * i], expected[2 * i + 1]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fails(hpack::decoder &d, const char *hex) {
+    std::vector<uint8_t> block = bytes(hex);
+    std::vector<hpack::header> headers;
+    return !d.decode(block.data(), block.size(), headers);
+}
+
+static const char *const REQUEST_1[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com" };
+static const char *const REQUEST_2[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+    "cache-control", "no-cache" };
+static const char *const REQUEST_3[] = {
+    ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com",
+    "custom-key", "custom-value" };
+
+/* RFC 7541 appendix C.3 & C.4 : requests sharing one dynamic table */
+static void check_rfc_requests() {
+    hpack::decoder raw;
+    CHECK(decodes(raw, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", REQUEST_1, 4));
+    CHECK(decodes(raw, "8286 84be 5808 6e6f 2d63 6163 6865", REQUEST_2, 5));
+    CHECK(decodes(raw, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+        REQUEST_3, 5));
+
+    hpack::decoder huffman;
+    CHECK(decodes(huffman, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", REQUEST_1, 4));
+    CHECK(decodes(huffman, "8286 84be 5886 a8eb 1064 9cbf", REQUEST_2, 5));
+    CHECK(decodes(huffman, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+        REQUEST_3, 5));
+}
+
+static const char *const RESPONSE_1[] = {
+    ":status", "302", "cache-control", "private", "date", "Mon, 21 Oct 2013 20:13:21 GMT",
+    "location", "https://www.example.com" };
+static const char *const RESPONSE_2[] = {
+    ":status", "307", "cache-control", "private", "date", "Mon, 21 Oct 2013 20:13:21 GMT",
+    "location", "https://www.example.com" };
+static const char *const STATUS_307[] = { ":status", "307" };
+
+/* RFC 7541 appendix C.5 : 256 byte table, second response evicts :status 302 */
+static void check_rfc_eviction() {
+    hpack::decoder d(256);
+    CHECK(decodes(d, "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230"
+        " 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70"
+        " 6c65 2e63 6f6d", RESPONSE_1, 4));
+    CHECK(decodes(d, "4803 3330 37c1 c0bf", RESPONSE_2, 4));
+    CHECK(decodes(d, "be", STATUS_307, 1));
+    CHECK(fails(d, "c2")); /* evicted, past end of table */
+}
+
+/* malformed blocks are compression errors */
+static void check_malformed() {
+    hpack::decoder d;
+    CHECK(fails(d, "80")); /* index 0 */
+    CHECK(fails(d, "be")); /* past empty dynamic table */
+    CHECK(fails(d, "7e 01 78")); /* literal with name index past table */
+    CHECK(fails(d, "ff")); /* integer cut short */
+    CHECK(fails(d, "ff ff ff ff ff ff ff ff ff ff ff 01")); /* integer overflow */
+    CHECK(fails(d, "40 05 6162")); /* string longer than block */
+    CHECK(fails(d, "00 85 1f")); /* huffman string longer than block */
+    CHECK(fails(d, "00 81 1f 82 1fff")); /* huffman padding of 8 bits or more */
+    CHECK(fails(d, "00 81 1f 81 18")); /* huffman padding not all ones */
+    CHECK(fails(d, "00 84 ffff ffff")); /* EOS symbol in string */
+    CHECK(fails(d, "82 20")); /* size update after a field */
+    CHECK(fails(d, "3f e2 1f")); /* size update to 4097, above our setting */
+
+    hpack::decoder ok;
+    static const char *const A[] = { "a", "a" };
+    CHECK(decodes(ok, "00 81 1f 81 1f", A, 1)); /* huffman "a" with 3 bits of padding */
+    CHECK(decodes(ok, "3f e1 1f 20 00 81 1f 81 1f", A, 1)); /* size updates at block start */
+}
+
+/* entry bigger than the table empties it (4.4) */
+static void check_oversized_entry() {
+    hpack::decoder d(64);
+    static const char *const SHORT[] = { "a", "b" };
+    CHECK(decodes(d, "40 0161 0162", SHORT, 1));
+    CHECK(decodes(d, "be", SHORT, 1));
+    std::string block = "\x40\x01" "a" "\x20";
+    block.append(32, 'x');
+    std::vector<hpack::header> headers;
+    CHECK(d.decode((const uint8_t *)block.data(), block.size(), headers) && headers.size() == 1);
+    CHECK(fails(d, "be"));
+}
+
+/* a block of 1 byte references to a big table entry stands for a huge list :
+ * it fails once the list is over SETTINGS_MAX_HEADER_LIST_SIZE */
+static void check_list_size() {
+    std::string entry = "\x40"; /* a: 4000 bytes, indexed, list size 4033 */
+    hpack::encode_int(1, 7, 0, entry);
+    entry += "a";
+    hpack::encode_int(4000, 7, 0, entry);
+    entry.append(4000, 'v');
+    std::vector<hpack::header> headers;
+
+    hpack::decoder fits;
+    std::string block = entry + std::string(3, '\xbe'); /* 4 fields, 16132 bytes */
+    CHECK(fits.decode((const uint8_t *)block.data(), block.size(), headers) && headers.size() == 4);
+
+    hpack::decoder over;
+    block = entry + std::string(4, '\xbe'); /* 5 fields, 20165 bytes */
+    headers.clear();
+    CHECK(!over.decode((const uint8_t *)block.data(), block.size(), headers));
+    CHECK(headers.size() < 5);
+
+    hpack::decoder flood;
+    block = entry + std::string(60000, '\xbe'); /* 240MB of copies if unbounded */
+    headers.clear();
+    CHECK(!flood.decode((const uint8_t *)block.data(), block.size(), headers));
+    CHECK(headers.size() < 5);
+}
+
+/* our encoder's blocks decode to what was encoded */
+static void check_round_trip() {
+    std::vector<hpack::header> in = {
+        { ":status", "200" }, { ":status", "404" }, { "content-type", "text/html" },
+        { "content-length", "123456" }, { "x-long", std::string(300, 'v') }, { "", "" } };
+    std::string block;
+    hpack::encoder::encode(in, block);
+    hpack::decoder d;
+    std::vector<hpack::header> out;
+    CHECK(d.decode((const uint8_t *)block.data(), block.size(), out));
+    CHECK(out.size() == in.size());
+    for(size_t i = 0; i < in.size() && i < out.size(); i++) {
+        CHECK(out[i].name == in[i].name && out[i].value == in[i].value);
+    }
+}
+
+int main() {
+    check_rfc_requests();
+    check_rfc_eviction();
+    check_malformed();
+    check_oversized_entry();
+    check_list_size();
+    check_round_trip();
+    CHECK_DONE();
+}
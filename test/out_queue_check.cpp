@@ -0,0 +1,157 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+
+#include "check.h"
+#include "out_queue.h"
+
+using namespace lu;
+
+/* queued bytes as fill() hands them to writev */
+static std::string queued(const out_queue &q) {
+    struct iovec iov[OUT_QUEUE_IOV_MAX];
+    int cnt = q.fill(iov, OUT_QUEUE_IOV_MAX);
+    std::string s;
+    for(int i = 0; i < cnt; i++) {
+        s.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    return s;
+}
+
+static int segments(const out_queue &q) {
+    struct iovec iov[OUT_QUEUE_IOV_MAX];
+    return q.fill(iov, OUT_QUEUE_IOV_MAX);
+}
+
+/* partial sends across segment boundaries */
+static void check_consume() {
+    out_queue q;
+    static const char head[] = "abc";
+    static const char tail[] = "ij";
+    q.push(head, 3);
+    q.push_copy("defgh", 5);
+    q.push(tail, 2);
+    CHECK(q.bytes() == 10 && segments(q) == 3);
+    q.consume(2); /* inside first */
+    CHECK(q.bytes() == 8 && queued(q) == "cdefghij" && segments(q) == 3);
+    q.consume(1); /* exactly first */
+    CHECK(q.bytes() == 7 && queued(q) == "defghij" && segments(q) == 2);
+    q.consume(6); /* over a boundary into last */
+    CHECK(q.bytes() == 1 && queued(q) == "j" && q.front().data == tail + 1);
+    q.consume(1);
+    CHECK(q.empty() && q.bytes() == 0);
+    /* reused after it emptied */
+    q.push(head, 3);
+    q.consume(3);
+    CHECK(q.empty() && q.bytes() == 0);
+}
+
+/* copies pack into chunks, a segment grows in place while its chunk has room */
+static void check_copies() {
+    out_queue q;
+    q.push_copy("ab", 2);
+    q.push_copy("cd", 2);
+    CHECK(segments(q) == 1 && queued(q) == "abcd");
+    q.consume(1);
+    q.push_copy("e", 1); /* partial send does not stop growth */
+    CHECK(segments(q) == 1 && queued(q) == "bcde");
+    static const char x[] = "X";
+    q.push(x, 1);
+    q.push_copy("f", 1); /* after other bytes : a new segment, same chunk */
+    CHECK(segments(q) == 3 && queued(q) == "bcdeXf");
+    q.clear();
+    CHECK(q.empty() && q.bytes() == 0);
+
+    /* over a chunk : the rest goes to a new one */
+    std::string big(OUT_CHUNK_SIZE + 100, 'z');
+    for(size_t i = 0; i < big.size(); i++) {
+        big[i] = 'a' + i % 26;
+    }
+    q.push_copy("0", 1);
+    q.push_copy(big.data(), big.size());
+    CHECK(segments(q) == 2 && q.bytes() == big.size() + 1);
+    CHECK(queued(q) == "0" + big);
+    q.consume(OUT_CHUNK_SIZE - 1);
+    CHECK(queued(q) == big.substr(OUT_CHUNK_SIZE - 2));
+    q.consume(q.bytes());
+    CHECK(q.empty());
+}
+
+/* file slices : kept referenced until sent, or until their zerocopy sends complete */
+static void check_zerocopy() {
+    char path[] = "/tmp/out_queue_check.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    std::string content(100 * 1024, 'f');
+    CHECK(write(fd, content.data(), content.size()) == (ssize_t)content.size());
+    fchmod(fd, 0644);
+    close(fd);
+
+    file_cache cache;
+    int err = 0;
+    file_cache::entry *e = cache.acquire(path, err);
+    CHECK(e != NULL);
+    if(e == NULL) {
+        unlink(path);
+        return;
+    }
+    int refs = e->refs; /* ours & the cache's */
+
+    {
+        out_queue q;
+        static const char head[] = "head";
+        q.push(head, 4);
+        q.push_file(&cache, e, 0, content.size());
+        CHECK(e->refs == refs + 1);
+        struct iovec iov[OUT_QUEUE_IOV_MAX];
+        bool zc = true;
+        /* head goes alone by writev, the big slice alone by zerocopy */
+        CHECK(q.fill(iov, OUT_QUEUE_IOV_MAX, 64 * 1024, &zc) == 1 && !zc && iov[0].iov_len == 4);
+        q.consume(4);
+        CHECK(q.fill(iov, OUT_QUEUE_IOV_MAX, 64 * 1024, &zc) == 1 && zc);
+        CHECK(iov[0].iov_base == e->address && iov[0].iov_len == content.size());
+        /* partial zerocopy sends 7 & 8 : the slice is held by the last one */
+        q.consume(30000, 7);
+        CHECK(q.front().zc == 7 && q.front().data == e->address + 30000);
+        q.consume(content.size() - 30000, 8);
+        CHECK(q.empty() && e->refs == refs + 1);
+        q.complete(0, 7);
+        CHECK(e->refs == refs + 1);
+        q.complete(8, 8);
+        CHECK(e->refs == refs);
+
+        /* ids wrap around */
+        q.push_file(&cache, e, 0, 10);
+        q.consume(10, 0xffffffffL);
+        CHECK(e->refs == refs + 1);
+        q.complete(0xfffffffe, 1);
+        CHECK(e->refs == refs);
+
+        /* clear keeps held slices, release_held drops them */
+        q.push_file(&cache, e, 0, 10);
+        q.push_file(&cache, e, 10, 10);
+        q.consume(5, 9);
+        q.clear();
+        CHECK(q.empty() && e->refs == refs + 1);
+        q.release_held();
+        CHECK(e->refs == refs);
+
+        /* slices sent without zerocopy are released right away */
+        q.push_file(&cache, e, 0, 10);
+        q.consume(10);
+        CHECK(e->refs == refs);
+        q.push_file(&cache, e, 0, 10);
+    } /* destructor releases queued slices */
+    CHECK(e->refs == refs);
+    cache.release(e);
+    unlink(path);
+}
+
+int main() {
+    check_consume();
+    check_copies();
+    check_zerocopy();
+    CHECK_DONE();
+}
@@ -0,0 +1,100 @@
+#include <string.h>
+#include <errno.h>
+
+#include "check.h"
+#include "path_cache.h"
+
+using namespace lu;
+
+/* url => canonical path, NULL if it must be refused */
+static const struct {
+    const char *url;
+    const char *path;
+} cases[] = {
+    { "/", "/" },
+    { "/index.html", "/index.html" },
+    { "/a//b", "/a/b" },
+    { "/a/./b", "/a/b" },
+    { "/a/b/../c", "/a/c" },
+    { "/a/..", "/" },
+    { "/..", "/" },
+    { "/../../etc/passwd", "/etc/passwd" }, /* clamped at root */
+    { "/a/../../../b", "/b" },
+    { "/%2e%2e/%2e%2e/etc/passwd", "/etc/passwd" }, /* decoded before dot segments */
+    { "/%2E%2E/x", "/x" },
+    { "/a/.%2e/b", "/b" },
+    { "/a/%2e/b", "/a/b" },
+    { "/%41%62c", "/Abc" },
+    { "/a%20b", "/a b" },
+    { "/a%2Fb", NULL }, /* encoded '/' */
+    { "/a%2f..%2f..%2fetc", NULL },
+    { "/a%00b", NULL }, /* encoded NUL */
+    { "/a%", NULL }, /* escape cut at end of url */
+    { "/a%4", NULL },
+    { "/a%zz", NULL },
+    { "/a%4g", NULL },
+    { "relative", NULL },
+    { "", NULL },
+};
+
+static void check_canonicalize() {
+    char out[64];
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bool ok = path_cache::canonicalize(cases[i].url, strlen(cases[i].url), out, sizeof(out));
+        if(cases[i].path == NULL) {
+            if(ok) {
+                printf("  %s => %s, expected refusal\n", cases[i].url, out);
+            }
+            CHECK(!ok);
+        } else {
+            if(!ok || strcmp(out, cases[i].path) != 0) {
+                printf("  %s => %s, expected %s\n", cases[i].url, ok ? out : "(refused)", cases[i].path);
+            }
+            CHECK(ok && strcmp(out, cases[i].path) == 0);
+        }
+    }
+    /* output never overflows, too long is refused */
+    char small[6];
+    CHECK(path_cache::canonicalize("/abcd", 5, small, sizeof(small)));
+    CHECK(!path_cache::canonicalize("/abcde", 6, small, sizeof(small)));
+    CHECK(!path_cache::canonicalize("/ab/cd", 6, small, 4));
+    CHECK(!path_cache::canonicalize("/", 1, small, 1));
+    /* only url_len bytes are read, an escape cut by it is malformed */
+    CHECK(!path_cache::canonicalize("/a%2e", 4, out, sizeof(out)));
+    CHECK(path_cache::canonicalize("/ab/../c", 3, out, sizeof(out)) && strcmp(out, "/ab") == 0);
+}
+
+static void check_resolve() {
+    path_cache cache(4);
+    char path[64];
+    /* query & fragment are not part of the path */
+    CHECK(cache.resolve("/index.html?x=/../../etc", path, sizeof(path)) == path_cache::PATH_OK);
+    CHECK(strcmp(path, "/index.html") == 0);
+    CHECK(cache.resolve("/a/../index.html#../x", path, sizeof(path)) == path_cache::PATH_OK);
+    CHECK(strcmp(path, "/index.html") == 0);
+    /* cached results are the same */
+    CHECK(cache.resolve("/%2e%2e/etc/passwd", path, sizeof(path)) == path_cache::PATH_OK);
+    CHECK(strcmp(path, "/etc/passwd") == 0);
+    CHECK(cache.resolve("/%2e%2e/etc/passwd", path, sizeof(path)) == path_cache::PATH_OK);
+    CHECK(strcmp(path, "/etc/passwd") == 0);
+    CHECK(cache.resolve("/a%2Fb", path, sizeof(path)) == path_cache::PATH_BAD);
+    CHECK(cache.resolve("/a%2Fb", path, sizeof(path)) == path_cache::PATH_BAD);
+    /* a cached path that does not fit the caller's buffer is refused */
+    CHECK(cache.resolve("/%2e%2e/etc/passwd", path, 8) == path_cache::PATH_BAD);
+    /* negative results */
+    cache.fail("/missing", ENOENT);
+    CHECK(cache.resolve("/missing?q", path, sizeof(path)) == path_cache::PATH_MISSING);
+    cache.fail("/secret", EACCES);
+    CHECK(cache.resolve("/secret", path, sizeof(path)) == path_cache::PATH_FORBIDDEN);
+    /* transient errors are not remembered */
+    cache.fail("/busy", EMFILE);
+    CHECK(cache.resolve("/busy", path, sizeof(path)) == path_cache::PATH_OK);
+    cache.fail("/busy", EIO);
+    CHECK(cache.resolve("/busy", path, sizeof(path)) == path_cache::PATH_OK);
+}
+
+int main() {
+    check_canonicalize();
+    check_resolve();
+    CHECK_DONE();
+}
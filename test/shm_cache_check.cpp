@@ -0,0 +1,104 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "check.h"
+#include "shm_cache.h"
+
+using namespace lu;
+
+#define BIG_FILE (128L << 20) /* copied long enough to be killed in the middle */
+
+static std::string temp_file(size_t size) {
+    char path[] = "/tmp/shm_cache_check.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(ftruncate(fd, size) == 0);
+    CHECK(write(fd, "x", 1) == 1);
+    fchmod(fd, 0644);
+    close(fd);
+    return path;
+}
+
+/* files copied once, found by path, refused when too big */
+static void check_store(shm_cache &shm) {
+    std::string small = temp_file(10000);
+    int err = -1;
+    file_cache::entry *e = shm.store(small.c_str(), err);
+    CHECK(e != NULL && err == 0 && e->st.st_size == 10000 && e->address[0] == 'x');
+    CHECK(shm.find(small.c_str(), true) == e);
+    CHECK(shm.store(small.c_str(), err) == e && err == 0); /* not copied again */
+    CHECK(shm.stats()->misses.load() == 1 && shm.stats()->files.load() == 1);
+    CHECK(shm.find("/tmp/shm_cache_check.none", true) == NULL);
+    CHECK(shm.store("/tmp/shm_cache_check.none", err) == NULL && err == ENOENT);
+    CHECK(shm.store("/tmp", err) == NULL && err == EISDIR);
+    unlink(small.c_str());
+}
+
+/* a worker killed while copying leaves its slot loading : the next store
+ * of the path takes it over instead of leaving the path out for good */
+static void check_dead_loader(shm_cache &shm) {
+    std::string big = temp_file(BIG_FILE);
+    uint64_t used = shm.stats()->used.load();
+    pid_t pid = fork();
+    if(pid == 0) {
+        int err;
+        shm.attach(1);
+        shm.stats()->workers[1].pid.store(getpid());
+        shm.store(big.c_str(), err);
+        _exit(0);
+    }
+    /* content reserved : slot is claimed & the copy is under way */
+    while(shm.stats()->used.load() == used) {
+        sched_yield();
+    }
+    kill(pid, SIGKILL);
+    int status;
+    waitpid(pid, &status, 0);
+    bool killed = WIFSIGNALED(status);
+    if(!killed) {
+        printf("  copy ended before it was killed, nothing to take over\n");
+    }
+    int err = -1;
+    /* not reaped by a master yet : still looks like a running worker */
+    CHECK(shm.store(big.c_str(), err) == NULL || !killed);
+    shm.stats()->workers[1].pid.store(0);
+    file_cache::entry *e = shm.store(big.c_str(), err);
+    CHECK(e != NULL && err == 0 && e->st.st_size == BIG_FILE);
+    CHECK(!killed || shm.stats()->orphans.load() == 1);
+    CHECK(shm.find(big.c_str(), true) == e);
+    unlink(big.c_str());
+}
+
+/* no room : refused, the first time is kept in full */
+static void check_full() {
+    shm_cache shm(2 * SHM_CACHE_PAGE);
+    std::string one = temp_file(SHM_CACHE_PAGE), two = temp_file(2 * SHM_CACHE_PAGE);
+    std::string huge = temp_file(3 * SHM_CACHE_PAGE);
+    int err = -1;
+    /* bigger than the segment : too big, not full */
+    CHECK(shm.store(huge.c_str(), err) == NULL && err == ENOSPC && shm.stats()->full.load() == 0);
+    CHECK(shm.store(one.c_str(), err) != NULL && shm.stats()->full.load() == 0);
+    CHECK(shm.store(two.c_str(), err) == NULL && err == ENOSPC);
+    int64_t full = shm.stats()->full.load();
+    CHECK(full != 0 && shm.stats()->refused.load() == 2);
+    CHECK(shm.store(two.c_str(), err) == NULL && shm.stats()->full.load() == full);
+    CHECK(shm.stats()->dead.load() == 0 && shm.stats()->lost.load() == 0);
+    unlink(one.c_str());
+    unlink(two.c_str());
+    unlink(huge.c_str());
+}
+
+int main() {
+    shm_cache shm(2 * BIG_FILE + (1 << 20), BIG_FILE);
+    shm.stats()->workers[0].pid.store(getpid());
+    check_store(shm);
+    check_dead_loader(shm);
+    check_full();
+    CHECK_DONE();
+}
@@ -0,0 +1,49 @@
+#include <string.h>
+
+#include "check.h"
+#include "tools.h"
+
+using namespace lu;
+
+/* Accept-Encoding value => gzip allowed */
+static const struct {
+    const char *value;
+    bool gzip;
+} encodings[] = {
+    { "gzip", true },
+    { "GZIP", true },
+    { "gzip, deflate, br", true },
+    { "deflate,gzip", true },
+    { "x-gzip", true },
+    { "gzip;q=0.5", true },
+    { "gzip ; q=1.0", true },
+    { "gzip;q=0", false },
+    { "gzip;q=0.000", false },
+    { "gzip; Q=0", false },
+    { "deflate, gzip;q=0, br", false },
+    { "gzip;q=0\r", false },
+    { "*", true },
+    { "*;q=0.1", true },
+    { "*;q=0", false },
+    { "gzip, *;q=0", true }, /* listed explicitly */
+    { "gzip;q=0, *", false },
+    { "identity", false },
+    { "gzipped", false },
+    { "br, x-gzipfoo", false },
+    { "", false },
+};
+
+static void check_accepts_gzip() {
+    for(size_t i = 0; i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+        bool gzip = tools::accepts_gzip(encodings[i].value);
+        if(gzip != encodings[i].gzip) {
+            printf("  \"%s\" => %d, expected %d\n", encodings[i].value, gzip, encodings[i].gzip);
+        }
+        CHECK(gzip == encodings[i].gzip);
+    }
+}
+
+int main() {
+    check_accepts_gzip();
+    CHECK_DONE();
+}
@@ -0,0 +1,275 @@
+/* asset_pack : pack a document root into one bundle served by "app -b".
+ * usage : asset_pack [-z] <dir> <bundle>
+ *     -z  add gzip variant of compressible files when it is smaller */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "bundle.h"
+
+struct asset {
+    std::string path; /* url path */
+    std::string file; /* source file */
+    std::string type; /* content type */
+    std::string body;
+    std::string gz; /* empty if not smaller */
+    time_t mtime;
+    int alias_of; /* index of asset sharing body, -1 if none */
+};
+
+static const char *content_type(const std::string &path, bool &compressible) {
+    static const struct { const char *ext; const char *type; bool compressible; } types[] = {
+        {".html", "text/html", true}, {".htm", "text/html", true}, 
+        {".css", "text/css", true}, {".js", "application/javascript", true}, 
+        {".json", "application/json", true}, {".txt", "text/plain", true}, 
+        {".xml", "application/xml", true}, {".svg", "image/svg+xml", true}, 
+        {".wasm", "application/wasm", true}, {".png", "image/png", false}, 
+        {".jpg", "image/jpeg", false}, {".jpeg", "image/jpeg", false}, 
+        {".gif", "image/gif", false}, {".ico", "image/x-icon", false}, 
+        {".webp", "image/webp", false}, {".woff2", "font/woff2", false}, 
+        {".pdf", "application/pdf", false}
+    };
+    size_t dot = path.rfind('.');
+    if(dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+        for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if(strcasecmp(path.c_str() + dot, types[i].ext) == 0) {
+                compressible = types[i].compressible;
+                return types[i].type;
+            }
+        }
+    }
+    compressible = false;
+    return "application/octet-stream";
+}
+
+static bool read_file(const std::string &file, std::string &out) {
+    FILE *fp = fopen(file.c_str(), "rb");
+    if(fp == NULL) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out.append(buf, n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+/* gzip (not raw deflate) of in, level 9 : packing is done once */
+static bool gzip(const std::string &in, std::string &out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, in.size()) + 32);
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if(ret != Z_STREAM_END) {
+        out.clear(); /* no partial stream */
+        return false;
+    }
+    return true;
+}
+
+/* files under dir, readable by others like the server requires */
+static void walk(const std::string &dir, const std::string &url, std::vector<asset> &assets) {
+    DIR *d = opendir(dir.c_str());
+    if(d == NULL) {
+        perror(dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    for(struct dirent *de = readdir(d); de != NULL; de = readdir(d)) {
+        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            names.push_back(de->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for(size_t i = 0; i < names.size(); i++) {
+        std::string file = dir + "/" + names[i];
+        struct stat st;
+        if(stat(file.c_str(), &st) != 0) {
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            walk(file, url + names[i] + "/", assets);
+        } else if(S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+            asset a;
+            a.path = url + names[i];
+            a.file = file;
+            a.mtime = st.st_mtime;
+            a.alias_of = -1;
+            assets.push_back(a);
+        }
+    }
+}
+
+static std::string headers(size_t len, const std::string &type, bool gz, bool vary) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "Content-Length: %zu\r\nContent-Type: %s\r\n%s%s", len, 
+        type.c_str(), gz ? "Content-Encoding: gzip\r\n" : "", vary ? "Vary: Accept-Encoding\r\n" : "");
+    return buf;
+}
+
+static size_t align(size_t off) {
+    return (off + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+}
+
+int main(int argc, char *argv[]) {
+    bool compress = false;
+    int opt;
+    while((opt = getopt(argc, argv, "z")) != -1) {
+        if(opt != 'z') {
+            printf("usage : %s [-z] <dir> <bundle>\n", argv[0]);
+            return -1;
+        }
+        compress = true;
+    }
+    if(argc - optind != 2) {
+        printf("usage : %s [-z] <dir> <bundle>\n", argv[0]);
+        return -1;
+    }
+    std::string root = argv[optind];
+    while(root.size() > 1 && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+
+    std::vector<asset> assets;
+    walk(root, "/", assets);
+    if(assets.empty()) {
+        printf("no file to pack under %s\n", root.c_str());
+        return -1;
+    }
+    size_t files = assets.size();
+    for(size_t i = 0; i < files; i++) {
+        asset &a = assets[i];
+        if(!read_file(a.file, a.body)) {
+            perror(a.file.c_str());
+            return -1;
+        }
+        bool compressible = false;
+        a.type = content_type(a.path, compressible);
+        /* no variant unless it is complete & smaller */
+        if(compress && compressible && (!gzip(a.body, a.gz) || a.gz.size() >= a.body.size())) {
+            a.gz.clear();
+        }
+        /* dir/ is served by dir/index.html */
+        const char *index = "index.html";
+        if(a.path.size() >= strlen(index) && a.path.compare(a.path.size() - strlen(index), 
+            strlen(index), index) == 0 && a.path[a.path.size() - strlen(index) - 1] == '/') {
+            asset alias;
+            alias.path = a.path.substr(0, a.path.size() - strlen(index));
+            alias.alias_of = i;
+            assets.push_back(alias);
+        }
+    }
+
+    /* header | slots | entries | strings, then page aligned bodies */
+    lu::bundle::header hdr;
+    memcpy(hdr.magic, BUNDLE_MAGIC, 8);
+    hdr.count = assets.size();
+    hdr.slots = 2;
+    while(hdr.slots < hdr.count * 2) {
+        hdr.slots <<= 1;
+    }
+    std::vector<lu::bundle::slot> slots(hdr.slots);
+    std::vector<lu::bundle::entry> entries(hdr.count);
+    memset(&slots[0], 0, slots.size() * sizeof(slots[0]));
+    memset(&entries[0], 0, entries.size() * sizeof(entries[0]));
+
+    size_t off = sizeof(hdr) + slots.size() * sizeof(slots[0]) + entries.size() * sizeof(entries[0]);
+    std::string strings;
+    for(size_t i = 0; i < assets.size(); i++) {
+        const asset &a = assets[i].alias_of < 0 ? assets[i] : assets[assets[i].alias_of];
+        lu::bundle::entry &e = entries[i];
+        e.path_off = off + strings.size();
+        e.path_len = assets[i].path.size();
+        strings += assets[i].path;
+        std::string head = headers(a.body.size(), a.type, false, !a.gz.empty());
+        e.head_off = off + strings.size();
+        e.head_len = head.size();
+        strings += head;
+        if(!a.gz.empty()) {
+            head = headers(a.gz.size(), a.type, true, true);
+            e.gz_head_off = off + strings.size();
+            e.gz_head_len = head.size();
+            strings += head;
+        }
+        e.mtime = a.mtime;
+
+        uint64_t h = lu::bundle::hash(assets[i].path.data(), assets[i].path.size());
+        uint32_t j = h & (hdr.slots - 1);
+        while(slots[j].entry != 0) {
+            j = (j + 1) & (hdr.slots - 1);
+        }
+        slots[j].hash = h;
+        slots[j].entry = i + 1;
+    }
+    off = align(off + strings.size());
+    for(size_t i = 0; i < files; i++) {
+        entries[i].body_off = off;
+        entries[i].body_len = assets[i].body.size();
+        off = align(off + assets[i].body.size());
+        if(!assets[i].gz.empty()) {
+            entries[i].gz_off = off;
+            entries[i].gz_len = assets[i].gz.size();
+            off = align(off + assets[i].gz.size());
+        }
+    }
+    for(size_t i = files; i < assets.size(); i++) {
+        const lu::bundle::entry &src = entries[assets[i].alias_of];
+        entries[i].body_off = src.body_off;
+        entries[i].body_len = src.body_len;
+        entries[i].gz_off = src.gz_off;
+        entries[i].gz_len = src.gz_len;
+    }
+    hdr.size = off;
+
+    std::string out = argv[optind + 1];
+    std::string tmp = out + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if(fp == NULL) {
+        perror(tmp.c_str());
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(&slots[0], sizeof(slots[0]), slots.size(), fp);
+    fwrite(&entries[0], sizeof(entries[0]), entries.size(), fp);
+    fwrite(strings.data(), 1, strings.size(), fp);
+    for(size_t i = 0; i < files; i++) {
+        fseek(fp, entries[i].body_off, SEEK_SET);
+        fwrite(assets[i].body.data(), 1, assets[i].body.size(), fp);
+        if(!assets[i].gz.empty()) {
+            fseek(fp, entries[i].gz_off, SEEK_SET);
+            fwrite(assets[i].gz.data(), 1, assets[i].gz.size(), fp);
+        }
+    }
+    /* bundle size is page aligned, last body is padded */
+    bool ok = ftruncate(fileno(fp), off) == 0;
+    ok = fclose(fp) == 0 && ok;
+    /* replace atomically, a server mapping the old one keeps it */
+    if(!ok || rename(tmp.c_str(), out.c_str()) != 0) {
+        perror(out.c_str());
+        unlink(tmp.c_str());
+        return -1;
+    }
+    printf("%zu files, %zu urls, %lu bytes packed into %s\n", files, assets.size(), 
+        (unsigned long)off, out.c_str());
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# compare.sh : build debug, release (-O3 + LTO) & pgo variants of app and run
+# the same benchmarks against each (make compare).
+# usage : tools/compare.sh [port]
+# benchmarks : webbench on index.html & a replay of resources/ as fast as it
+# goes. app is left built as the pgo variant
+PORT=${1:-18889}
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+build() {
+    make -s $1 > $TMP/build.log 2>&1 || { cat $TMP/build.log; exit 1; }
+    cp app $TMP/app.$2
+}
+make -s clean
+build "" debug
+build release release
+build pgo pgo
+make -s replay || exit 1
+
+(cd resources && find . -type f -printf '%P\n') | awk '
+    { for(i = 0; i < 200; i++) printf "{\"url\": \"/%s\"}\n", $1 }' > $TMP/trace.jsonl
+
+bench() {
+    $TMP/app.$1 -d "$(pwd)/resources" 127.0.0.1 $PORT > $TMP/app.log 2>&1 &
+    pid=$!
+    sleep 1
+    # numbers of 404s or refused connections would compare nothing
+    if ! curl -sf -o /dev/null http://127.0.0.1:$PORT/index.html; then
+        echo "app.$1 does not serve /index.html on port $PORT :"
+        cat $TMP/app.log
+        kill -TERM $pid 2> /dev/null
+        exit 1
+    fi
+    ./webbench-1.5/webbench -c 200 -t 5 http://127.0.0.1:$PORT/index.html 2>&1 \
+        | sed -n 's/^Speed=\([0-9]*\) pages\/min.*/\1/p' > $TMP/wb
+    ./replay -c 64 -s 0 127.0.0.1 $PORT $TMP/trace.jsonl > $TMP/rp
+    kill -TERM $pid
+    wait $pid
+    printf "%-8s %14s %14s %10s %10s\n" $1 $(cat $TMP/wb) \
+        $(sed -n 's/.*, \([0-9]*\) requests\/s.*/\1/p' $TMP/rp) \
+        $(sed -n 's/.*p50 \([0-9.]*\),.*/\1/p' $TMP/rp) \
+        $(sed -n 's/.* p99 \([0-9.]*\),.*/\1/p' $TMP/rp)
+}
+
+printf "%-8s %14s %14s %10s %10s\n" build "webbench/min" "replay/s" "p50 ms" "p99 ms"
+for v in debug release pgo; do
+    bench $v
+done
@@ -0,0 +1,563 @@
+/* replay : send a recorded request trace to a server over keep-alive connctions
+ * with its original timing, & report latency & errors of each url.
+ * usage : replay [-c conns] [-s speed] [-t timeout] [-u urls] <ip> <port> <trace>
+ *     -c  connctions at most, default 64
+ *     -s  speed of trace time, 2 replays twice as fast, 0 sends as fast as it can
+ *     -t  seconds a response may take, default 10
+ *     -u  urls shown in report, the most requested first, default 20
+ * trace is one json object per line :
+ *     {"t": 1666000000.125, "method": "GET", "url": "/index.html", "host": "a.com"}
+ * t is seconds (any origin, the first request is at 0), method & host are
+ * optional. requests are sent when they are due whether earlier ones are
+ * answered or not, so latency counts from due time & includes waiting for
+ * a free connction : a slow server is not hidden by a slow client */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+
+struct request {
+    double at; /* seconds from first request */
+    int url; /* index of url stats */
+    std::string data; /* request bytes */
+    bool head; /* HEAD : response has no body */
+};
+
+struct url_stats {
+    std::string url;
+    std::vector<double> lat; /* seconds, of answered requests */
+    unsigned long status[6]; /* responses by status / 100 */
+    unsigned long errors; /* connect, reset, timeout, bad response */
+};
+
+struct conn {
+    enum STATE { CLOSED = 0, CONNECTING, IDLE, BUSY };
+    int fd;
+    STATE state;
+    int req; /* request in flight, -1 if none */
+    double due; /* due time of it */
+    size_t sent; /* bytes of request sent */
+    bool reused; /* request went on a kept-alive connction */
+    std::string in; /* response bytes not consumed */
+    bool head_done;
+    int status;
+    bool close; /* server closes after response */
+    bool until_eof; /* body ends when server closes */
+    bool chunked;
+    long left; /* body bytes, or bytes of current chunk */
+    bool crlf; /* CRLF after chunk data expected */
+    bool trailer; /* last chunk seen, trailer lines until empty one */
+};
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* value of "key" in a flat json object, unescaped for strings. false if absent */
+static bool json_field(const char *line, const char *key, std::string &out) {
+    std::string k = std::string("\"") + key + "\"";
+    const char *p = strstr(line, k.c_str());
+    while(p != NULL) {
+        const char *q = p + k.size();
+        q += strspn(q, " \t");
+        if(*q == ':') {
+            q++;
+            q += strspn(q, " \t");
+            out.clear();
+            if(*q == '"') {
+                for(q++; *q != '\0' && *q != '"'; q++) {
+                    if(*q == '\\' && q[1] != '\0') {
+                        q++;
+                        out += *q == 'n' ? '\n' : *q == 't' ? '\t' : *q;
+                    } else {
+                        out += *q;
+                    }
+                }
+            } else {
+                size_t n = strcspn(q, ",} \t\r\n");
+                out.assign(q, n);
+            }
+            return true;
+        }
+        p = strstr(p + 1, k.c_str());
+    }
+    return false;
+}
+
+static bool load(const char *file, std::vector<request> &reqs, std::vector<url_stats> &urls,
+    const char *default_host) {
+    FILE *fp = fopen(file, "r");
+    if(fp == NULL) {
+        perror(file);
+        return false;
+    }
+    std::unordered_map<std::string, int> ids;
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    while(getline(&line, &cap, fp) != -1) {
+        lineno++;
+        std::string url, method, host, t;
+        if(strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+        if((!json_field(line, "url", url) && !json_field(line, "path", url)) || url.empty()) {
+            printf("%s:%d : no url\n", file, lineno);
+            continue;
+        }
+        if(!json_field(line, "method", method)) {
+            method = "GET";
+        }
+        if(!json_field(line, "host", host)) {
+            host = default_host;
+        }
+        request r;
+        r.at = json_field(line, "t", t) ? atof(t.c_str()) : 0;
+        r.head = strcasecmp(method.c_str(), "HEAD") == 0;
+        r.data = method + " " + url + " HTTP/1.1\r\nHost: " + host
+            + "\r\nConnection: keep-alive\r\nUser-Agent: replay\r\n\r\n";
+        std::unordered_map<std::string, int>::iterator it = ids.find(url);
+        if(it == ids.end()) {
+            url_stats s;
+            s.url = url;
+            memset(s.status, 0, sizeof(s.status));
+            s.errors = 0;
+            urls.push_back(s);
+            it = ids.insert(std::make_pair(url, (int)urls.size() - 1)).first;
+        }
+        r.url = it->second;
+        reqs.push_back(r);
+    }
+    free(line);
+    fclose(fp);
+    std::stable_sort(reqs.begin(), reqs.end(),
+        [](const request &a, const request &b) { return a.at < b.at; });
+    double origin = reqs.empty() ? 0 : reqs[0].at;
+    for(size_t i = 0; i < reqs.size(); i++) {
+        reqs[i].at -= origin;
+    }
+    return true;
+}
+
+/* response head in c.in : status & how its body ends. 1 done, 0 more bytes, -1 bad */
+static int parse_head(conn &c, const request &r) {
+    size_t end = c.in.find("\r\n\r\n");
+    if(end == std::string::npos) {
+        return c.in.size() > 64 * 1024 ? -1 : 0;
+    }
+    if(c.in.compare(0, 5, "HTTP/") != 0 || c.in.size() < 12) {
+        return -1;
+    }
+    c.status = atoi(c.in.c_str() + 9);
+    c.close = c.in.compare(0, 8, "HTTP/1.0") == 0;
+    c.chunked = false;
+    c.until_eof = true;
+    c.left = 0;
+    for(size_t pos = c.in.find("\r\n") + 2; pos < end; ) {
+        size_t eol = c.in.find("\r\n", pos);
+        const char *h = c.in.c_str() + pos;
+        if(strncasecmp(h, "Content-Length:", 15) == 0) {
+            c.left = atol(h + 15);
+            c.until_eof = false;
+        } else if(strncasecmp(h, "Transfer-Encoding:", 18) == 0 && strstr(h, "chunked") != NULL
+            && strstr(h, "chunked") < c.in.c_str() + eol) {
+            c.chunked = true;
+            c.until_eof = false;
+        } else if(strncasecmp(h, "Connection:", 11) == 0) {
+            h += 11;
+            h += strspn(h, " \t");
+            if(strncasecmp(h, "close", 5) == 0) {
+                c.close = true;
+            } else if(strncasecmp(h, "keep-alive", 10) == 0) {
+                c.close = false;
+            }
+        }
+        pos = eol + 2;
+    }
+    if(r.head || c.status / 100 == 1 || c.status == 204 || c.status == 304) {
+        c.chunked = c.until_eof = false;
+        c.left = 0;
+    }
+    c.in.erase(0, end + 4);
+    c.head_done = true;
+    c.crlf = c.trailer = false;
+    return 1;
+}
+
+/* consume body bytes in c.in. true once the whole body is in */
+static bool parse_body(conn &c) {
+    if(c.until_eof) {
+        c.in.clear();
+        return false;
+    }
+    if(!c.chunked) {
+        long n = std::min<long>(c.left, c.in.size());
+        c.left -= n;
+        c.in.erase(0, n);
+        return c.left == 0;
+    }
+    size_t pos = 0;
+    bool done = false;
+    while(!done) {
+        if(c.left > 0) {
+            long n = std::min<long>(c.left, c.in.size() - pos);
+            pos += n;
+            c.left -= n;
+            if(c.left > 0) {
+                break;
+            }
+            c.crlf = true;
+        }
+        if(c.crlf) {
+            if(c.in.size() - pos < 2) {
+                break;
+            }
+            pos += 2;
+            c.crlf = false;
+        }
+        size_t eol = c.in.find("\r\n", pos);
+        if(eol == std::string::npos) {
+            break;
+        }
+        if(c.trailer) {
+            done = eol == pos; /* empty line ends trailer */
+        } else {
+            c.left = strtol(c.in.c_str() + pos, NULL, 16);
+            c.trailer = c.left == 0;
+        }
+        pos = eol + 2;
+    }
+    c.in.erase(0, pos);
+    return done;
+}
+
+static int connect_to(const sockaddr_in &addr, int epfd, conn *c) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return fd;
+}
+
+/* EPOLLOUT only while connecting or a request is stuck in socket */
+static void arm(int epfd, conn *c, bool out) {
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void usage(const char *prog) {
+    printf("usage : %s [-c conns] [-s speed] [-t timeout] [-u urls] <ip> <port> <trace>\n", prog);
+    printf("    -c <number>   connctions at most, default 64\n");
+    printf("    -s <speed>    speed of trace time, 0 sends as fast as it can, default 1\n");
+    printf("    -t <seconds>  response timeout, default 10\n");
+    printf("    -u <number>   urls in report, default 20\n");
+    printf("trace : one json object per line, {\"t\": <seconds>, \"url\": \"/path\"[, \"method\": ..., \"host\": ...]}\n");
+}
+
+int main(int argc, char *argv[]) {
+    int max_conns = 64;
+    double speed = 1;
+    double timeout = 10;
+    int shown = 20;
+    int opt;
+    while((opt = getopt(argc, argv, "c:s:t:u:")) != -1) {
+        switch(opt) {
+            case 'c': max_conns = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 't': timeout = atof(optarg); break;
+            case 'u': shown = atoi(optarg); break;
+            default: usage(argv[0]); return -1;
+        }
+    }
+    if(argc - optind != 3 || max_conns <= 0 || speed < 0 || timeout <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    if(inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+        printf("bad ip : %s\n", argv[optind]);
+        return -1;
+    }
+    std::vector<request> reqs;
+    std::vector<url_stats> urls;
+    if(!load(argv[optind + 2], reqs, urls, argv[optind]) || reqs.empty()) {
+        printf("no request in trace\n");
+        return -1;
+    }
+    printf("%lu requests of %lu urls over %.3fs of trace time\n",
+        (unsigned long)reqs.size(), (unsigned long)urls.size(), reqs.back().at);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<conn> conns(max_conns);
+    for(int i = 0; i < max_conns; i++) {
+        conns[i].fd = -1;
+        conns[i].state = conn::CLOSED;
+        conns[i].req = -1;
+    }
+    std::deque<int> ready; /* due requests waiting for a connction */
+    size_t next = 0, finished = 0;
+    unsigned long connects = 0;
+    double lag_max = 0; /* how late a request got a connction */
+    double start = now();
+
+    /* response of c is over (ok) or failed, c is free again unless it closed */
+    auto finish = [&](conn &c, bool ok, bool close_it) {
+        url_stats &s = urls[reqs[c.req].url];
+        if(ok) {
+            s.lat.push_back(now() - c.due);
+            s.status[std::min(c.status / 100, 5)]++;
+        } else {
+            s.errors++;
+        }
+        finished++;
+        c.req = -1;
+        c.in.clear();
+        if(close_it) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+            close(c.fd);
+            c.fd = -1;
+            c.state = conn::CLOSED;
+        } else {
+            c.state = conn::IDLE;
+        }
+    };
+    /* c broke before any byte of response came : a kept-alive connction
+     * the server closed meanwhile, request goes again on another one */
+    auto fail = [&](conn &c) {
+        if(c.reused && !c.head_done && c.in.empty()) {
+            ready.push_front(c.req);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+            close(c.fd);
+            c.fd = -1;
+            c.req = -1;
+            c.state = conn::CLOSED;
+            return;
+        }
+        finish(c, false, true);
+    };
+    /* send as much of c's request as socket takes */
+    auto send_req = [&](conn &c) -> bool {
+        const std::string &d = reqs[c.req].data;
+        while(c.sent < d.size()) {
+            ssize_t n = send(c.fd, d.data() + c.sent, d.size() - c.sent, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno == EAGAIN) {
+                    arm(epfd, &c, true);
+                    return true;
+                }
+                return false;
+            }
+            c.sent += n;
+        }
+        arm(epfd, &c, false);
+        return true;
+    };
+
+    epoll_event events[256];
+    while(finished < reqs.size()) {
+        double t = now();
+        while(next < reqs.size() && (speed == 0 || start + reqs[next].at / speed <= t)) {
+            ready.push_back(next++);
+        }
+        /* hand due requests to free connctions, opening new ones up to max */
+        for(int i = 0; i < max_conns && !ready.empty(); i++) {
+            conn &c = conns[i];
+            if(c.state == conn::CLOSED) {
+                c.fd = connect_to(addr, epfd, &c);
+                if(c.fd < 0) {
+                    c.req = ready.front();
+                    ready.pop_front();
+                    c.due = speed == 0 ? start : start + reqs[c.req].at / speed;
+                    finish(c, false, false);
+                    c.state = conn::CLOSED;
+                    continue;
+                }
+                connects++;
+                c.state = conn::CONNECTING;
+            }
+            if(c.req >= 0 || c.state == conn::BUSY) {
+                continue;
+            }
+            c.req = ready.front();
+            ready.pop_front();
+            c.due = speed == 0 ? t : start + reqs[c.req].at / speed;
+            lag_max = std::max(lag_max, t - c.due);
+            c.sent = 0;
+            c.head_done = false;
+            c.reused = c.state == conn::IDLE;
+            if(c.state == conn::IDLE) {
+                c.state = conn::BUSY;
+                if(!send_req(c)) {
+                    fail(c);
+                }
+            }
+        }
+        int wait = 100;
+        if(next < reqs.size() && speed > 0) {
+            double due = start + reqs[next].at / speed - now();
+            wait = due <= 0 ? 0 : std::min(100, (int)(due * 1000) + 1);
+        }
+        if(!ready.empty()) {
+            wait = std::min(wait, 1);
+        }
+        int n = epoll_wait(epfd, events, 256, wait);
+        for(int i = 0; i < n; i++) {
+            conn &c = *(conn *)events[i].data.ptr;
+            if(c.fd < 0) {
+                continue;
+            }
+            if(c.state == conn::CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    if(c.req >= 0) {
+                        finish(c, false, true);
+                    } else {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+                        close(c.fd);
+                        c.fd = -1;
+                        c.state = conn::CLOSED;
+                    }
+                    continue;
+                }
+                c.state = c.req >= 0 ? conn::BUSY : conn::IDLE;
+                if(c.req < 0) {
+                    arm(epfd, &c, false);
+                } else if(!send_req(c)) {
+                    finish(c, false, true);
+                    continue;
+                }
+            }
+            if(c.state == conn::BUSY && c.sent < reqs[c.req].data.size()
+                && (events[i].events & EPOLLOUT) && !send_req(c)) {
+                fail(c);
+                continue;
+            }
+            if(!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+            char buf[65536];
+            bool eof = false;
+            while(true) {
+                ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+                if(r > 0) {
+                    c.in.append(buf, r);
+                    if(c.state == conn::BUSY && c.head_done && !c.chunked) {
+                        parse_body(c); /* keep buffer small on long bodies */
+                    }
+                    continue;
+                }
+                eof = r == 0 || errno != EAGAIN;
+                break;
+            }
+            if(c.state != conn::BUSY) {
+                if(eof) { /* idle keep-alive closed by server */
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+                    close(c.fd);
+                    c.fd = -1;
+                    c.state = conn::CLOSED;
+                }
+                continue;
+            }
+            int head = c.head_done ? 1 : parse_head(c, reqs[c.req]);
+            if(head < 0) {
+                finish(c, false, true);
+                continue;
+            }
+            if(head > 0 && parse_body(c)) {
+                finish(c, true, c.close || eof);
+            } else if(eof && head > 0 && c.until_eof) {
+                finish(c, true, true);
+            } else if(eof) {
+                fail(c);
+            }
+        }
+        /* requests past timeout count as errors, their connctions are dropped */
+        t = now();
+        for(int i = 0; i < max_conns; i++) {
+            if(conns[i].req >= 0 && conns[i].state != conn::CLOSED && t - conns[i].due > timeout) {
+                finish(conns[i], false, true);
+            }
+        }
+    }
+    double elapsed = now() - start;
+    for(int i = 0; i < max_conns; i++) {
+        if(conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+
+    /* report : whole trace, then urls by requests */
+    std::vector<double> all;
+    unsigned long errors = 0, status[6] = {0};
+    for(size_t i = 0; i < urls.size(); i++) {
+        all.insert(all.end(), urls[i].lat.begin(), urls[i].lat.end());
+        errors += urls[i].errors;
+        for(int k = 0; k < 6; k++) {
+            status[k] += urls[i].status[k];
+        }
+    }
+    auto pct = [](std::vector<double> &v, double p) -> double {
+        if(v.empty()) {
+            return 0;
+        }
+        size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+        return v[i] * 1000;
+    };
+    std::sort(all.begin(), all.end());
+    printf("%.3fs, %.0f requests/s, %lu connects, %.1fms worst wait for a connction\n",
+        elapsed, reqs.size() / elapsed, connects, lag_max * 1000);
+    printf("2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, errors %lu\n",
+        status[2], status[3], status[4], status[5], errors);
+    printf("latency ms : p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n\n",
+        pct(all, 0.5), pct(all, 0.9), pct(all, 0.99), pct(all, 0.999), pct(all, 1));
+    std::vector<int> order(urls.size());
+    for(size_t i = 0; i < urls.size(); i++) {
+        order[i] = i;
+        std::sort(urls[i].lat.begin(), urls[i].lat.end());
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return urls[a].lat.size() + urls[a].errors > urls[b].lat.size() + urls[b].errors;
+    });
+    printf("%8s %8s %8s %8s %8s %8s  %s\n", "requests", "non-2xx", "errors", "p50 ms", "p99 ms", "max ms", "url");
+    for(int k = 0; k < (int)order.size() && k < shown; k++) {
+        url_stats &s = urls[order[k]];
+        printf("%8lu %8lu %8lu %8.2f %8.2f %8.2f  %s\n", s.lat.size() + s.errors,
+            s.lat.size() - s.status[2], s.errors, pct(s.lat, 0.5), pct(s.lat, 0.99),
+            pct(s.lat, 1), s.url.c_str());
+    }
+    return errors > 0 ? 1 : 0;
+}
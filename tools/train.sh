@@ -0,0 +1,53 @@
+#!/bin/sh
+# train.sh : representative load for the profile guided build (make pgo).
+# usage : tools/train.sh <app> [port]
+# app serves resources/ (-d) on loopback, once with requests handed to
+# working threads & once answered inline on reactor thread. load is a replay
+# of every file of resources/ (small ones more often, each also by a path to
+# canonicalize & as a miss, plus traversal attempts) & a webbench burst on
+# index.html. app is stopped by SIGTERM, so its profile is written on exit
+APP=${1:-./app}
+PORT=${2:-18888}
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+make -s replay || exit 1
+[ -x ./webbench-1.5/webbench ] || make -s -C webbench-1.5 webbench || exit 1
+
+# trace : urls of document root weighted by size, bad & missing urls
+(cd resources && find . -type f -printf '%s %P\n') | awk '
+    { w = $1 <= 65536 ? 20 : 2
+      for(i = 0; i < w; i++) {
+          printf "{\"t\": %d, \"url\": \"/%s\"}\n", n++, $2
+      }
+      printf "{\"t\": %d, \"url\": \"/./%s\"}\n", n++, $2
+      printf "{\"t\": %d, \"url\": \"/missing/%s\"}\n", n++, $2 }
+    END {
+      for(i = 0; i < 50; i++) {
+          printf "{\"t\": %d, \"url\": \"/%%2e%%2e/etc/passwd\"}\n", n++
+          printf "{\"t\": %d, \"url\": \"/images/../index.html?x=%d\"}\n", n++, i
+      }
+    }' > $TMP/once.jsonl
+for i in 1 2 3 4 5 6 7 8 9 10; do cat $TMP/once.jsonl; done > $TMP/trace.jsonl
+
+run() {
+    "$APP" -d "$(pwd)/resources" "$@" 127.0.0.1 $PORT > $TMP/app.log 2>&1 &
+    pid=$!
+    sleep 1
+    # a profile of 404s & refused connections would train the wrong paths
+    if ! curl -sf -o /dev/null http://127.0.0.1:$PORT/index.html; then
+        echo "app does not serve /index.html on port $PORT :"
+        cat $TMP/app.log
+        kill -TERM $pid 2> /dev/null
+        exit 1
+    fi
+    ./replay -c 64 -s 0 127.0.0.1 $PORT $TMP/trace.jsonl | head -3
+    ./webbench-1.5/webbench -c 64 -t 3 http://127.0.0.1:$PORT/index.html 2>&1 | grep Speed
+    kill -TERM $pid
+    wait $pid
+}
+
+echo "training : threads"
+run
+echo "training : inline"
+run -i